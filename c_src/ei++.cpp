@@ -139,6 +139,9 @@ int Serializer::read()
     int len = m_readPacketSz;
     m_readOffset = m_readPacketSz = 0;
 
+    if (m_hook)
+        m_hook(true, &m_rbuf, len, m_hookArg);
+
     /* Ensure that we are receiving the binary term by reading and
      * stripping the version byte */
     int version;
@@ -155,6 +158,8 @@ int Serializer::write()
         m_wbuf.write_header(static_cast<size_t>(m_wIdx));
         if (m_debug)
             dump(std::cerr, true);
+        if (m_hook)
+            m_hook(false, &m_wbuf, m_wIdx, m_hookArg);
 
         m_writePacketSz = m_wIdx+m_wbuf.headerSize();
         m_writeOffset = 0;
@@ -117,7 +117,7 @@ namespace ei {
         void   packetHeaderSize(size_t sz) {
             assert(sz == 0 || sz == 1 || sz == 2 || sz == 4);
             m_headerSize = sz;
-            m_maxMsgSize = (1u << (8*m_headerSize)) - 1;
+            m_maxMsgSize = (size_t)((1ull << (8*m_headerSize)) - 1);
         }
         /// Does the buffer have memory allocated on heap?
         bool   allocated()  const               { return m_buffer != m_buff; }
@@ -350,6 +350,12 @@ namespace ei {
     /// Erlang distribution.
     class Serializer
     {
+    public:
+        /// Callback invoked with the content of every packet read or written
+        /// (excluding the packet header).
+        typedef void (*PacketHook)(bool inbound, const char* data, size_t len, void* arg);
+
+    private:
         StringBuffer<1024> m_wbuf;  // for writing output commands
         StringBuffer<1024> m_rbuf;  // for reading input commands
         size_t  m_readOffset,   m_writeOffset;
@@ -357,6 +363,8 @@ namespace ei {
         int     m_wIdx, m_rIdx, m_rsize;
         int     m_fin,  m_fout;
         bool    m_debug;
+        PacketHook m_hook;
+        void*   m_hookArg;
 
         void wcheck(int n) {
             if (m_wbuf.resize(m_wIdx + n + 16, true) == NULL)
@@ -375,6 +383,7 @@ namespace ei {
             , m_readPacketSz(0), m_writePacketSz(0)
             , m_wIdx(0), m_rIdx(0), m_rsize(0)
             , m_fin(0), m_fout(1), m_debug(false)
+            , m_hook(NULL), m_hookArg(NULL)
             , tuple(*this)
         {
             ei_encode_version(&m_wbuf, &m_wIdx);
@@ -393,6 +402,8 @@ namespace ei {
             reset_wbuf(_saveVersion);
         }
         void debug(bool _enable)            { m_debug = _enable; }
+        /// Install a callback tapping every packet read or written.
+        void hook(PacketHook fun, void* arg = NULL) { m_hook = fun; m_hookArg = arg; }
 
         // This is a helper class for encoding tuples using streaming operator.
         // Example: encode {ok, 123, "test"}
@@ -472,6 +483,8 @@ namespace ei {
         void encodeTupleSize(int sz)        { wcheck(5);           ei_encode_tuple_header(&m_wbuf, &m_wIdx, sz); }
         void encodeListSize(int sz)         { wcheck(5);           ei_encode_list_header(&m_wbuf, &m_wIdx, sz); }
         void encodeListEnd()                { wcheck(1);           ei_encode_empty_list(&m_wbuf, &m_wIdx); }
+        /// Append a term already encoded in the external format (without the version byte)
+        void encodeTerm(const char* p, int sz) { wcheck(sz);       memcpy(&m_wbuf + m_wIdx, p, sz); m_wIdx += sz; }
 
         int  encodeListBegin()              { wcheck(5); int n=m_wIdx; ei_encode_list_header(&m_wbuf, &m_wIdx, 1); return n; }
         /// This function for encoding the list size after all elements are encoded.
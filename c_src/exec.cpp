@@ -24,6 +24,10 @@
                   {list}                            |
                   {stop, OsPid::integer()}          |
                   {kill, OsPid::integer(), Signal::integer()} |
+                  {stop_tag, Tag::string()}         |
+                  {kill_tag, Tag::string(), Signal::integer()} |
+                  {list_tag, Tag::string()}         |
+                  {tag_stats, Tag::string()}        |
                   {stdin, OsPid::integer(), Data::binary()}
 
     Options = [Option]
@@ -34,21 +38,74 @@
               {group, integer() | string()} |
               {user, User::string()} |
               {nice, Priority::integer()} |
+              setsid |
+              {tags, [Tag::string()]} |
+              {cpu_affinity, [Cpu::integer()]} | {numa_node, Node::integer()} |
+              {ioprio, realtime | best_effort | idle, Level::integer()} |
+              {sched_policy, other | batch | idle} | {sched_policy, fifo | rr, Priority::integer()} |
+              {perf_counters, [PerfEvent::atom()]} |
+              sync   | {sync, MaxBytes::integer()} |
               stdin  | {stdin, null | close | File::string()} |
-              stdout | {stdout, Device::string()} |
-              stderr | {stderr, Device::string()} |
+              stdout | {stdout, Device::string()} | {stdout, [StreamOpt]} |
+              stderr | {stderr, Device::string()} | {stderr, [StreamOpt]} |
 
-    Device  = close | null | stderr | stdout | File::string() | {append, File::string()}
+    Device  = close | null | stderr | stdout | File::string() | {append, File::string()} |
+              {tail, Bytes::integer()} |
+              {tee, File::string() | {append, File::string()}, erlang | {tail, Bytes::integer()}} |
+              {rotate, File::string(), [RotateOpt]} |
+              {spool, File::string(), [SpoolOpt]}
+
+    RotateOpt = {size, Bytes::integer()} | {time, Sec::integer()} |
+                {count, Files::integer()} | {buffer, Bytes::integer()}
+
+    SpoolOpt  = {progress, Bytes::integer()} | {buffer, Bytes::integer()}
+
+    StreamOpt = {framing, line | {delimiter, Byte::integer()} | {packet, 1 | 2 | 4}} |
+                {max_record, Bytes::integer()} |
+                {include, [Regex::binary()]} | {exclude, [Regex::binary()]} |
+                {compress, Level::integer()} | {compress_flush, Bytes::integer()}
+
+    PerfEvent = cycles | instructions | cache_references | cache_misses |
+                branches | branch_misses | task_clock | page_faults |
+                context_switches | cpu_migrations
 
     Reply = ok                      |       // For kill/stop commands
             {ok, OsPid}             |       // For run/shell command
+            {ok, Status, Stdout::binary(), Stderr::binary()} |       // For run/shell
+            {ok, Status, Stdout::binary(), Stderr::binary(), Info} | // with sync option
             {ok, [OsPid]}           |       // For list command
+            {ok, Count::integer()}  |       // For stop_tag/kill_tag commands
+            {ok, [{count | cpu_usec | rss, N::integer()}]} | // For tag_stats command
             {error, Reason}         |
             {exit_status, OsPid, Status}    // OsPid terminated with Status
+            {exit_status, OsPid, Status, Info}
+
+    Output = {stdout | stderr, OsPid, Data::binary()} |
+             {stdout | stderr, OsPid, [Record::binary()]} | // Framed output
+             {spooled, OsPid, File::string(), Bytes::integer()} |
+             {msg, OsPid, Term::binary()}   // Term sent by the child ({msg, Fd})
 
     Reason = atom() | string()
     OsPid  = integer()
     Status = integer()
+    Info   = [{perf_counters, [{PerfEvent, Count::integer()}]} |
+              {dropped, [{stdout | stderr, Records::integer(), Bytes::integer()}]} |
+              {stdout_tail | stderr_tail, LastBytes::binary()} |
+              {truncated, [{stdout | stderr, Bytes::integer()}]}]   // Over sync limit
+
+    Static tracepoints:
+        When compiled with HAVE_SDT (sys/sdt.h from SystemTap is available),
+        the program contains the following USDT probes of the "exec" provider
+        that can be traced with bpftrace, perf or stap:
+
+        cmd_recv    (long TransId, const char* Cmd)     Command received from Erlang
+        cmd_reply   (long TransId, const char* Cmd)     Command processed and replied to
+        spawn_start (const char* Cmd)                   About to fork(2) a child
+        spawn_end   (int OsPid, const char* Cmd)        Child forked (OsPid < 0 on failure)
+        child_reap  (int OsPid, int Status)             Exit of a child reported to Erlang
+        output_read (int OsPid, int Fd, int Bytes)      Read from child's stdout (1) or stderr (2)
+        input_write (int OsPid, int Bytes, int Left)    Write to child's stdin with Left
+                                                        bytes remaining in the head chunk
 */
 
 #include <stdio.h>
@@ -62,18 +119,46 @@
 #include <sys/capability.h>
 #endif
 
+#ifdef __linux__
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <linux/sched.h>
+#include <linux/mempolicy.h>
+#include <sched.h>
+#endif
+
+#ifdef HAVE_SDT
+#include <sys/sdt.h>
+#define EXEC_PROBE1(name, a1)           DTRACE_PROBE1(exec, name, a1)
+#define EXEC_PROBE2(name, a1, a2)       DTRACE_PROBE2(exec, name, a1, a2)
+#define EXEC_PROBE3(name, a1, a2, a3)   DTRACE_PROBE3(exec, name, a1, a2, a3)
+#else
+#define EXEC_PROBE1(name, a1)
+#define EXEC_PROBE2(name, a1, a2)
+#define EXEC_PROBE3(name, a1, a2, a3)
+#endif
+
 #include <assert.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/time.h>
+#include <sys/resource.h>
 #include <setjmp.h>
 #include <limits.h>
 #include <grp.h>
 #include <pwd.h>
 #include <fcntl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <regex.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
 #include <map>
 #include <list>
 #include <deque>
+#include <algorithm>
 #include <sstream>
 
 #include <ei.h>
@@ -95,13 +180,69 @@ using namespace ei;
  * seconds and then *really* kill it with SIGKILL if needs be.  */
 #define KILL_TIMEOUT_SEC 5
 
+/* Default and maximum length of a record of framed output, and the maximum
+ * payload of a batch of records sent to Erlang. */
+#define DEF_MAX_RECORD  16384
+#define MAX_BATCH_SIZE  60000
+
+/* Default and maximum input size between sync flushes of compressed output */
+#define DEF_COMPRESS_FLUSH  (64*1024)
+#define MAX_COMPRESS_FLUSH  (16*1024*1024)
+
+/* Maximum size of the tail of output retained by {Stream, {tail, Bytes}} */
+#define MAX_TAIL_SIZE   (1024*1024)
+
+/* Defaults of output written to a file by the port program ({rotate, File, Opts}) */
+#define DEF_SINK_BUFFER     (64*1024)           // Write buffer size
+#define MAX_SINK_BUFFER     (16*1024*1024)
+#define DEF_ROTATE_SIZE     (10*1024*1024)      // Rotate the file at this size
+#define DEF_ROTATE_COUNT    5                   // Number of rotated files kept
+#define SINK_FLUSH_SEC      1                   // Max age of unflushed data
+#define SINK_ALIGN          4096                // Alignment of the write buffer
+#define DEF_SPOOL_BUFFER    (1024*1024)         // Write buffer size of {spool, File, Opts}
+#define SPOOL_REPORT_SEC    1                   // Min interval of spool progress reports
+
+/* Default and maximum size of each output stream collected by the sync option */
+#define DEF_SYNC_LIMIT  (1024*1024)
+#define MAX_SYNC_LIMIT  (64*1024*1024)
+
+/* Select timeout while output of a child is held back by {output_rate, Bytes} */
+#define RATE_POLL_USEC  20000
+
+/* Default child's fd and maximum size of a message of the {msg, Fd} channel */
+#define DEF_MSG_FD      3
+#define MAX_MSG_SIZE    (16*1024*1024)
+
+/* Default time a RUN request waits for admission, and the interval of checking
+ * queued requests for expiry and the host load for admission */
+#define DEF_QUEUE_TIMEOUT   25
+#define QUEUE_CHECK_SEC     1
+#define HOST_CHECK_MSEC     100
+
+/* Max size of a response of a pool worker, and the min interval between
+ * restarts of dead workers of a pool */
+#define MAX_POOL_RESPONSE   (64*1024*1024)
+#define POOL_RESTART_MSEC   100
+
+/* The backoff of a restarted command is doubled on every restart within
+ * the restart window at most this many times */
+#define MAX_BACKOFF_SHIFT   16
+
+/* CPU time of a child killed by its cpu_limit reported by wait4(2) may be
+ * short of the limit by this much */
+#define CPU_LIMIT_SLACK_USEC 100000
+
+#ifndef ERL_MAP_EXT
+#define ERL_MAP_EXT     't'
+#endif
+
 //-------------------------------------------------------------------------
 // Global variables
 //-------------------------------------------------------------------------
 
 extern char **environ; // process environment
 
-ei::Serializer eis(/* packet header size */ 2);
+ei::Serializer eis(/* packet header size */ 4);
 
 sigjmp_buf  jbuf;
 static int  alarm_max_time  = 12;
@@ -112,12 +253,84 @@ static bool superuser       = false;
 static bool pipe_valid      = true;
 static int  max_fds;
 static int  dev_null;
+static FILE* capture_file   = NULL;  // Protocol capture file (see -capture option)
+static int  max_jobs        = 0;     // Max number of running commands (0 - unlimited)
+static double max_load      = 0;     // Hold back commands over this 1-min load average
+static double max_mem_pressure = 0;  // Hold back commands over this memory pressure (%)
+static std::string cgroup_root;      // Delegated cgroup v2 directory of children (see -cgroup option)
+static bool subreaper       = false; // Reap orphaned descendants and run children in own sessions
 
 //-------------------------------------------------------------------------
 // Types & variables
 //-------------------------------------------------------------------------
 
 class CmdInfo;
+class CmdOptions;
+
+/// A RUN request held back by admission control
+struct PendingRun {
+    long            trans_id;
+    ei::TimeVal     deadline;       // Time the request expires (zero - never)
+    CmdOptions*     opts;
+};
+
+/// A request waiting for an idle worker of a pool
+struct PoolRequest {
+    long            trans_id;
+    std::string     data;
+};
+
+/// Long-running workers started with the same options.  A request is
+/// written to stdin of an idle worker as <<Len:32, Request/binary>> and
+/// the worker writes its response to stdout in the same format.
+struct WorkerPool {
+    CmdOptions*     opts;           // Options of (re)started workers
+    int             size;
+    int             missing;        // Number of workers to (re)start
+    ei::TimeVal     restart_time;   // Last time dead workers were restarted
+    std::list<pid_t>        idle;   // Workers waiting for a request
+    std::deque<PoolRequest> queue;  // Requests waiting for an idle worker
+
+    WorkerPool() : opts(NULL), size(0), missing(0) {}
+};
+
+/// A command of a job dependency graph
+struct DagNode {
+    enum StateT { PENDING, RUNNING, DONE, CANCELLED };
+
+    std::string     id;             // Node id in the external term format
+    CmdOptions*     opts;           // Options of the command (freed when started)
+    StateT          state;
+    pid_t           pid;
+    int             waiting;        // Number of predecessors that haven't exited yet
+    std::list<int>  next;           // Nodes depending on this one
+
+    DagNode() : opts(NULL), state(PENDING), pid(0), waiting(0) {}
+};
+
+/// Outcome of a node of a job dependency graph not yet reported to Erlang
+struct DagEvent {
+    enum TypeT { EXITED, CANCELLED, FAILED };
+
+    int             node;
+    TypeT           type;
+    int             status;         // Exit status (EXITED)
+    std::string     error;          // Reason the command didn't start (FAILED)
+};
+
+/// A job dependency graph.  A node starts when all its predecessors exit
+/// with status 0, and is cancelled with all its dependants otherwise.
+struct Dag {
+    std::deque<DagNode>     nodes;
+    std::deque<int>         ready;          // Nodes that can be started
+    std::list<DagEvent>     events;         // Outcomes reported in the next batch
+    int                     max_parallel;   // Max number of running nodes (0 - unlimited)
+    int                     running;
+    int                     left;           // Nodes that haven't exited or been cancelled
+    bool                    failed;
+
+    Dag() : max_parallel(0), running(0), left(0), failed(false) {}
+};
 
 typedef unsigned char byte;
 typedef int   exit_status_t;
@@ -129,15 +342,326 @@ typedef std::pair<kill_cmd_pid_t, pid_t>    KillPidStatusT;
 typedef std::map <kill_cmd_pid_t, pid_t>    MapKillPidT;
 typedef std::map<std::string, std::string>  MapEnv;
 typedef typename MapEnv::iterator           MapEnvIterator;
+typedef std::pair<int, long>                PendingKeyT;    // {-Priority, Sequence}
+typedef std::map <PendingKeyT, PendingRun>  MapPendingT;
+typedef std::map <std::string, int>         MapJobClassT;
+typedef std::map <std::string, WorkerPool>  MapPoolT;
+typedef std::map <long, Dag>                MapDagT;
+typedef std::multimap<TimeVal, pid_t>       MapTimeoutT;
+typedef std::map <std::string, int>         MapCgroupT;
 
 MapChildrenT children;              // Map containing all managed processes started by this port program.
 MapKillPidT  transient_pids;        // Map of pids of custom kill commands.
+MapPendingT  pending_runs;          // RUN requests waiting for admission in priority order.
+MapJobClassT class_jobs;            // Number of running commands of each job class.
+static int   running_jobs = 0;      // Number of running commands started by RUN requests.
+static long  pending_seq  = 0;      // Keeps the order of pending requests of the same priority.
+MapPoolT     pools;                 // Pools of workers serving requests of exec:call().
+MapDagT      dags;                  // Job dependency graphs being executed.
+static long  dag_seq      = 0;      // Id of the last started job dependency graph.
+std::list<pid_t> restart_pending;   // Exited children waiting for a restart by their policy.
+MapTimeoutT  timeouts;              // Wall-clock deadlines of children with the timeout option.
+MapCgroupT   cgroups;               // Number of children in each named cgroup.
+static long  cgroup_seq   = 0;      // Id of the last cgroup created for a single child.
 
 #define SIGCHLD_MAX_SIZE 4096
 std::list< PidStatusT > exited_children;  // deque of processed SIGCHLD events
+std::map<pid_t, long long> exited_cpu;    // CPU time (usec) of reaped children
 
 const char* CS_DEV_NULL = "/dev/null";
 
+// Magic header of a protocol capture file. It's followed by records:
+//   <<Dir:8, MonotonicTimeNs:64, Len:32, Packet:Len/binary>>
+// where Dir is 'I' for packets received from Erlang and 'O' for packets sent
+// to Erlang, and Packet is the external term format of the message.
+const char  CAPTURE_MAGIC[] = "EXECCAP1";
+
+#ifdef __linux__
+// Hardware and software events that can be counted for a child
+// with the {perf_counters, [Event]} option.
+struct PerfEventT {
+    const char* name;
+    unsigned    type;
+    unsigned    config;
+};
+
+const PerfEventT perf_events[] = {
+    { "cycles",             PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES          },
+    { "instructions",       PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS        },
+    { "cache_references",   PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES    },
+    { "cache_misses",       PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES        },
+    { "branches",           PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS },
+    { "branch_misses",      PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES       },
+    { "task_clock",         PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK          },
+    { "page_faults",        PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS         },
+    { "context_switches",   PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES    },
+    { "cpu_migrations",     PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS      }
+};
+
+/// Scheduling policies of {sched_policy, Policy} and {sched_policy, Policy, Priority}
+struct SchedPolicyT {
+    const char* name;
+    int         policy;
+    bool        realtime;       // Policy takes a static priority
+};
+
+const SchedPolicyT sched_policies[] = {
+    { "other",  SCHED_OTHER,    false },
+    { "batch",  SCHED_BATCH,    false },
+    { "idle",   SCHED_IDLE,     false },
+    { "fifo",   SCHED_FIFO,     true  },
+    { "rr",     SCHED_RR,       true  }
+};
+
+// I/O scheduling classes of {ioprio, Class, Level} in the order of
+// their IOPRIO_CLASS_* values starting from 1 (see ioprio_set(2))
+const char* ioprio_classes[] = { "realtime", "best_effort", "idle" };
+const int   IOPRIO_SHIFT     = 13;  // Class bits of an I/O priority value
+const int   IOPRIO_PROCESS   = 1;   // IOPRIO_WHO_PROCESS
+const int   MAX_NUMA_NODES   = 1024;
+
+// CPU affinity of the port program at startup.  When the port program is
+// pinned with "-port_cpu_affinity", its children get this affinity back.
+static cpu_set_t child_cpus;
+static bool      port_pinned = false;
+#endif
+
+enum FramingType {
+    FRAMING_NONE,           // Output is sent as it's read
+    FRAMING_DELIMITER,      // Records are terminated by a delimiter byte
+    FRAMING_PACKET          // Records are prefixed with a big-endian length header
+};
+
+/// Policy of {restart, Policy, MaxRestarts, WithinSec, BackoffMsec}
+enum RestartPolicy {
+    RESTART_NEVER,
+    RESTART_PERMANENT,      // Restart the command whenever it exits
+    RESTART_TRANSIENT       // Restart the command when it exits with non-zero status
+};
+
+/// Action taken when a child's output exceeds {max_output, Bytes, Action}
+enum OutputLimitAction {
+    LIMIT_TRUNCATE,         // Discard the rest of output
+    LIMIT_DROP,             // Close the stdout/stderr pipes of the child
+    LIMIT_KILL              // Stop the child and discard the rest of output
+};
+
+typedef std::list<regex_t*>                 RegexListT;
+
+/// Splits the output stream of a child into records and filters them.
+/// Compiled patterns are shallow-copied and released by free_filters().
+struct StreamFraming {
+    FramingType     type;
+    char            delim;          // Record delimiter (FRAMING_DELIMITER)
+    int             hdr_size;       // Size of the length header (FRAMING_PACKET)
+    size_t          max_record;     // Longer records are split in pieces of this size
+    std::string     pending;        // Incomplete record carried over between reads
+    size_t          remaining;      // Bytes of the current packet not yet read
+    int             hdr_got;        // Bytes of the length header read so far
+    unsigned char   hdr[4];
+    RegexListT      include;        // Only deliver records matching one of these
+    RegexListT      exclude;        // Don't deliver records matching any of these
+    long long       dropped_records;
+    long long       dropped_bytes;
+
+    StreamFraming()
+        : type(FRAMING_NONE), delim('\n'), hdr_size(0), max_record(DEF_MAX_RECORD)
+        , remaining(0), hdr_got(0), dropped_records(0), dropped_bytes(0)
+    {}
+
+    bool filtered() const { return !include.empty() || !exclude.empty(); }
+
+    /// Returns true if the record passes include/exclude filters
+    bool accept(const char* data, size_t len) {
+        bool ok = include.empty();
+        for (RegexListT::const_iterator it=include.begin(); !ok && it != include.end(); ++it)
+            ok = match(*it, data, len);
+        for (RegexListT::const_iterator it=exclude.begin(); ok && it != exclude.end(); ++it)
+            ok = !match(*it, data, len);
+        if (!ok) {
+            dropped_records++;
+            dropped_bytes += len;
+        }
+        return ok;
+    }
+
+    void free_filters() {
+        for (RegexListT::iterator it=include.begin(); it != include.end(); ++it) { regfree(*it); delete *it; }
+        for (RegexListT::iterator it=exclude.begin(); it != exclude.end(); ++it) { regfree(*it); delete *it; }
+        include.clear();
+        exclude.clear();
+    }
+
+private:
+    static bool match(const regex_t* re, const char* data, size_t len) {
+        #ifdef REG_STARTEND
+        regmatch_t m;
+        m.rm_so = 0;
+        m.rm_eo = len;
+        return regexec(re, data, 1, &m, REG_STARTEND) == 0;
+        #else
+        std::string s(data, len);
+        return regexec(re, s.c_str(), 0, NULL, 0) == 0;
+        #endif
+    }
+};
+
+/// Zlib compression of output sent to Erlang (see {compress, Level} stream
+/// option). The data sent in a sequence of {Stream, OsPid, Data} messages
+/// forms a single zlib stream which is sync-flushed every <flush_bytes>
+/// of input (or when output is idle) and finished when the stream closes.
+struct StreamCompressor {
+    int             level;          // Compression level (-1 - disabled)
+    size_t          flush_bytes;    // Sync-flush after this many input bytes
+    size_t          pending;        // Input bytes since the last flush
+    time_t          pending_time;   // Arrival time of the oldest unflushed input
+    std::string     out;            // Compressed data not sent yet
+    bool            finished;
+    #ifdef HAVE_ZLIB
+    z_stream*       zs;             // Allocated by init()
+    #endif
+
+    StreamCompressor()
+        : level(-1), flush_bytes(DEF_COMPRESS_FLUSH), pending(0), pending_time(0), finished(false)
+        #ifdef HAVE_ZLIB
+        , zs(NULL)
+        #endif
+    {}
+
+    bool active() const { return level >= 0 && !finished; }
+
+    int  init();
+    /// Compress <len> bytes of <data> using <mode> (Z_NO_FLUSH, Z_SYNC_FLUSH
+    /// or Z_FINISH) and append the output to <out>
+    int  deflate(const char* data, size_t len, int mode, std::string& out);
+    void free();
+};
+
+/// Ring buffer retaining the last <capacity> bytes of output
+struct TailBuffer {
+    size_t          capacity;
+    size_t          pos;            // Next write position
+    bool            wrapped;
+    std::string     data;           // Allocated on first write
+
+    TailBuffer(size_t cap = 0) : capacity(cap), pos(0), wrapped(false) {}
+
+    void append(const char* p, size_t len) {
+        if (data.empty())
+            data.resize(capacity);
+        if (len >= capacity) {
+            memcpy(&data[0], p + len - capacity, capacity);
+            pos     = 0;
+            wrapped = true;
+            return;
+        }
+        size_t n = std::min(len, capacity - pos);
+        memcpy(&data[pos], p, n);
+        memcpy(&data[0], p + n, len - n);
+        if (len - n > 0 || pos + n == capacity)
+            wrapped = true;
+        pos = (pos + len) % capacity;
+    }
+
+    std::string str() const {
+        if (!wrapped)
+            return data.substr(0, pos);
+        return data.substr(pos) + data.substr(0, pos);
+    }
+};
+
+/// Settings of the cgroup v2 group of a child (see {cgroup, [Opt]})
+struct CgroupSpec {
+    bool            enabled;
+    std::string     name;           // Group shared by commands (empty - own group of the command)
+    long            cpu_quota;      // cpu.max quota in usec (0 - unlimited)
+    long            cpu_period;     // cpu.max period in usec
+    long            cpu_weight;     // cpu.weight (0 - default)
+    long long       memory_max;     // memory.max in bytes (0 - unlimited)
+    long            pids_max;       // pids.max (0 - unlimited)
+    std::string     io_max;         // io.max limits, e.g. "8:0 rbps=1048576 wiops=120"
+
+    CgroupSpec()
+        : enabled(false), cpu_quota(0), cpu_period(100000), cpu_weight(0)
+        , memory_max(0), pids_max(0)
+    {}
+};
+
+/// Copy of a child's output written to a file by the port program
+/// in addition to delivering it to Erlang (see {Stream, {tee, File, Sink}}).
+/// On Linux the data is duplicated with tee(2) into an internal pipe and moved
+/// to the file with splice(2) without copying it through user space.
+struct TeeSink {
+    int             file_fd;
+    int             dup_fd[2];      // Pipe receiving a duplicate of spliced data
+    bool            copy;           // Copy data with read(2)/write(2)
+
+    TeeSink() : file_fd(-1), copy(true) { dup_fd[0] = dup_fd[1] = -1; }
+
+    bool active() const { return file_fd >= 0; }
+
+    /// Read up to <len> bytes of the child's output from <fd> into <buf>
+    /// and write them to the file. Returns the result of read(2).
+    int read(int fd, char* buf, size_t len);
+
+    void close() {
+        if (file_fd   >= 0) ::close(file_fd);
+        if (dup_fd[0] >= 0) ::close(dup_fd[0]);
+        if (dup_fd[1] >= 0) ::close(dup_fd[1]);
+        file_fd = dup_fd[0] = dup_fd[1] = -1;
+    }
+};
+
+/// Output of a child written by the port program to a file with large
+/// buffered writes and rotated when it reaches a size or age limit
+/// (see {Stream, {rotate, File, Opts}}), or spooled to a file with progress
+/// reported to Erlang (see {Stream, {spool, File, Opts}})
+struct FileSink {
+    std::string     path;
+    int             fd;
+    char*           buf;            // Write buffer (allocated by open())
+    size_t          buf_size;
+    size_t          buf_len;
+    time_t          buf_time;       // Arrival time of the oldest unflushed data
+    unsigned long long size;        // Size of the current file
+    unsigned long long max_size;    // Rotate the file at this size (0 - never)
+    int             max_age;        // Rotate the file after Sec (0 - never)
+    int             count;          // Number of rotated files kept
+    time_t          opened;         // Time the current file was opened
+    bool            spool;          // Truncate the file and never rotate it
+    unsigned long long progress;    // Report spooled size every <progress> bytes
+    unsigned long long reported;    // Last reported spooled size
+    time_t          report_time;    // Time of the last report
+
+    FileSink()
+        : fd(-1), buf(NULL), buf_size(DEF_SINK_BUFFER), buf_len(0), buf_time(0)
+        , size(0), max_size(DEF_ROTATE_SIZE), max_age(0), count(DEF_ROTATE_COUNT)
+        , opened(0), spool(false), progress(0), reported(0), report_time(0)
+    {}
+
+    bool active() const { return fd >= 0; }
+
+    /// True if <progress> bytes were spooled since the last report
+    bool progress_due() const {
+        return spool && progress && size - reported >= progress;
+    }
+    /// True if a periodic spool progress report is due
+    bool report_due(time_t now) const {
+        return spool && size != reported && (progress_due() || now - report_time >= SPOOL_REPORT_SEC);
+    }
+
+    int  open(const char* stream, ei::StringBuffer<128>& err);
+    int  write(const char* data, size_t len);
+    int  flush(bool aligned = false);
+    int  rotate();
+    /// Flush stale buffered data and rotate the file if it's too old
+    void tick(time_t now);
+    void close();
+};
+
+typedef std::list<int>                      PerfEventListT; // Indexes in perf_events[]
+typedef std::list<std::pair<int, int> >     PerfFdListT;    // {Index in perf_events[], fd}
+
 enum RedirectType {
     REDIRECT_STDOUT = -1,   // Redirect to stdout
     REDIRECT_STDERR = -2,   // Redirect to stderr
@@ -145,7 +669,9 @@ enum RedirectType {
     REDIRECT_CLOSE  = -4,   // Close output file descriptor
     REDIRECT_ERL    = -5,   // Redirect output back to Erlang
     REDIRECT_FILE   = -6,   // Redirect output to file
-    REDIRECT_NULL   = -7    // Redirect input/output to /dev/null
+    REDIRECT_NULL   = -7,   // Redirect input/output to /dev/null
+    REDIRECT_TAIL   = -8,   // Keep the tail of output in memory
+    REDIRECT_SINK   = -9    // Write output to a file by the port program
 };
 
 std::string fd_type(int tp) {
@@ -157,6 +683,8 @@ std::string fd_type(int tp) {
         case REDIRECT_ERL:      return "erlang";
         case REDIRECT_FILE:     return "file";
         case REDIRECT_NULL:     return "null";
+        case REDIRECT_TAIL:     return "tail";
+        case REDIRECT_SINK:     return "sink";
         default: {
             std::stringstream s;
             s << "fd:" << tp;
@@ -174,27 +702,89 @@ class CmdInfo;
 //-------------------------------------------------------------------------
 
 int   send_ok(int transId, pid_t pid = -1);
-int   send_pid_status_term(const PidStatusT& stat);
+int   send_pid_status_term(const PidStatusT& stat, const CmdInfo* ci = NULL);
 int   send_error_str(int transId, bool asAtom, const char* fmt, ...);
 int   send_pid_list(int transId, const MapChildrenT& children);
 int   send_ospid_output(int pid, const char* type, const char* data, int len);
+void  send_framed_output(CmdInfo& ci, int stream, const char* data, int len);
+void  flush_framed_output(CmdInfo& ci, int stream);
 
-pid_t start_child(CmdOptions& op, std::string& err);
+pid_t start_child(CmdOptions& op, std::string& err, int (*stage_fds)[2] = NULL);
+pid_t start_pipeline(CmdOptions& op, std::string& err, std::list<PidStatusT>& stages);
+int   pipeline_stage_exited(MapChildrenT::iterator& it, const PidStatusT& ps, bool notify);
 int   kill_child(pid_t pid, int sig, int transId, bool notify=true);
 int   check_children(int& isTerminated, bool notify = true);
 bool  process_pid_input(CmdInfo& ci);
-void  process_pid_output(CmdInfo& ci, int maxsize = 4096);
+int   process_pid_output(CmdInfo& ci, int maxsize = 4096, int stream = -1);
+void  close_pid_output(CmdInfo& ci, int stream);
+int   limit_pid_output(CmdInfo& ci, int stream, int len);
+void  deliver_pid_output(CmdInfo& ci, int stream, const char* data, int len);
+void  process_pid_messages(CmdInfo& ci, int maxsize = 65536);
+int   forward_pid_messages(CmdInfo& ci);
+void  flush_pid_output(CmdInfo& ci);
+void  send_compressed_output(CmdInfo& ci, int stream, const char* data, int len, bool finish = false);
+void  tick_buffered_output();
+int   send_spooled(pid_t pid, FileSink& sink);
+void  collect_sync_output(CmdInfo& ci, int stream, const char* data, int len);
 void  stop_child(pid_t pid, int transId, const TimeVal& now);
 int   stop_child(CmdInfo& ci, int transId, const TimeVal& now, bool notify = true);
 void  erase_child(MapChildrenT::iterator& it);
+pid_t run_child(CmdOptions& po, long transId);
+pid_t spawn_child(CmdOptions& po, std::string& err);
+bool  admit_child(CmdOptions& po);
+void  start_pending_runs();
+bool  host_overloaded();
+pid_t start_pool_worker(const std::string& name, WorkerPool& pool);
+void  dispatch_pool_requests(WorkerPool& pool);
+void  process_pool_output(CmdInfo& ci, const char* data, int len);
+void  pool_worker_exited(CmdInfo& ci);
+bool  restart_pool_workers();
+void  stop_pool(const std::string& name);
+int   decode_dag(Dag& dag, std::string& err);
+bool  run_dags();
+void  dag_node_exited(CmdInfo& ci, int status);
+void  cancel_dag_nodes(Dag& dag, int node);
+void  stop_dag(Dag& dag);
+void  free_dag(Dag& dag);
+int   send_dag_events(long id, Dag& dag);
+bool  schedule_restart(CmdInfo& ci, int status);
+bool  restart_children(TimeVal& next, bool notify = true);
+void  restart_child(MapChildrenT::iterator& it, bool notify);
+bool  expire_timeouts(TimeVal& next);
+int   cgroup_init(const char* root);
+int   cgroup_create(CmdOptions& op, std::string& err);
+void  cgroup_release(const std::string& path, const std::string& name);
+int   cgroup_write(const std::string& path, const char* file, const std::string& value);
+void  cgroup_stats(const std::string& path, std::list<std::pair<const char*, unsigned long long> >& stats);
+pid_t fork_child(CmdOptions& op, bool& in_cgroup);
+int   parse_cpu_list(const char* s, std::list<int>& cpus);
+int   numa_node_cpus(int node, std::list<int>& cpus);
+int   pin_port(const char* cpus);
+int   set_child_sched(const CmdOptions& op, ei::StringBuffer<128>& err);
+void  shorten_timeout(TimeVal& timeout, const TimeVal& due);
 
 int process_command();
 int finalize();
+int open_capture(const char* file);
+void capture_packet(bool inbound, const char* data, size_t len, void*);
+void close_capture(const char* what);
 int set_nonblock_flag(pid_t pid, int fd, bool value);
 int erl_exec_kill(pid_t pid, int signal);
+int erl_exec_kill_group(pid_t pid, int signal);
+void tagged_children(const std::string& tag, std::list<pid_t>& pids, bool reaped);
+int send_pid_list(int transId, const std::list<pid_t>& pids);
+int send_tag_stats(int transId, const std::list<pid_t>& pids);
+int read_proc_stat(pid_t pid, unsigned long long& ticks, long long& rss_pages);
+void reap_orphans();
+pid_t reap_child(pid_t pid, int& status);
 int open_file(const char* file, bool append, const char* stream,
               const char* cmd, ei::StringBuffer<128>& err);
 int open_pipe(int fds[2], const char* stream, ei::StringBuffer<128>& err);
+int open_tee(TeeSink& tee, const char* file, bool append, const char* stream,
+             const char* cmd, ei::StringBuffer<128>& err);
+int perf_event_index(const std::string& name);
+void open_perf_counters(pid_t pid, CmdOptions& op);
+int read_perf_counter(int fd, unsigned long long& value);
 
 //-------------------------------------------------------------------------
 // Types
@@ -204,6 +794,7 @@ class CmdOptions {
     ei::StringBuffer<256>   m_tmp;
     std::stringstream       m_err;
     std::string             m_cmd;
+    std::list<std::string>  m_stages;   // commands of pipeline stages (empty - single command)
     std::string             m_cd;
     std::string             m_kill_cmd;
     int                     m_kill_timeout;
@@ -217,13 +808,48 @@ class CmdOptions {
     std::string             m_std_stream[3];
     bool                    m_std_stream_append[3];
     int                     m_std_stream_fd[3];
+    PerfEventListT          m_perf_events;  // performance counters to open
+    StreamFraming           m_framing[3];
+    size_t                  m_tail_size[3];
+    size_t                  m_sync_limit;   // collect output and reply on exit if > 0
+    long                    m_output_rate;  // max bytes/sec read from stdout/stderr (0 - unlimited)
+    size_t                  m_max_output;   // max bytes of stdout/stderr output (0 - unlimited)
+    OutputLimitAction       m_max_output_action;
+    int                     m_msg_fd;       // child's fd of the message channel (0 - none)
+    int                     m_msg_pipe;     // reading end of the message channel
+    std::string             m_job_class;    // admission control class of the command
+    int                     m_job_class_max;// max running commands of <m_job_class>
+    int                     m_priority;     // admission priority (higher starts first)
+    int                     m_queue_timeout;// max secs waiting for admission (0 - infinity)
+    RestartPolicy           m_restart;
+    int                     m_max_restarts; // max restarts within <m_restart_within> secs
+    int                     m_restart_within;
+    int                     m_restart_backoff;  // msecs before a restart, doubled on every one
+    int                     m_timeout;      // max msecs of wall-clock run time (0 - infinity)
+    int                     m_cpu_limit;    // max secs of CPU time (0 - infinity)
+    CgroupSpec              m_cgroup;
+    std::string             m_cgroup_path;  // cgroup created for the command being started
+    int                     m_cgroup_fd;    // directory fd of <m_cgroup_path> for clone3(2)
+    std::list<int>          m_cpus;         // CPUs the child may run on (empty - inherited)
+    int                     m_numa_node;    // NUMA node preferred for memory (-1 - any)
+    int                     m_ioprio;       // ioprio_set(2) value (-1 - inherited)
+    int                     m_sched_policy; // sched_setscheduler(2) policy (-1 - inherited)
+    int                     m_sched_priority;
+    bool                    m_setsid;       // run in own session and process group
+    std::list<std::string>  m_tags;         // tags of bulk operations on commands
+    TeeSink                 m_tee[3];       // files receiving a copy of output
+    FileSink                m_sink[3];      // files written by the port program
+    StreamCompressor        m_zip[3];       // compression of output sent to Erlang
+    PerfFdListT             m_perf_fds;     // opened performance counters
 
     void init_streams() {
         m_std_stream[STDOUT_FILENO] = CS_DEV_NULL;
         m_std_stream[STDERR_FILENO] = CS_DEV_NULL;
 
-        for (int i=STDIN_FILENO; i <= STDERR_FILENO; i++)
+        for (int i=STDIN_FILENO; i <= STDERR_FILENO; i++) {
             m_std_stream_append[i] = false;
+            m_tail_size[i]         = 0;
+        }
 
         m_std_stream_fd[STDIN_FILENO]  = REDIRECT_NULL;
         m_std_stream_fd[STDOUT_FILENO] = REDIRECT_NONE;
@@ -236,7 +862,14 @@ public:
         : m_tmp(0, 256)
         , m_kill_timeout(KILL_TIMEOUT_SEC)
         , m_cenv(NULL), m_nice(INT_MAX), m_size(0), m_count(0)
-        , m_group(INT_MAX), m_user(INT_MAX)
+        , m_group(INT_MAX), m_user(INT_MAX), m_sync_limit(0)
+        , m_output_rate(0), m_max_output(0), m_max_output_action(LIMIT_TRUNCATE)
+        , m_msg_fd(0), m_msg_pipe(-1)
+        , m_job_class_max(0), m_priority(0), m_queue_timeout(DEF_QUEUE_TIMEOUT)
+        , m_restart(RESTART_NEVER), m_max_restarts(0), m_restart_within(0), m_restart_backoff(0)
+        , m_timeout(0), m_cpu_limit(0), m_cgroup_fd(-1)
+        , m_numa_node(-1), m_ioprio(-1), m_sched_policy(-1), m_sched_priority(0)
+        , m_setsid(false)
     {
         init_streams();
     }
@@ -245,17 +878,33 @@ public:
         : m_cmd(cmd), m_cd(cd ? cd : "")
         , m_kill_timeout(KILL_TIMEOUT_SEC)
         , m_cenv(NULL), m_nice(INT_MAX), m_size(0), m_count(0)
-        , m_group(group), m_user(user)
+        , m_group(group), m_user(user), m_sync_limit(0)
+        , m_output_rate(0), m_max_output(0), m_max_output_action(LIMIT_TRUNCATE)
+        , m_msg_fd(0), m_msg_pipe(-1)
+        , m_job_class_max(0), m_priority(0), m_queue_timeout(DEF_QUEUE_TIMEOUT)
+        , m_restart(RESTART_NEVER), m_max_restarts(0), m_restart_within(0), m_restart_backoff(0)
+        , m_timeout(0), m_cpu_limit(0), m_cgroup_fd(-1)
+        , m_numa_node(-1), m_ioprio(-1), m_sched_policy(-1), m_sched_priority(0)
+        , m_setsid(false)
     {
         init_streams();
     }
     ~CmdOptions() {
         if (m_cenv != environ) delete [] m_cenv;
         m_cenv = NULL;
+        if (m_msg_pipe >= 0) close(m_msg_pipe);
+        for (int i=STDOUT_FILENO; i <= STDERR_FILENO; i++) {
+            m_framing[i].free_filters();
+            m_tee[i].close();
+            m_sink[i].close();
+            m_zip[i].free();
+        }
     }
 
-    const char*  strerror()             const { return m_err.str().c_str(); }
+    std::string  strerror()             const { return m_err.str(); }
     const char*  cmd()                  const { return m_cmd.c_str(); }
+    void         cmd(const std::string& c)    { m_cmd = c; }
+    const std::list<std::string>& stages() const { return m_stages; }
     const char*  cd()                   const { return m_cd.c_str(); }
     char* const* env()                  const { return (char* const*)m_cenv; }
     const char*  kill_cmd()             const { return m_kill_cmd.c_str(); }
@@ -265,9 +914,44 @@ public:
     int          nice()                 const { return m_nice; }
     const char*  stream_file(int i)     const { return m_std_stream[i].c_str(); }
     bool         stream_append(int i)   const { return m_std_stream_append[i]; }
+    void         stream_append(int i, bool append) { m_std_stream_append[i] = append; }
     int          stream_fd(int i)       const { return m_std_stream_fd[i]; }
     int&         stream_fd(int i)             { return m_std_stream_fd[i]; }
     const char*  stream_fd_type(int i)  const { return fd_type(stream_fd(i)).c_str(); }
+    const StreamFraming& framing(int i) const { return m_framing[i]; }
+    StreamFraming&       framing(int i)       { return m_framing[i]; }
+    size_t       tail_size(int i)       const { return m_tail_size[i]; }
+    size_t       sync_limit()           const { return m_sync_limit; }
+    long         output_rate()          const { return m_output_rate; }
+    size_t       max_output()           const { return m_max_output; }
+    OutputLimitAction max_output_action() const { return m_max_output_action; }
+    int          msg_fd()               const { return m_msg_fd; }
+    int&         msg_pipe()                   { return m_msg_pipe; }
+    const std::string& job_class()      const { return m_job_class; }
+    int          job_class_max()        const { return m_job_class_max; }
+    int          priority()             const { return m_priority; }
+    int          queue_timeout()        const { return m_queue_timeout; }
+    RestartPolicy restart()             const { return m_restart; }
+    int          max_restarts()         const { return m_max_restarts; }
+    int          restart_within()       const { return m_restart_within; }
+    int          restart_backoff()      const { return m_restart_backoff; }
+    int          timeout()              const { return m_timeout; }
+    int          cpu_limit()            const { return m_cpu_limit; }
+    const CgroupSpec& cgroup()          const { return m_cgroup; }
+    std::string& cgroup_path()                { return m_cgroup_path; }
+    int&         cgroup_fd()                  { return m_cgroup_fd; }
+    const std::list<int>& cpus()        const { return m_cpus; }
+    int          numa_node()            const { return m_numa_node; }
+    int          ioprio()               const { return m_ioprio; }
+    int          sched_policy()         const { return m_sched_policy; }
+    int          sched_priority()       const { return m_sched_priority; }
+    bool         setsid()               const { return m_setsid; }
+    const std::list<std::string>& tags() const { return m_tags; }
+    TeeSink&     tee(int i)                   { return m_tee[i]; }
+    FileSink&    sink(int i)                  { return m_sink[i]; }
+    StreamCompressor& zip(int i)              { return m_zip[i]; }
+    const PerfEventListT& perf_events() const { return m_perf_events; }
+    PerfFdListT& perf_fds()                   { return m_perf_fds; }
 
     void stream_file(int i, const std::string& file, bool append) {
         m_std_stream_fd[i]      = REDIRECT_FILE;
@@ -287,7 +971,14 @@ public:
         m_std_stream[i].clear();
     }
 
-    int ei_decode(ei::Serializer& ei, bool getCmd = false);
+    /// When `allowed' is given, only the options named in that
+    /// NULL-terminated array are accepted
+    int ei_decode(ei::Serializer& ei, bool getCmd = false, const char** allowed = NULL);
+    int ei_decode_pipeline(ei::Serializer& ei);
+    int ei_decode_stream_opts(ei::Serializer& ei, int i);
+    int ei_decode_tee(ei::Serializer& ei, int i);
+    int ei_decode_sink(ei::Serializer& ei, int i, const std::string& type);
+    int ei_decode_cgroup(ei::Serializer& ei);
     int init_cenv();
 };
 
@@ -307,6 +998,46 @@ struct CmdInfo {
     int             stream_fd[3];   // Pipe fd getting   process's stdin/stdout/stderr
     int             stdin_wr_pos;   // Offset of the unwritten portion of the head item of stdin_queue 
     std::list<std::string> stdin_queue;
+    PerfFdListT     perf_fds;       // Performance counters attached to the process
+    StreamFraming   framing[3];     // Framing of stdout/stderr output sent to Erlang
+    TailBuffer      tail[3];        // Retained tail of stdout/stderr output
+    TeeSink         tee[3];         // Files receiving a copy of stdout/stderr output
+    FileSink        sink[3];        // Files receiving stdout/stderr output
+    StreamCompressor zip[3];        // Compression of stdout/stderr output
+    long            sync_trans;     // TransId of a sync run replied to on exit (0 - async)
+    size_t          sync_limit;     // Max size of each collected output stream
+    std::string     sync_out[3];    // Collected stdout/stderr output of a sync run
+    size_t          discarded[3];   // Bytes discarded over <sync_limit> or <max_output>
+    long            output_rate;    // Max bytes/sec read from stdout/stderr (0 - unlimited)
+    double          rate_tokens;    // Bytes that can be read before output is held back
+    ei::TimeVal     rate_time;      // Last time <rate_tokens> were replenished
+    size_t          max_output;     // Max bytes of stdout/stderr output (0 - unlimited)
+    OutputLimitAction max_output_action;
+    size_t          output_total;   // Bytes of stdout/stderr output read so far
+    int             msg_fd;         // Pipe fd getting messages of the {msg, Fd} channel
+    std::string     msg_buf;        // Partially received messages
+    std::string     msg_error;      // Reason the message channel was closed
+    std::string     job_class;      // Admission control class of the command
+    std::string     pool;           // Pool of a worker
+    long            pool_trans;     // Request being served by a worker (0 - idle)
+    pid_t           pipeline;       // Last stage of the pipeline of this stage (0 - none)
+    std::list<PidStatusT> stages;   // Stages of a pipeline and their exit statuses
+    bool            reaped;         // Last stage exited, waiting for other stages
+    int             exit_status;    // Exit status of the reaped last stage
+    long            dag;            // Job dependency graph of a node (0 - none)
+    int             dag_node;       // Index of the node in the graph
+    CmdOptions*     restart_opts;   // Options of a command with a restart policy (owned)
+    std::list<TimeVal> restarts;    // Times of restarts within the restart window
+    ei::TimeVal     restart_at;     // Time when the exited command is due for a restart
+    int             timeout;        // Max msecs of wall-clock run time (0 - infinity)
+    ei::TimeVal     timeout_at;     // Time when the command is stopped by the <timeout>
+    bool            timed_out;      // <true> if the command was stopped by the <timeout>
+    int             cpu_limit;      // Max secs of CPU time (0 - infinity)
+    bool            cpu_out;        // <true> if the command was killed over its <cpu_limit>
+    std::string     cgroup;         // cgroup v2 directory of the command (empty - none)
+    std::string     cgroup_name;    // Name of a shared cgroup (empty - own cgroup)
+    bool            group;          // <true> if the command leads its own process group
+    std::list<std::string> tags;    // Tags of bulk operations on the command
 
     CmdInfo() {
         new (this) CmdInfo("", "", 0);
@@ -315,6 +1046,48 @@ struct CmdInfo {
         new (this) CmdInfo(ci.cmd.c_str(), ci.kill_cmd.c_str(), ci.cmd_pid, ci.managed,
                            ci.stream_fd[STDIN_FILENO], ci.stream_fd[STDOUT_FILENO],
                            ci.stream_fd[STDERR_FILENO]);
+        perf_fds = ci.perf_fds;
+        sync_trans = ci.sync_trans;
+        sync_limit = ci.sync_limit;
+        output_rate       = ci.output_rate;
+        rate_tokens       = ci.rate_tokens;
+        rate_time         = ci.rate_time;
+        max_output        = ci.max_output;
+        max_output_action = ci.max_output_action;
+        output_total      = ci.output_total;
+        msg_fd            = ci.msg_fd;
+        msg_buf           = ci.msg_buf;
+        msg_error         = ci.msg_error;
+        job_class         = ci.job_class;
+        pool              = ci.pool;
+        pool_trans        = ci.pool_trans;
+        pipeline          = ci.pipeline;
+        stages            = ci.stages;
+        reaped            = ci.reaped;
+        exit_status       = ci.exit_status;
+        dag               = ci.dag;
+        dag_node          = ci.dag_node;
+        restart_opts      = ci.restart_opts;
+        restarts          = ci.restarts;
+        restart_at        = ci.restart_at;
+        timeout           = ci.timeout;
+        timeout_at        = ci.timeout_at;
+        timed_out         = ci.timed_out;
+        cpu_limit         = ci.cpu_limit;
+        cpu_out           = ci.cpu_out;
+        cgroup            = ci.cgroup;
+        cgroup_name       = ci.cgroup_name;
+        group             = ci.group;
+        tags              = ci.tags;
+        for (int i=STDOUT_FILENO; i <= STDERR_FILENO; i++) {
+            framing[i]      = ci.framing[i];
+            tail[i]         = ci.tail[i];
+            tee[i]          = ci.tee[i];
+            sink[i]         = ci.sink[i];
+            zip[i]          = ci.zip[i];
+            sync_out[i]     = ci.sync_out[i];
+            discarded[i]    = ci.discarded[i];
+        }
     }
     CmdInfo(const char* _cmd, const char* _kill_cmd, pid_t _cmd_pid, bool _managed = false,
             int _stdin_fd = REDIRECT_NULL, int _stdout_fd = REDIRECT_NONE, int _stderr_fd = REDIRECT_NONE,
@@ -322,8 +1095,13 @@ struct CmdInfo {
         : cmd(_cmd), cmd_pid(_cmd_pid), kill_cmd(_kill_cmd), kill_cmd_pid(-1)
         , sigterm(false), sigkill(false)
         , kill_timeout(_kill_timeout), managed(_managed)
-        , stdin_wr_pos(0)
+        , stdin_wr_pos(0), sync_trans(0), sync_limit(0)
+        , output_rate(0), rate_tokens(0), max_output(0), max_output_action(LIMIT_TRUNCATE)
+        , output_total(0), msg_fd(REDIRECT_NONE), pool_trans(0)
+        , pipeline(0), reaped(false), exit_status(0), dag(0), dag_node(0), restart_opts(NULL)
+        , timeout(0), timed_out(false), cpu_limit(0), cpu_out(false), group(false)
     {
+        discarded[STDOUT_FILENO] = discarded[STDERR_FILENO] = 0;
         stream_fd[STDIN_FILENO]  = _stdin_fd;
         stream_fd[STDOUT_FILENO] = _stdout_fd;
         stream_fd[STDERR_FILENO] = _stderr_fd;
@@ -338,7 +1116,19 @@ struct CmdInfo {
         }
     }
 
-    void include_stream_fd(int i, int& maxfd, fd_set* readfds, fd_set* writefds) {
+    /// Replenish the output rate tokens and return true if output can be read
+    bool output_allowed(const TimeVal& now) {
+        if (output_rate <= 0)
+            return true;
+        rate_tokens = std::min((double)output_rate,
+                               rate_tokens + (double)output_rate * now.diff(rate_time));
+        rate_time   = now;
+        return rate_tokens > 0;
+    }
+
+    /// Returns false if the stream is held back by the output rate limit
+    bool include_stream_fd(int i, int& maxfd, fd_set* readfds, fd_set* writefds,
+                           const TimeVal& now) {
         bool ok;
         fd_set* fds;
        
@@ -350,6 +1140,14 @@ struct CmdInfo {
             fds = writefds;
         } else {
             ok = stream_fd[i] >= 0;
+            // Stop polling the pipe while over the rate so that the child
+            // blocks on a full pipe instead of flooding the port program
+            if (ok && output_rate > 0 && !output_allowed(now)) {
+                if (debug > 2)
+                    fprintf(stderr, "Pid %d %s is held back by output rate\r\n",
+                        cmd_pid, stream_name(i));
+                return false;
+            }
             if (debug > 2)
                 fprintf(stderr, "Pid %d adding stdout checking (fd=%d)\r\n", cmd_pid, stream_fd[i]);
             fds = readfds;
@@ -359,6 +1157,18 @@ struct CmdInfo {
             FD_SET(stream_fd[i], fds);
             if (stream_fd[i] > maxfd) maxfd = stream_fd[i];
         }
+        return true;
+    }
+
+    void include_msg_fd(int& maxfd, fd_set* readfds) {
+        if (msg_fd < 0) return;
+        FD_SET(msg_fd, readfds);
+        if (msg_fd > maxfd) maxfd = msg_fd;
+    }
+
+    void process_msg_data(fd_set* readfds) {
+        if (msg_fd >= 0 && FD_ISSET(msg_fd, readfds))
+            process_pid_messages(*this);
     }
 
     void process_stream_data(int i, fd_set* readfds, fd_set* writefds) {
@@ -369,8 +1179,10 @@ struct CmdInfo {
 
         if (i == STDIN_FILENO)
             process_pid_input(*this);
+        else if (output_rate <= 0)
+            process_pid_output(*this, 4096, i);
         else
-            process_pid_output(*this);
+            rate_tokens -= process_pid_output(*this, std::max(1, (int)rate_tokens), i);
     }
 };
 
@@ -389,6 +1201,20 @@ void gotsignal(int signal)
     if (oktojump) siglongjmp(jbuf, 1);
 }
 
+/// waitpid(pid, &status, WNOHANG) that also records the CPU time of the reaped child
+pid_t reap_child(pid_t pid, int& status)
+{
+    struct rusage ru;
+    pid_t ret;
+
+    while ((ret = wait4(pid, &status, WNOHANG, &ru)) < 0 && errno == EINTR);
+
+    if (ret > 0 && (WIFEXITED(status) || WIFSIGNALED(status)))
+        exited_cpu[ret] = (long long)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000
+                        + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+    return ret;
+}
+
 void gotsigchild(int signal, siginfo_t* si, void* context)
 {
     // If someone used kill() to send SIGCHLD ignore the event
@@ -400,7 +1226,7 @@ void gotsigchild(int signal, siginfo_t* si, void* context)
     int status;
     pid_t ret;
 
-    while ((ret = waitpid(pid, &status, WNOHANG)) < 0 && errno == EINTR);
+    ret = reap_child(pid, status);
 
     if (debug)
         fprintf(stderr, "Process %d exited (status=%d, oktojump=%d)\r\n", si->si_pid, status, oktojump);
@@ -443,12 +1269,25 @@ void check_pending()
 void usage(char* progname) {
     fprintf(stderr,
         "Usage:\n"
-        "   %s [-n] [-alarm N] [-debug [Level]] [-user User]\n"
+        "   %s [-n] [-alarm N] [-debug [Level]] [-user User] [-capture File]\n"
+        "      [-max_jobs N] [-max_load Load] [-max_mem_pressure Pct] [-cgroup Dir]\n"
+        "      [-port_cpu_affinity Cpus] [-subreaper]\n"
         "Options:\n"
         "   -n              - Use marshaling file descriptors 3&4 instead of default 0&1.\n"
         "   -alarm N        - Allow up to <N> seconds to live after receiving SIGTERM/SIGINT (default %d)\n"
         "   -debug [Level]  - Turn on debug mode (default Level: 1)\n"
         "   -user User      - If started by root, run as User\n"
+        "   -capture File   - Append every packet exchanged with Erlang to File\n"
+        "   -max_jobs N     - Queue commands while N commands are running\n"
+        "   -max_load Load  - Queue commands while 1-min load average is over Load\n"
+        "   -max_mem_pressure Pct\n"
+        "                   - Queue commands while memory pressure (Linux PSI) is over Pct\n"
+        "   -cgroup Dir     - Create cgroups of commands under the delegated cgroup v2 Dir\n"
+        "   -port_cpu_affinity Cpus\n"
+        "                   - Run the port program on Cpus (e.g. \"0-1,4\") and its children\n"
+        "                     on the CPUs it was started with\n"
+        "   -subreaper      - Run commands in their own sessions and reap their orphaned\n"
+        "                     descendants (Linux)\n"
         "Description:\n"
         "   This is a port program intended to be started by an Erlang\n"
         "   virtual machine.  It can start/kill/list OS processes\n"
@@ -506,6 +1345,34 @@ int main(int argc, char* argv[])
                     exit(3);
                 }
                 userid = pw->pw_uid;
+            } else if (strcmp(argv[res], "-capture") == 0 && res+1 < argc && argv[res+1][0] != '-') {
+                if (open_capture(argv[++res]) < 0)
+                    exit(11);
+            } else if (strcmp(argv[res], "-max_jobs") == 0 && res+1 < argc && argv[res+1][0] != '-') {
+                max_jobs = atoi(argv[++res]);
+            } else if (strcmp(argv[res], "-max_load") == 0 && res+1 < argc && argv[res+1][0] != '-') {
+                max_load = atof(argv[++res]);
+            } else if (strcmp(argv[res], "-max_mem_pressure") == 0 && res+1 < argc && argv[res+1][0] != '-') {
+                max_mem_pressure = atof(argv[++res]);
+            } else if (strcmp(argv[res], "-cgroup") == 0 && res+1 < argc && argv[res+1][0] != '-') {
+                // Commands with the cgroup option run in their cgroup only if it's usable
+                cgroup_init(argv[++res]);
+            } else if (strcmp(argv[res], "-subreaper") == 0) {
+                #ifdef PR_SET_CHILD_SUBREAPER
+                if (prctl(PR_SET_CHILD_SUBREAPER, 1) < 0) {
+                    perror("Failed to become a child subreaper");
+                    exit(13);
+                }
+                #endif
+                subreaper = true;
+            } else if (strcmp(argv[res], "-port_cpu_affinity") == 0 && res+1 < argc && argv[res+1][0] != '-') {
+                #ifdef __linux__
+                if (pin_port(argv[++res]) < 0)
+                    exit(12);
+                #else
+                fprintf(stderr, "CPU affinity is not supported on this platform\r\n");
+                exit(12);
+                #endif
             }
         }
     }
@@ -600,10 +1467,40 @@ int main(int argc, char* argv[])
         while (!terminated && !exited_children.empty())
             check_children(terminated);
 
+        // Start commands held back by admission control as children exit
+        if (!pending_runs.empty())
+            start_pending_runs();
+
+        // Replace dead workers of pools
+        bool restarting = restart_pool_workers();
+
+        // Start nodes of job dependency graphs whose predecessors exited
+        bool dag_held = !dags.empty() && run_dags();
+
+        // Restart exited children by their restart policy once their backoff expires
+        TimeVal next_restart;
+        bool respawning = !restart_pending.empty() && restart_children(next_restart);
+
+        // Stop children over their wall-clock timeout
+        TimeVal next_timeout;
+        bool timing = !timeouts.empty() && expire_timeouts(next_timeout);
+
         // Set up all stdout/stderr input streams that we need to monitor and redirect to Erlang
-        for(MapChildrenT::iterator it=children.begin(), end=children.end(); it != end; ++it)
-            for (int i=STDIN_FILENO; i <= STDERR_FILENO; i++)
-                it->second.include_stream_fd(i, maxfd, &readfds, &writefds);
+        bool buffered = false, throttled = false;
+        TimeVal now(TimeVal::NOW);
+        for(MapChildrenT::iterator it=children.begin(), end=children.end(); it != end; ++it) {
+            for (int i=STDIN_FILENO; i <= STDERR_FILENO; i++) {
+                throttled |= !it->second.include_stream_fd(i, maxfd, &readfds, &writefds, now);
+                buffered  |= it->second.sink[i].active() || it->second.zip[i].active();
+            }
+            it->second.include_msg_fd(maxfd, &readfds);
+        }
+
+        // Flush output buffered for files written by the port program or
+        // being compressed and check if files are due for rotation at least
+        // once a second
+        if (buffered)
+            tick_buffered_output();
 
         check_pending(); // Check for pending signals arrived while we were in the signal handler
 
@@ -611,6 +1508,17 @@ int main(int argc, char* argv[])
 
         oktojump = 1;
         ei::TimeVal timeout(KILL_TIMEOUT_SEC, 0);
+        if (throttled)
+            timeout = ei::TimeVal(0, RATE_POLL_USEC);
+        else if (restarting)
+            timeout = ei::TimeVal(0, POOL_RESTART_MSEC*1000);
+        else if (buffered || !pending_runs.empty() || dag_held)
+            timeout = ei::TimeVal(buffered ? SINK_FLUSH_SEC : QUEUE_CHECK_SEC, 0);
+
+        if (respawning)
+            shorten_timeout(timeout, next_restart);
+        if (timing)
+            shorten_timeout(timeout, next_timeout);
 
         if (debug > 2)
             fprintf(stderr, "Selecting maxfd=%d\r\n", maxfd);
@@ -623,6 +1531,8 @@ int main(int argc, char* argv[])
             fprintf(stderr, "Select got %d events (maxfd=%d)\r\n", cnt, maxfd);
 
         if (interrupted || cnt == 0) {
+            if (cnt == 0 && capture_file && fflush(capture_file) != 0)
+                close_capture("flush");
             if (check_children(terminated) < 0)
                 break;
         } else if (cnt < 0) {
@@ -635,9 +1545,11 @@ int main(int argc, char* argv[])
                 break;
         } else {
             // Check if any stdout/stderr streams have data
-            for(MapChildrenT::iterator it=children.begin(), end=children.end(); it != end; ++it)
+            for(MapChildrenT::iterator it=children.begin(), end=children.end(); it != end; ++it) {
                 for (int i=STDIN_FILENO; i <= STDERR_FILENO; i++)
                     it->second.process_stream_data(i, &readfds, &writefds);
+                it->second.process_msg_data(&readfds);
+            }
         }
     }
 
@@ -670,8 +1582,12 @@ int process_command()
         return -1;
     }
 
-    enum CmdTypeT        {  MANAGE,  RUN,  SHELL,  STOP,  KILL,  LIST,  SHUTDOWN,  STDIN  } cmd;
-    const char* cmds[] = { "manage","run","shell","stop","kill","list","shutdown","stdin" };
+    enum CmdTypeT        {  MANAGE,  RUN,  SHELL,  STOP,  KILL,  LIST,  SHUTDOWN,  STDIN,  POOL,  CALL,
+                            STOP_POOL,  PIPELINE,  DAG,  STOP_DAG,  STOP_TAG,  KILL_TAG,  LIST_TAG,
+                            TAG_STATS } cmd;
+    const char* cmds[] = { "manage","run","shell","stop","kill","list","shutdown","stdin","pool","call",
+                           "stop_pool","pipeline","dag","stop_dag","stop_tag","kill_tag","list_tag",
+                           "tag_stats" };
 
     /* Determine the command */
     if ((int)(cmd = (CmdTypeT) eis.decodeAtomIndex(cmds, command)) < 0) {
@@ -682,6 +1598,8 @@ int process_command()
         return 0;
     }
 
+    EXEC_PROBE2(cmd_recv, transId, command.c_str());
+
     switch (cmd) {
         case SHUTDOWN: {
             terminated = 0;
@@ -695,7 +1613,7 @@ int process_command()
 
             if (arity != 3 || (eis.decodeInt(pid)) < 0 || po.ei_decode(eis) < 0) {
                 send_error_str(transId, true, "badarg");
-                return 0;
+                break;
             }
             realpid = pid;
 
@@ -707,28 +1625,36 @@ int process_command()
             break;
         }
         case RUN:
-        case SHELL: {
+        case SHELL:
+        case PIPELINE: {
             // {shell, Cmd::string(), Options::list()}
-            CmdOptions po;
+            // {pipeline, [Cmd::string()], Options::list()}
+            CmdOptions* opts = new CmdOptions();
 
-            if (arity != 3 || po.ei_decode(eis, true) < 0) {
-                send_error_str(transId, false, po.strerror());
+            if (arity != 3 || (cmd == PIPELINE ? opts->ei_decode_pipeline(eis)
+                                               : opts->ei_decode(eis, true)) < 0) {
+                send_error_str(transId, false, "%s", opts->strerror().c_str());
+                delete opts;
                 break;
             }
 
-            pid_t pid;
-            std::string err;
-            if ((pid = start_child(po, err)) < 0)
-                send_error_str(transId, false, "Couldn't start pid: %s", err.c_str());
-            else {
-                CmdInfo ci(po.cmd(), po.kill_cmd(), pid, false,
-                           po.stream_fd(STDIN_FILENO),
-                           po.stream_fd(STDOUT_FILENO),
-                           po.stream_fd(STDERR_FILENO),
-                           po.kill_timeout());
-                children[pid] = ci;
-                send_ok(transId, pid);
+            // Requests queued ahead of this one go first
+            if (pending_runs.empty() && admit_child(*opts)) {
+                // The options of a restartable command are owned by the child
+                if (run_child(*opts, transId) < 0 || opts->restart() == RESTART_NEVER)
+                    delete opts;
+                break;
             }
+
+            PendingRun run;
+            run.trans_id = transId;
+            run.opts     = opts;
+            if (opts->queue_timeout() > 0)
+                run.deadline.set(TimeVal(TimeVal::NOW), opts->queue_timeout());
+            pending_runs[std::make_pair(-opts->priority(), pending_seq++)] = run;
+            if (debug)
+                fprintf(stderr, "Queued command '%s' (priority=%d, running=%d, queued=%ld)\r\n",
+                    opts->cmd(), opts->priority(), running_jobs, (long)pending_runs.size());
             break;
         }
         case STOP: {
@@ -782,80 +1708,1373 @@ int process_command()
             process_pid_input(it->second);
             break;
         }
+        case POOL: {
+            // {pool, Name::atom(), Size::integer(), Cmd::string(), Options::list()}
+            std::string name;
+            long size;
+            if (arity != 5 || eis.decodeAtom(name) < 0 || eis.decodeInt(size) < 0 || size <= 0) {
+                send_error_str(transId, true, "badarg");
+                break;
+            } else if (pools.find(name) != pools.end()) {
+                send_error_str(transId, true, "already_started");
+                break;
+            }
+
+            // Workers share the pool's options, so only those that don't
+            // own resources (fds, filters, files) are accepted. Pools restart
+            // their workers on their own
+            static const char* pool_opts[] = {
+                "cd", "env", "kill", "kill_timeout", "user", "group", "nice",
+                "cpu_affinity", "numa_node", "ioprio", "sched_policy", "setsid", "tags", NULL
+            };
+            CmdOptions* opts = new CmdOptions();
+            if (opts->ei_decode(eis, true, pool_opts) < 0) {
+                send_error_str(transId, false, "%s", opts->strerror().c_str());
+                delete opts;
+                break;
+            }
+            // Requests and responses are exchanged over the worker's stdin/stdout
+            opts->stream_redirect(STDIN_FILENO,  REDIRECT_ERL);
+            opts->stream_redirect(STDOUT_FILENO, REDIRECT_ERL);
+            opts->framing(STDOUT_FILENO).type       = FRAMING_PACKET;
+            opts->framing(STDOUT_FILENO).hdr_size   = 4;
+            opts->framing(STDOUT_FILENO).max_record = MAX_POOL_RESPONSE;
+
+            WorkerPool& pool = pools[name];
+            pool.opts    = opts;
+            pool.size    = size;
+            pool.missing = 0;
+
+            int started = 0;
+            for (int i=0; i < size; i++)
+                if (start_pool_worker(name, pool) > 0)
+                    started++;
+                else
+                    pool.missing++;
+
+            if (started == 0) {
+                send_error_str(transId, false, "Couldn't start pool workers of '%s'", opts->cmd());
+                stop_pool(name);
+            } else
+                send_ok(transId);
+            break;
+        }
+        case CALL: {
+            // {call, Name::atom(), Request::binary()}
+            std::string name;
+            PoolRequest req;
+            if (arity != 3 || eis.decodeAtom(name) < 0 || eis.decodeBinary(req.data) < 0) {
+                send_error_str(transId, true, "badarg");
+                break;
+            }
+            MapPoolT::iterator it = pools.find(name);
+            if (it == pools.end()) {
+                send_error_str(transId, true, "no_pool");
+                break;
+            }
+            req.trans_id = transId;
+            it->second.queue.push_back(req);
+            dispatch_pool_requests(it->second);
+            break;
+        }
+        case STOP_POOL: {
+            // {stop_pool, Name::atom()}
+            std::string name;
+            if (arity != 2 || eis.decodeAtom(name) < 0) {
+                send_error_str(transId, true, "badarg");
+                break;
+            } else if (pools.find(name) == pools.end()) {
+                send_error_str(transId, true, "no_pool");
+                break;
+            }
+            stop_pool(name);
+            send_ok(transId);
+            break;
+        }
+        case DAG: {
+            // {dag, Nodes::list(), Edges::list(), Options::list()}
+            Dag dag;
+            std::string err;
+            if (arity != 4 || decode_dag(dag, err) < 0) {
+                send_error_str(transId, false, "%s", err.c_str());
+                free_dag(dag);
+                break;
+            }
+            long id = ++dag_seq;
+            dags[id] = dag;
+
+            // Reply: {TransId, {ok, {dag, Id::integer()}}}
+            eis.reset();
+            eis.encodeTupleSize(2);
+            eis.encode(transId);
+            eis.encodeTupleSize(2);
+            eis.encode(atom_t("ok"));
+            eis.encodeTupleSize(2);
+            eis.encode(atom_t("dag"));
+            eis.encode(id);
+            eis.write();
+
+            if (debug)
+                fprintf(stderr, "Started dag %ld of %ld nodes\r\n", id, (long)dag.nodes.size());
+            run_dags();
+            break;
+        }
+        case STOP_DAG: {
+            // {stop_dag, Id::integer()}
+            long id;
+            MapDagT::iterator it;
+            if (arity != 2 || eis.decodeInt(id) < 0) {
+                send_error_str(transId, true, "badarg");
+                break;
+            } else if ((it = dags.find(id)) == dags.end()) {
+                send_error_str(transId, true, "no_dag");
+                break;
+            }
+            stop_dag(it->second);
+            send_ok(transId);
+            run_dags();
+            break;
+        }
+        case STOP_TAG:
+        case KILL_TAG:
+        case LIST_TAG:
+        case TAG_STATS: {
+            // {stop_tag, Tag::string()} | {kill_tag, Tag::string(), Signal::integer()} |
+            // {list_tag, Tag::string()} | {tag_stats, Tag::string()}
+            std::string tag;
+            long sig = 0;
+            if (arity != (cmd == KILL_TAG ? 3 : 2) || eis.decodeString(tag) < 0 ||
+                (cmd == KILL_TAG && eis.decodeInt(sig) < 0)) {
+                send_error_str(transId, true, "badarg");
+                break;
+            }
+
+            // Commands waiting for a restart are stopped to cancel the restart
+            std::list<pid_t> pids;
+            tagged_children(tag, pids, cmd == STOP_TAG);
+
+            if (cmd == LIST_TAG)
+                send_pid_list(transId, pids);
+            else if (cmd == TAG_STATS)
+                send_tag_stats(transId, pids);
+            else {
+                TimeVal now(TimeVal::NOW);
+                int n = 0;
+                // Stopping a command may erase other ones (e.g. stages of a pipeline)
+                for (std::list<pid_t>::iterator p = pids.begin(); p != pids.end(); ++p) {
+                    MapChildrenT::iterator it = children.find(*p);
+                    if (it == children.end())
+                        continue;
+                    else if (cmd == STOP_TAG && stop_child(it->second, 0, now, false) >= 0)
+                        n++;
+                    else if (cmd == KILL_TAG && kill_child(*p, sig, 0, false) == 0)
+                        n++;
+                }
+                if (debug)
+                    fprintf(stderr, "%s %d of %ld commands tagged '%s'\r\n",
+                        cmd == STOP_TAG ? "Stopped" : "Signaled", n, (long)pids.size(), tag.c_str());
+                // Reply: {TransId, {ok, Count::integer()}}
+                send_ok(transId, n);
+            }
+            break;
+        }
     }
+
+    EXEC_PROBE2(cmd_reply, transId, command.c_str());
     return 0;
 }
 
-int finalize()
+pid_t run_child(CmdOptions& po, long transId)
 {
-    if (debug) fprintf(stderr, "Setting alarm to %d seconds\r\n", alarm_max_time);
-    alarm(alarm_max_time);  // Die in <alarm_max_time> seconds if not done
-
-    int old_terminated = terminated;
-    terminated = 0;
+    std::string err;
+    pid_t pid = spawn_child(po, err);
+    if (pid < 0)
+        send_error_str(transId, false, "Couldn't start pid: %s", err.c_str());
+    else if (po.sync_limit() > 0) {
+        // In sync mode the reply is sent when the child exits
+        CmdInfo& ci  = children[pid];
+        ci.sync_trans = transId;
+        ci.sync_limit = po.sync_limit();
+    } else
+        send_ok(transId, pid);
+    return pid;
+}
 
-    erl_exec_kill(0, SIGTERM); // Kill all children in our process group
+pid_t spawn_child(CmdOptions& po, std::string& err)
+{
+    pid_t pid;
+    std::list<PidStatusT> stages;
+    int   redirect[3] = { po.stream_fd(STDIN_FILENO), po.stream_fd(STDOUT_FILENO),
+                          po.stream_fd(STDERR_FILENO) };
 
-    TimeVal now(TimeVal::NOW);
-    TimeVal deadline(now, 6, 0);
+    // Without a delegated cgroup the command runs in the cgroup of the port program
+    std::string cgerr;
+    if (po.cgroup().enabled && cgroup_create(po, cgerr) < 0 && debug)
+        fprintf(stderr, "Running '%s' without its cgroup: %s\r\n", po.cmd(), cgerr.c_str());
 
-    while (children.size() > 0) {
-        sigsetjmp(jbuf, 1);
+    pid = po.stages().size() > 1 ? start_pipeline(po, err, stages) : start_child(po, err);
 
-        if (children.size() > 0 || !exited_children.empty()) {
-            int term = 0;
-            check_children(term, pipe_valid);
+    if (po.cgroup_fd() >= 0) {
+        close(po.cgroup_fd());
+        po.cgroup_fd() = -1;
+    }
+    if (pid < 0)
+        cgroup_release(po.cgroup_path(), po.cgroup().name);
+
+    if (pid >= 0) {
+        CmdInfo ci(po.cmd(), po.kill_cmd(), pid, false,
+                   po.stream_fd(STDIN_FILENO),
+                   po.stream_fd(STDOUT_FILENO),
+                   po.stream_fd(STDERR_FILENO),
+                   po.kill_timeout());
+        ci.perf_fds = po.perf_fds();
+        // The child takes over compiled output filters
+        for (int i=STDOUT_FILENO; i <= STDERR_FILENO; i++) {
+            ci.tail[i]    = TailBuffer(po.tail_size(i));
+            ci.tee[i]     = po.tee(i);
+            ci.sink[i]    = po.sink(i);
+            ci.zip[i]     = po.zip(i);
+            ci.framing[i] = po.framing(i);
+            po.tee(i)     = TeeSink();
+            po.sink(i)    = FileSink();
+            po.zip(i)     = StreamCompressor();
+            po.framing(i).include.clear();
+            po.framing(i).exclude.clear();
+        }
+        ci.output_rate       = po.output_rate();
+        ci.max_output        = po.max_output();
+        ci.max_output_action = po.max_output_action();
+        ci.msg_fd            = po.msg_pipe();
+        po.msg_pipe()        = -1;
+        ci.job_class         = po.job_class();
+        ci.cpu_limit         = po.cpu_limit();
+        ci.cgroup            = po.cgroup_path();
+        ci.cgroup_name       = po.cgroup().name;
+        ci.group             = po.setsid();
+        ci.tags              = po.tags();
+        if (po.timeout() > 0) {
+            ci.timeout       = po.timeout();
+            ci.timeout_at.set(TimeVal(TimeVal::NOW), po.timeout() / 1000, po.timeout() % 1000 * 1000);
+            timeouts.insert(std::make_pair(ci.timeout_at, pid));
         }
+        if (!stages.empty()) {
+            ci.pipeline      = pid;
+            ci.stages        = stages;
+        }
+        if (po.restart() != RESTART_NEVER) {
+            // Keep the options for restarts. Files opened by the port program
+            // are handed over to the restarted command, and the files opened
+            // by the child are appended to.
+            ci.restart_opts = &po;
+            for (int i=STDIN_FILENO; i <= STDERR_FILENO; i++) {
+                po.stream_fd(i) = redirect[i];
+                if (i == STDIN_FILENO)
+                    continue;
+                else if (redirect[i] == REDIRECT_SINK || redirect[i] == REDIRECT_ERL)
+                    po.stream_redirect(i, REDIRECT_ERL);
+                else if (redirect[i] == REDIRECT_TAIL)
+                    po.stream_redirect(i, REDIRECT_TAIL);
+                else if (redirect[i] == REDIRECT_FILE)
+                    po.stream_append(i, true);
+            }
+        }
+        children[pid] = ci;
+        running_jobs++;
+        if (!ci.job_class.empty())
+            class_jobs[ci.job_class]++;
+    }
+    po.cgroup_path().clear();
+    return pid;
+}
 
-        for(MapChildrenT::iterator it=children.begin(), end=children.end(); it != end; ++it)
-            stop_child(it->second, 0, now, false);
+bool admit_child(CmdOptions& po)
+{
+    if (max_jobs > 0 && running_jobs >= max_jobs)
+        return false;
+    if (!po.job_class().empty()) {
+        MapJobClassT::const_iterator it = class_jobs.find(po.job_class());
+        if (it != class_jobs.end() && it->second >= po.job_class_max())
+            return false;
+    }
+    // Host load only holds back commands while some of ours are running,
+    // so that the queue can't stall on load caused by others
+    return running_jobs == 0 || !host_overloaded();
+}
 
-        for(MapKillPidT::iterator it=transient_pids.begin(), end=transient_pids.end(); it != end; ++it) {
-            erl_exec_kill(it->first, SIGKILL);
-            transient_pids.erase(it);
-        }
+void start_pending_runs()
+{
+    static TimeVal expired; // Last time the queue was checked for expired requests
 
-        if (children.size() == 0)
+    TimeVal now(TimeVal::NOW);
+    bool    expire = now.diff(expired) >= QUEUE_CHECK_SEC;
+
+    if (expire)
+        expired = now;
+
+    for (MapPendingT::iterator it = pending_runs.begin(), end = pending_runs.end(); it != end; ) {
+        PendingRun& run  = it->second;
+        bool        held = (max_jobs > 0 && running_jobs >= max_jobs)
+                        || (running_jobs > 0 && host_overloaded());
+
+        // Nothing can start - only look for expired requests once in a while
+        if (held && !expire)
             break;
 
-        TimeVal timeout(TimeVal::NOW);
-        if (timeout < deadline) {
-            timeout = deadline - timeout;
+        if (!run.deadline.zero() && now.diff(run.deadline) > 0) {
+            if (debug)
+                fprintf(stderr, "Queued command '%s' expired\r\n", run.opts->cmd());
+            send_error_str(run.trans_id, true, "queue_timeout");
+        } else if (held || !admit_child(*run.opts)) {
+            ++it;
+            continue;
+        } else if (run_child(*run.opts, run.trans_id) >= 0 && run.opts->restart() != RESTART_NEVER)
+            run.opts = NULL;    // Owned by the restartable child
+
+        delete run.opts;
+        pending_runs.erase(it++);
+    }
+}
 
-            oktojump = 1;
-            select (0, (fd_set *)0, (fd_set *)0, (fd_set *) 0, &timeout);
-            oktojump = 0;
-        }
+bool host_overloaded()
+{
+    static TimeVal checked;
+    static bool    overloaded = false;
+
+    if (max_load <= 0 && max_mem_pressure <= 0)
+        return false;
+
+    TimeVal now(TimeVal::NOW);
+    if (now.diff(checked) * 1000 < HOST_CHECK_MSEC)
+        return overloaded;
+    checked = now;
+
+    double load = 0, pressure = 0;
+
+    if (max_load > 0 && getloadavg(&load, 1) < 1)
+        load = 0;
+
+    #ifdef __linux__
+    // Share of time some tasks were stalled on memory over the last 10s
+    FILE* f;
+    if (max_mem_pressure > 0 && (f = fopen("/proc/pressure/memory", "r")) != NULL) {
+        if (fscanf(f, "some avg10=%lf", &pressure) != 1)
+            pressure = 0;
+        fclose(f);
     }
+    #endif
 
-    if (debug)
-        fprintf(stderr, "Exiting (%d)\r\n", old_terminated);
+    bool was = overloaded;
+    overloaded = (max_load > 0 && load > max_load) || (max_mem_pressure > 0 && pressure > max_mem_pressure);
 
-    return old_terminated;
+    if (debug && overloaded != was)
+        fprintf(stderr, "Host is %s (load=%.2f, memory pressure=%.2f%%)\r\n",
+            overloaded ? "overloaded, holding back commands" : "no longer overloaded", load, pressure);
+    return overloaded;
 }
 
-pid_t start_child(CmdOptions& op, std::string& error)
+int cgroup_init(const char* root)
 {
-    enum { RD = 0, WR = 1 };
+    #ifdef __linux__
+    const char* controllers[] = { "cpu", "memory", "io", "pids" };
+    std::string dir(root), available;
+    char        buf[256];
+    int         fd, n;
+
+    if ((fd = open((dir + "/cgroup.controllers").c_str(), O_RDONLY)) < 0 || access(root, W_OK) < 0) {
+        fprintf(stderr, "cgroup v2 directory %s is not usable: %s\r\n", root, strerror(errno));
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+        available.append(buf, n);
+    close(fd);
+
+    // The list of controllers is space separated and ends with a newline
+    for (std::string::iterator it = available.begin(); it != available.end(); ++it)
+        if (isspace(*it)) *it = ' ';
+    available = " " + available + " ";
+
+    // Enable the controllers for children one by one, so that an
+    // undelegated one doesn't disable the others
+    for (size_t i=0; i < sizeof(controllers)/sizeof(controllers[0]); i++) {
+        const char* c = controllers[i];
+        if (available.find(std::string(" ") + c + " ") == std::string::npos) {
+            if (debug)
+                fprintf(stderr, "cgroup controller '%s' is not available in %s\r\n", c, root);
+        } else if (cgroup_write(dir, "cgroup.subtree_control", std::string("+") + c) < 0 && debug)
+            fprintf(stderr, "Failed to enable cgroup controller '%s' in %s: %s\r\n", c, root, strerror(errno));
+    }
 
-    int stream_fd[][2] = {
-        { REDIRECT_NULL, REDIRECT_NONE },
-        { REDIRECT_NONE, REDIRECT_NONE },
-        { REDIRECT_NONE, REDIRECT_NONE }
-    };
+    cgroup_root = dir;
+    if (debug)
+        fprintf(stderr, "Creating cgroups of commands in %s\r\n", root);
+    return 0;
+    #else
+    fprintf(stderr, "cgroups are not supported on this platform\r\n");
+    return -1;
+    #endif
+}
 
-    ei::StringBuffer<128> err;
+int cgroup_write(const std::string& path, const char* file, const std::string& value)
+{
+    int fd = open((path + "/" + file).c_str(), O_WRONLY);
+    if (fd < 0)
+        return -1;
+    int n = write(fd, value.c_str(), value.size());
+    int e = errno;
+    close(fd);
+    errno = e;
+    return n < 0 ? -1 : 0;
+}
 
-    const char* stream[] = { "stdin", "stdout", "stderr" };
+int cgroup_create(CmdOptions& op, std::string& err)
+{
+    const CgroupSpec& spec = op.cgroup();
+    std::stringstream path, val;
 
-    // Optionally setup stdin/stdout/stderr redirect
-    for (int i=0; i < 3; i++) {
-        int  crw        = i==0 ? RD : WR;
+    if (cgroup_root.empty()) {
+        err = "no delegated cgroup is available (see -cgroup option)";
+        return -1;
+    }
+
+    // Own groups are named "cmd-<PortPid>-<Seq>" (the "cmd-" prefix is reserved
+    // for them), skipping the ones left behind by an earlier port program
+    int rc = -1;
+    if (spec.name.empty()) {
+        for (int i=0; i < 100; i++) {
+            path.str("");
+            path << cgroup_root << "/cmd-" << getpid() << '-' << ++cgroup_seq;
+            if ((rc = mkdir(path.str().c_str(), 0755)) == 0 || errno != EEXIST)
+                break;
+        }
+    } else {
+        path << cgroup_root << "/" << spec.name;
+        if ((rc = mkdir(path.str().c_str(), 0755)) < 0 && errno == EEXIST)
+            rc = 0;
+    }
+
+    if (rc < 0) {
+        err = std::string("cannot create cgroup ") + path.str() + ": " + strerror(errno);
+        return -1;
+    }
+
+    // Settings of a named group are updated by every command started in it.
+    // A setting of a controller that isn't delegated is skipped.
+    struct { const char* file; bool set; std::string value; } settings[] = {
+        { "cpu.max",    spec.cpu_quota  > 0, "" },
+        { "cpu.weight", spec.cpu_weight > 0, "" },
+        { "memory.max", spec.memory_max > 0, "" },
+        { "io.max",     !spec.io_max.empty(), spec.io_max },
+        { "pids.max",   spec.pids_max   > 0, "" }
+    };
+    val << spec.cpu_quota << ' ' << spec.cpu_period;
+    settings[0].value = val.str();  val.str("");
+    val << spec.cpu_weight;
+    settings[1].value = val.str();  val.str("");
+    val << spec.memory_max;
+    settings[2].value = val.str();  val.str("");
+    val << spec.pids_max;
+    settings[4].value = val.str();
+
+    for (size_t i=0; i < sizeof(settings)/sizeof(settings[0]); i++)
+        if (settings[i].set && cgroup_write(path.str(), settings[i].file, settings[i].value) < 0 && debug)
+            fprintf(stderr, "Cannot set %s of cgroup %s to '%s': %s\r\n",
+                settings[i].file, path.str().c_str(), settings[i].value.c_str(), strerror(errno));
+
+    if (!spec.name.empty())
+        cgroups[spec.name]++;
+
+    op.cgroup_path() = path.str();
+    #ifdef O_DIRECTORY
+    op.cgroup_fd()   = open(path.str().c_str(), O_RDONLY | O_DIRECTORY);
+    #endif
+    return 0;
+}
+
+void cgroup_release(const std::string& path, const std::string& name)
+{
+    if (path.empty())
+        return;
+
+    // A named group is removed with the last command in it
+    MapCgroupT::iterator it = cgroups.find(name);
+    if (!name.empty() && it != cgroups.end()) {
+        if (--it->second > 0)
+            return;
+        cgroups.erase(it);
+    }
+
+    // Fails if descendants of the command are still in the cgroup
+    if (rmdir(path.c_str()) < 0 && debug)
+        fprintf(stderr, "Cannot remove cgroup %s: %s\r\n", path.c_str(), strerror(errno));
+}
+
+void cgroup_stats(const std::string& path, std::list<std::pair<const char*, unsigned long long> >& stats)
+{
+    // {File, Key (NULL - single value file), Stat}
+    const char* keys[][3] = {
+        { "cpu.stat",       "usage_usec",   "cpu_usec"    },
+        { "cpu.stat",       "user_usec",    "user_usec"   },
+        { "cpu.stat",       "system_usec",  "system_usec" },
+        { "memory.peak",    NULL,           "memory_peak" },
+        { "memory.events",  "oom_kill",     "oom_kills"   },
+        { "pids.peak",      NULL,           "pids_peak"   }
+    };
+
+    for (size_t i=0; i < sizeof(keys)/sizeof(keys[0]); i++) {
+        FILE* f = fopen((path + "/" + keys[i][0]).c_str(), "r");
+        if (!f)
+            continue;
+
+        char name[64];
+        unsigned long long value;
+        bool found = false;
+
+        if (!keys[i][1])
+            found = fscanf(f, "%llu", &value) == 1;
+        else
+            while (!found && fscanf(f, "%63s %llu", name, &value) == 2)
+                found = strcmp(name, keys[i][1]) == 0;
+        fclose(f);
+
+        if (found)
+            stats.push_back(std::make_pair(keys[i][2], value));
+    }
+}
+
+pid_t fork_child(CmdOptions& op, bool& in_cgroup)
+{
+    in_cgroup = false;
+
+    #if defined(__linux__) && defined(SYS_clone3) && defined(CLONE_INTO_CGROUP)
+    // Start the child right in its cgroup (Linux 5.7+)
+    if (op.cgroup_fd() >= 0) {
+        struct clone_args args;
+        memset(&args, 0, sizeof(args));
+        args.flags       = CLONE_INTO_CGROUP;
+        args.exit_signal = SIGCHLD;
+        args.cgroup      = op.cgroup_fd();
+
+        pid_t pid = syscall(SYS_clone3, &args, sizeof(args));
+        if (pid >= 0) {
+            in_cgroup = true;
+            return pid;
+        }
+        if (debug)
+            fprintf(stderr, "clone3 into cgroup %s failed: %s\r\n",
+                op.cgroup_path().c_str(), strerror(errno));
+    }
+    #endif
+
+    return fork();
+}
+
+#ifdef __linux__
+int parse_cpu_list(const char* s, std::list<int>& cpus)
+{
+    // Format of /sys/devices/system/node/node*/cpulist, e.g. "0-3,8,10-11"
+    while (*s != '\0' && *s != '\n') {
+        char* end;
+        long lo = strtol(s, &end, 10), hi = lo;
+        if (end == s || lo < 0)
+            return -1;
+        if (*end == '-') {
+            s  = end+1;
+            hi = strtol(s, &end, 10);
+            if (end == s || hi < lo)
+                return -1;
+        }
+        if (hi >= CPU_SETSIZE || (*end != ',' && *end != '\0' && *end != '\n'))
+            return -1;
+        for (long i=lo; i <= hi; i++)
+            cpus.push_back(i);
+        s = *end == ',' ? end+1 : end;
+    }
+    return 0;
+}
+
+int numa_node_cpus(int node, std::list<int>& cpus)
+{
+    char path[64], buf[1024];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+
+    FILE* f = fopen(path, "r");
+    if (!f)
+        return -1;
+    // Nodes without CPUs (e.g. memory expanders) have an empty list
+    bool ok = fgets(buf, sizeof(buf), f) == NULL || parse_cpu_list(buf, cpus) == 0;
+    fclose(f);
+    return ok ? 0 : -1;
+}
+
+int pin_port(const char* list)
+{
+    std::list<int> cpus;
+    cpu_set_t set;
+
+    if (parse_cpu_list(list, cpus) < 0 || cpus.empty()) {
+        fprintf(stderr, "Invalid list of CPUs: %s\r\n", list);
+        return -1;
+    }
+
+    CPU_ZERO(&set);
+    for (std::list<int>::iterator it=cpus.begin(); it != cpus.end(); ++it)
+        CPU_SET(*it, &set);
+
+    if (sched_getaffinity(0, sizeof(child_cpus), &child_cpus) < 0 ||
+        sched_setaffinity(0, sizeof(set), &set) < 0) {
+        fprintf(stderr, "Cannot set CPU affinity to %s: %s\r\n", list, strerror(errno));
+        return -1;
+    }
+
+    port_pinned = true;
+    if (debug)
+        fprintf(stderr, "Pinned port program to CPUs %s\r\n", list);
+    return 0;
+}
+#endif
+
+int set_child_sched(const CmdOptions& op, ei::StringBuffer<128>& err)
+{
+    #ifdef __linux__
+    if (!op.cpus().empty() || port_pinned) {
+        cpu_set_t set = child_cpus;
+        if (!op.cpus().empty()) {
+            CPU_ZERO(&set);
+            for (std::list<int>::const_iterator it=op.cpus().begin(); it != op.cpus().end(); ++it)
+                CPU_SET(*it, &set);
+        }
+        if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+            err.write("Cannot set CPU affinity");
+            return -1;
+        }
+    }
+
+    if (op.numa_node() >= 0) {
+        const int bits = 8*sizeof(unsigned long);
+        unsigned long mask[MAX_NUMA_NODES / (8*sizeof(unsigned long))];
+        memset(mask, 0, sizeof(mask));
+        mask[op.numa_node() / bits] |= 1ul << (op.numa_node() % bits);
+        if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, MAX_NUMA_NODES+1) < 0) {
+            err.write("Cannot prefer memory of NUMA node %d", op.numa_node());
+            return -1;
+        }
+    }
+
+    if (op.ioprio() >= 0 && syscall(SYS_ioprio_set, IOPRIO_PROCESS, 0, op.ioprio()) < 0) {
+        err.write("Cannot set I/O priority to %d", op.ioprio());
+        return -1;
+    }
+
+    if (op.sched_policy() >= 0) {
+        struct sched_param sp;
+        sp.sched_priority = op.sched_priority();
+        if (sched_setscheduler(0, op.sched_policy(), &sp) < 0) {
+            err.write("Cannot set scheduling policy %d", op.sched_policy());
+            return -1;
+        }
+    }
+    #endif
+    return 0;
+}
+
+pid_t start_pool_worker(const std::string& name, WorkerPool& pool)
+{
+    CmdOptions& po = *pool.opts;
+    std::string err;
+    int fds[3];
+
+    // start_child() replaces redirect types with pipe descriptors, which
+    // are restored for the next worker
+    for (int i=STDIN_FILENO; i <= STDERR_FILENO; i++)
+        fds[i] = po.stream_fd(i);
+
+    pid_t pid = start_child(po, err);
+
+    for (int i=STDIN_FILENO; i <= STDERR_FILENO; i++)
+        std::swap(fds[i], po.stream_fd(i));
+
+    if (pid < 0) {
+        if (debug)
+            fprintf(stderr, "Couldn't start a worker of pool '%s': %s\r\n", name.c_str(), err.c_str());
+        return pid;
+    }
+
+    CmdInfo ci(po.cmd(), po.kill_cmd(), pid, false,
+               fds[STDIN_FILENO], fds[STDOUT_FILENO], fds[STDERR_FILENO],
+               po.kill_timeout());
+    // Compiled filters are owned by the pool's options and released with them
+    for (int i=STDOUT_FILENO; i <= STDERR_FILENO; i++) {
+        ci.framing[i] = po.framing(i);
+        ci.framing[i].include.clear();
+        ci.framing[i].exclude.clear();
+    }
+    ci.pool  = name;
+    ci.group = po.setsid();
+    ci.tags  = po.tags();
+    children[pid] = ci;
+    pool.idle.push_back(pid);
+
+    if (debug)
+        fprintf(stderr, "Started worker %d of pool '%s'\r\n", pid, name.c_str());
+    return pid;
+}
+
+void dispatch_pool_requests(WorkerPool& pool)
+{
+    while (!pool.queue.empty() && !pool.idle.empty()) {
+        MapChildrenT::iterator it = children.find(pool.idle.front());
+        pool.idle.pop_front();
+        if (it == children.end() || it->second.sigterm || it->second.sigkill ||
+            it->second.stream_fd[STDIN_FILENO] < 0)
+            continue;
+
+        CmdInfo&     ci  = it->second;
+        PoolRequest& req = pool.queue.front();
+        size_t       len = req.data.size();
+        char         hdr[4] = { (char)(len >> 24), (char)(len >> 16), (char)(len >> 8), (char)len };
+
+        ci.pool_trans = req.trans_id;
+        ci.stdin_queue.push_front(std::string(hdr, sizeof(hdr)) + req.data);
+        pool.queue.pop_front();
+        process_pid_input(ci);
+    }
+}
+
+void pool_worker_exited(CmdInfo& ci)
+{
+    MapPoolT::iterator it = pools.find(ci.pool);
+
+    if (ci.pool_trans)
+        send_error_str(ci.pool_trans, true, "worker_exited");
+    ci.pool_trans = 0;
+
+    if (it == pools.end())  // The pool is being stopped
+        return;
+
+    it->second.idle.remove(ci.cmd_pid);
+    it->second.missing++;
+
+    if (debug)
+        fprintf(stderr, "Worker %d of pool '%s' exited\r\n", ci.cmd_pid, ci.pool.c_str());
+}
+
+bool restart_pool_workers()
+{
+    bool    restarting = false;
+    TimeVal now(TimeVal::NOW);
+
+    for (MapPoolT::iterator it = pools.begin(), end = pools.end(); it != end; ++it) {
+        WorkerPool& pool = it->second;
+        if (pool.missing == 0)
+            continue;
+        // Don't spin on a command that keeps failing
+        if (now.diff(pool.restart_time) * 1000 >= POOL_RESTART_MSEC) {
+            pool.restart_time = now;
+            for (int n = pool.missing; n > 0; n--)
+                if (start_pool_worker(it->first, pool) > 0)
+                    pool.missing--;
+            dispatch_pool_requests(pool);
+        }
+        restarting = restarting || pool.missing > 0;
+    }
+    return restarting;
+}
+
+void stop_pool(const std::string& name)
+{
+    MapPoolT::iterator it = pools.find(name);
+    if (it == pools.end())
+        return;
+
+    WorkerPool& pool = it->second;
+    TimeVal     now(TimeVal::NOW);
+
+    for (MapChildrenT::iterator c = children.begin(), end = children.end(); c != end; ++c) {
+        CmdInfo& ci = c->second;
+        if (ci.pool != name)
+            continue;
+        if (ci.pool_trans)
+            send_error_str(ci.pool_trans, true, "pool_stopped");
+        ci.pool_trans = 0;
+        stop_child(ci, 0, now, false);
+    }
+
+    for (std::deque<PoolRequest>::iterator r = pool.queue.begin(); r != pool.queue.end(); ++r)
+        send_error_str(r->trans_id, true, "pool_stopped");
+
+    delete pool.opts;
+    pools.erase(it);
+}
+
+/// Decode the term at the current read position in its external format
+static int decode_term(std::string& term)
+{
+    int start = eis.read_idx();
+    if (ei_skip_term(eis.read_buffer(), eis.read_index()) < 0)
+        return -1;
+    term.assign(eis.read_buffer() + start, eis.read_idx() - start);
+    return 0;
+}
+
+/// Exit info and messages of a node's OsPid are not delivered to Erlang,
+/// so the options producing them are rejected
+static bool dag_node_options_ok(CmdOptions& op)
+{
+    if (op.sync_limit() > 0 || op.restart() != RESTART_NEVER || op.msg_fd() > 0 ||
+        !op.perf_events().empty() || op.timeout() > 0 || op.cpu_limit() > 0 || op.max_output() > 0)
+        return false;
+    for (int i=STDOUT_FILENO; i <= STDERR_FILENO; i++)
+        if (op.tail_size(i) > 0 || op.sink(i).spool)
+            return false;
+    return true;
+}
+
+int decode_dag(Dag& dag, std::string& error)
+{
+    // Nodes   = [{Id::term(), Cmd::string(), Options::list()}]
+    // Edges   = [{From::term(), To::term()}]
+    // Options = [{max_parallel, N::integer()}]
+    std::map<std::string, int> index;
+    std::stringstream err;
+    int n;
+
+    if ((n = eis.decodeListSize()) < 0) {
+        error = "list of dag nodes expected";
+        return -1;
+    }
+    for (int i=0; i < n; i++) {
+        dag.nodes.push_back(DagNode());
+        DagNode& node = dag.nodes.back();
+
+        if (eis.decodeTupleSize() != 3 || decode_term(node.id) < 0) {
+            err << "dag node #" << i << " must be {Id, Cmd, Options}";
+            error = err.str();
+            return -1;
+        } else if (index.find(node.id) != index.end()) {
+            err << "duplicate dag node #" << i;
+            error = err.str();
+            return -1;
+        }
+        node.opts = new CmdOptions();
+        if (node.opts->ei_decode(eis, true) < 0) {
+            err << "dag node #" << i << ": " << node.opts->strerror();
+            error = err.str();
+            return -1;
+        } else if (!dag_node_options_ok(*node.opts)) {
+            err << "dag node #" << i << ": sync, restart, msg, perf_counters, timeout, cpu_limit,"
+                   " max_output, tail and spool options are not supported by dag nodes";
+            error = err.str();
+            return -1;
+        }
+        index[node.id] = i;
+    }
+    if (n > 0 && eis.decodeListEnd() < 0) {
+        error = "proper list of dag nodes expected";
+        return -1;
+    }
+
+    if ((n = eis.decodeListSize()) < 0) {
+        error = "list of dag edges expected";
+        return -1;
+    }
+    for (int i=0; i < n; i++) {
+        std::string from, to;
+        std::map<std::string, int>::iterator f, t;
+        if (eis.decodeTupleSize() != 2 || decode_term(from) < 0 || decode_term(to) < 0) {
+            err << "dag edge #" << i << " must be {From, To}";
+            error = err.str();
+            return -1;
+        } else if ((f = index.find(from)) == index.end() || (t = index.find(to)) == index.end()) {
+            err << "dag edge #" << i << " refers to an unknown node";
+            error = err.str();
+            return -1;
+        }
+        dag.nodes[f->second].next.push_back(t->second);
+        dag.nodes[t->second].waiting++;
+    }
+    if (n > 0 && eis.decodeListEnd() < 0) {
+        error = "proper list of dag edges expected";
+        return -1;
+    }
+
+    if ((n = eis.decodeListSize()) < 0) {
+        error = "list of dag options expected";
+        return -1;
+    }
+    for (int i=0; i < n; i++) {
+        std::string opt;
+        long val;
+        if (eis.decodeTupleSize() != 2 || eis.decodeAtom(opt) < 0 || opt != "max_parallel" ||
+            eis.decodeInt(val) < 0 || val <= 0) {
+            error = "invalid dag option: expected {max_parallel, N}";
+            return -1;
+        }
+        dag.max_parallel = val;
+    }
+
+    // Nodes without predecessors start first.  Visiting nodes in the
+    // topological order finds dependency cycles.
+    std::deque<int> waiting, order;
+    for (int i=0; i < (int)dag.nodes.size(); i++) {
+        waiting.push_back(dag.nodes[i].waiting);
+        if (waiting[i] == 0) {
+            dag.ready.push_back(i);
+            order.push_back(i);
+        }
+    }
+    for (size_t k=0; k < order.size(); k++) {
+        std::list<int>& next = dag.nodes[order[k]].next;
+        for (std::list<int>::iterator it = next.begin(); it != next.end(); ++it)
+            if (--waiting[*it] == 0)
+                order.push_back(*it);
+    }
+    if (order.size() < dag.nodes.size()) {
+        error = "dag has a dependency cycle";
+        return -1;
+    }
+
+    dag.left = dag.nodes.size();
+    return 0;
+}
+
+bool run_dags()
+{
+    bool held = false;
+
+    for (MapDagT::iterator it = dags.begin(), end = dags.end(); it != end; ) {
+        Dag& dag = it->second;
+
+        while (!dag.ready.empty() && (dag.max_parallel == 0 || dag.running < dag.max_parallel)) {
+            int      i    = dag.ready.front();
+            DagNode& node = dag.nodes[i];
+
+            if (node.state != DagNode::PENDING) {
+                dag.ready.pop_front();
+                continue;
+            }
+            // Global admission limits hold back the node until children exit
+            if (!admit_child(*node.opts)) {
+                held = true;
+                break;
+            }
+            dag.ready.pop_front();
+
+            std::string err;
+            node.pid = spawn_child(*node.opts, err);
+            delete node.opts;
+            node.opts = NULL;
+
+            if (node.pid < 0) {
+                DagEvent ev = { i, DagEvent::FAILED, 0, err };
+                node.state = DagNode::DONE;
+                dag.left--;
+                dag.failed = true;
+                dag.events.push_back(ev);
+                cancel_dag_nodes(dag, i);
+                continue;
+            }
+
+            CmdInfo& ci = children[node.pid];
+            ci.dag      = it->first;
+            ci.dag_node = i;
+            node.state  = DagNode::RUNNING;
+            dag.running++;
+        }
+
+        send_dag_events(it->first, dag);
+
+        if (dag.left > 0) {
+            ++it;
+            continue;
+        }
+
+        // Reply: {0, {dag_done, Id::integer(), ok | failed}}
+        eis.reset();
+        eis.encodeTupleSize(2);
+        eis.encode(0);
+        eis.encodeTupleSize(3);
+        eis.encode(atom_t("dag_done"));
+        eis.encode(it->first);
+        eis.encode(atom_t(dag.failed ? "failed" : "ok"));
+        eis.write();
+
+        if (debug)
+            fprintf(stderr, "Dag %ld is done%s\r\n", it->first, dag.failed ? " (failed)" : "");
+
+        free_dag(dag);
+        dags.erase(it++);
+    }
+    return held;
+}
+
+int send_dag_events(long id, Dag& dag)
+{
+    if (dag.events.empty())
+        return 0;
+
+    // Reply: {0, {dag, Id::integer(), [{NodeId, {exit_status, Status} | cancelled | {error, Reason}}]}}
+    eis.reset();
+    eis.encodeTupleSize(2);
+    eis.encode(0);
+    eis.encodeTupleSize(3);
+    eis.encode(atom_t("dag"));
+    eis.encode(id);
+    eis.encodeListSize(dag.events.size());
+    for (std::list<DagEvent>::iterator it = dag.events.begin(); it != dag.events.end(); ++it) {
+        const std::string& node = dag.nodes[it->node].id;
+        eis.encodeTupleSize(2);
+        eis.encodeTerm(node.c_str(), node.size());
+        switch (it->type) {
+            case DagEvent::EXITED:
+                eis.encodeTupleSize(2);
+                eis.encode(atom_t("exit_status"));
+                eis.encode(it->status);
+                break;
+            case DagEvent::CANCELLED:
+                eis.encode(atom_t("cancelled"));
+                break;
+            case DagEvent::FAILED:
+                eis.encodeTupleSize(2);
+                eis.encode(atom_t("error"));
+                eis.encode(it->error);
+                break;
+        }
+    }
+    eis.encodeListEnd();
+    dag.events.clear();
+    return eis.write();
+}
+
+void dag_node_exited(CmdInfo& ci, int status)
+{
+    MapDagT::iterator it = dags.find(ci.dag);
+    if (it == dags.end())
+        return;
+
+    Dag&     dag  = it->second;
+    DagNode& node = dag.nodes[ci.dag_node];
+    DagEvent ev   = { ci.dag_node, DagEvent::EXITED, status, "" };
+
+    node.state = DagNode::DONE;
+    dag.running--;
+    dag.left--;
+    dag.events.push_back(ev);
+
+    if (status == 0) {
+        for (std::list<int>::iterator n = node.next.begin(); n != node.next.end(); ++n)
+            if (--dag.nodes[*n].waiting == 0 && dag.nodes[*n].state == DagNode::PENDING)
+                dag.ready.push_back(*n);
+    } else {
+        dag.failed = true;
+        cancel_dag_nodes(dag, ci.dag_node);
+    }
+}
+
+void cancel_dag_nodes(Dag& dag, int node)
+{
+    // Cancel all dependants of the node
+    std::deque<int> todo(dag.nodes[node].next.begin(), dag.nodes[node].next.end());
+
+    while (!todo.empty()) {
+        int      i = todo.front();
+        DagNode& n = dag.nodes[i];
+        todo.pop_front();
+        if (n.state != DagNode::PENDING)
+            continue;
+
+        DagEvent ev = { i, DagEvent::CANCELLED, 0, "" };
+        n.state = DagNode::CANCELLED;
+        delete n.opts;
+        n.opts  = NULL;
+        dag.left--;
+        dag.events.push_back(ev);
+        todo.insert(todo.end(), n.next.begin(), n.next.end());
+    }
+}
+
+void stop_dag(Dag& dag)
+{
+    TimeVal now(TimeVal::NOW);
+
+    dag.failed = true;
+
+    for (int i=0; i < (int)dag.nodes.size(); i++) {
+        DagNode& n = dag.nodes[i];
+        if (n.state == DagNode::PENDING) {
+            DagEvent ev = { i, DagEvent::CANCELLED, 0, "" };
+            n.state = DagNode::CANCELLED;
+            delete n.opts;
+            n.opts  = NULL;
+            dag.left--;
+            dag.events.push_back(ev);
+        } else if (n.state == DagNode::RUNNING) {
+            MapChildrenT::iterator it = children.find(n.pid);
+            if (it != children.end())
+                stop_child(it->second, 0, now, false);
+        }
+    }
+}
+
+void free_dag(Dag& dag)
+{
+    for (std::deque<DagNode>::iterator it = dag.nodes.begin(); it != dag.nodes.end(); ++it) {
+        delete it->opts;
+        it->opts = NULL;
+    }
+}
+
+bool schedule_restart(CmdInfo& ci, int status)
+{
+    const CmdOptions& po = *ci.restart_opts;
+    TimeVal now(TimeVal::NOW);
+
+    // A command stopped by request or a transient one that exited normally stays down
+    if ((ci.sigterm && !ci.timed_out) || (po.restart() == RESTART_TRANSIENT && status == 0))
+        return false;
+
+    // Forget restarts that fell out of the restart window
+    while (!ci.restarts.empty() && now.diff(ci.restarts.front()) >= po.restart_within())
+        ci.restarts.pop_front();
+
+    if ((int)ci.restarts.size() >= po.max_restarts()) {
+        if (debug)
+            fprintf(stderr, "Pid %d reached max restarts (%d in %ds)\r\n",
+                ci.cmd_pid, po.max_restarts(), po.restart_within());
+        return false;
+    }
+
+    // The pid stays in <children> without its pipes until it's restarted
+    for (int i=STDIN_FILENO; i <= STDERR_FILENO; i++)
+        if (ci.stream_fd[i] >= 0) {
+            close(ci.stream_fd[i]);
+            ci.stream_fd[i] = REDIRECT_NONE;
+        }
+    if (ci.msg_fd >= 0) {
+        close(ci.msg_fd);
+        ci.msg_fd = REDIRECT_NONE;
+    }
+    ci.stdin_queue.clear();
+    ci.stdin_wr_pos = 0;
+    // Stopping the command from now on cancels the restart
+    ci.sigterm      = ci.sigkill = ci.timed_out = ci.cpu_out = false;
+
+    int64_t backoff = (int64_t)po.restart_backoff() * 1000
+                    << std::min((int)ci.restarts.size(), MAX_BACKOFF_SHIFT);
+    ci.restart_at  = now;
+    ci.restart_at += backoff;
+    ci.reaped      = true;
+    ci.exit_status = status;
+    restart_pending.push_back(ci.cmd_pid);
+
+    if (debug)
+        fprintf(stderr, "Pid %d exited with status %d, restarting in %lldms\r\n",
+            ci.cmd_pid, status, (long long)backoff / 1000);
+    return true;
+}
+
+bool restart_children(TimeVal& next, bool notify)
+{
+    TimeVal now(TimeVal::NOW);
+
+    for (std::list<pid_t>::iterator p = restart_pending.begin(); p != restart_pending.end(); ) {
+        MapChildrenT::iterator it = children.find(*p);
+        if (it == children.end())
+            restart_pending.erase(p++);
+        else if (it->second.sigterm || now.diff(it->second.restart_at) >= 0) {
+            restart_pending.erase(p++);
+            restart_child(it, notify);
+        } else {
+            if (next.zero() || it->second.restart_at.diff(next) < 0)
+                next = it->second.restart_at;
+            ++p;
+        }
+    }
+    return !restart_pending.empty();
+}
+
+void restart_child(MapChildrenT::iterator& it, bool notify)
+{
+    CmdInfo&    old = it->second;
+    pid_t       pid = -1;
+    std::string err;
+
+    if (!old.sigterm && (pid = spawn_child(*old.restart_opts, err)) < 0 && debug)
+        fprintf(stderr, "Failed to restart pid %d: %s\r\n", old.cmd_pid, err.c_str());
+
+    if (pid < 0) {
+        // The command is down for good
+        if (notify)
+            send_pid_status_term(PidStatusT(old.cmd_pid, old.sigterm ? 0 : old.exit_status), &old);
+        erase_child(it);
+        return;
+    }
+
+    // The restarted command takes over output filters and files of the old one
+    CmdInfo& ci = children[pid];
+    for (int i=STDOUT_FILENO; i <= STDERR_FILENO; i++) {
+        ci.tail[i]    = old.tail[i];
+        ci.tee[i]     = old.tee[i];
+        ci.sink[i]    = old.sink[i];
+        ci.framing[i] = old.framing[i];
+        old.tee[i]    = TeeSink();
+        old.sink[i]   = FileSink();
+        old.framing[i].include.clear();
+        old.framing[i].exclude.clear();
+        // Output of the restarted command is compressed as a new stream
+        ci.zip[i].level       = old.zip[i].level;
+        ci.zip[i].flush_bytes = old.zip[i].flush_bytes;
+        if (ci.zip[i].level >= 0 && ci.zip[i].init() < 0)
+            ci.zip[i].level = -1;
+    }
+    ci.restarts = old.restarts;
+    ci.restarts.push_back(TimeVal(TimeVal::NOW));
+    old.restart_opts = NULL;
+
+    if (debug)
+        fprintf(stderr, "Restarted pid %d as %d (restarts=%ld)\r\n",
+            old.cmd_pid, pid, (long)ci.restarts.size());
+
+    // Reply: {0, {restarted, OldOsPid::integer(), NewOsPid::integer(), Status::integer()}}
+    if (notify) {
+        eis.reset();
+        eis.encodeTupleSize(2);
+        eis.encode(0);
+        eis.encodeTupleSize(4);
+        eis.encode(atom_t("restarted"));
+        eis.encode(old.cmd_pid);
+        eis.encode(pid);
+        eis.encode(old.exit_status);
+        eis.write();
+    }
+    erase_child(it);
+}
+
+bool expire_timeouts(TimeVal& next)
+{
+    TimeVal now(TimeVal::NOW);
+
+    while (!timeouts.empty() && timeouts.begin()->first <= now) {
+        pid_t pid = timeouts.begin()->second;
+        timeouts.erase(timeouts.begin());
+
+        MapChildrenT::iterator it = children.find(pid);
+        if (it == children.end() || it->second.reaped || it->second.sigterm)
+            continue;
+
+        if (debug)
+            fprintf(stderr, "Pid %d is over its timeout of %dms - stopping it\r\n",
+                pid, it->second.timeout);
+        it->second.timed_out = true;
+        stop_child(it->second, 0, now, false);
+    }
+
+    if (timeouts.empty())
+        return false;
+    next = timeouts.begin()->first;
+    return true;
+}
+
+void shorten_timeout(TimeVal& timeout, const TimeVal& due)
+{
+    TimeVal wait = due - TimeVal(TimeVal::NOW);
+    if (wait.microsec() < 0)
+        wait = TimeVal();
+    if (wait.microsec() < timeout.microsec())
+        timeout = wait;
+}
+
+int finalize()
+{
+    if (debug) fprintf(stderr, "Setting alarm to %d seconds\r\n", alarm_max_time);
+    alarm(alarm_max_time);  // Die in <alarm_max_time> seconds if not done
+
+    int old_terminated = terminated;
+    terminated = 0;
+
+    erl_exec_kill(0, SIGTERM); // Kill all children in our process group
+
+    TimeVal now(TimeVal::NOW);
+    TimeVal deadline(now, 6, 0);
+
+    while (children.size() > 0) {
+        sigsetjmp(jbuf, 1);
+
+        if (children.size() > 0 || !exited_children.empty()) {
+            int term = 0;
+            check_children(term, pipe_valid);
+        }
+
+        for(MapChildrenT::iterator it=children.begin(), end=children.end(); it != end; ++it)
+            stop_child(it->second, 0, now, false);
+
+        // Stopped children waiting for a restart are reported right away
+        if (!restart_pending.empty()) {
+            TimeVal next;
+            restart_children(next, pipe_valid);
+        }
+
+        for(MapKillPidT::iterator it=transient_pids.begin(), end=transient_pids.end(); it != end; ++it) {
+            erl_exec_kill(it->first, SIGKILL);
+            transient_pids.erase(it);
+        }
+
+        if (children.size() == 0)
+            break;
+
+        TimeVal timeout(TimeVal::NOW);
+        if (timeout < deadline) {
+            timeout = deadline - timeout;
+
+            oktojump = 1;
+            select (0, (fd_set *)0, (fd_set *)0, (fd_set *) 0, &timeout);
+            oktojump = 0;
+        }
+    }
+
+    if (capture_file && fflush(capture_file) != 0)
+        close_capture("flush");
+    if (capture_file)
+        fclose(capture_file);
+
+    if (debug)
+        fprintf(stderr, "Exiting (%d)\r\n", old_terminated);
+
+    return old_terminated;
+}
+
+pid_t start_child(CmdOptions& op, std::string& error, int (*stage_fds)[2])
+{
+    enum { RD = 0, WR = 1 };
+
+    int stream_fd[][2] = {
+        { REDIRECT_NULL, REDIRECT_NONE },
+        { REDIRECT_NONE, REDIRECT_NONE },
+        { REDIRECT_NONE, REDIRECT_NONE }
+    };
+
+    ei::StringBuffer<128> err;
+
+    const char* stream[] = { "stdin", "stdout", "stderr" };
+
+    // Optionally setup stdin/stdout/stderr redirect
+    for (int i=0; i < 3; i++) {
+        int  crw        = i==0 ? RD : WR;
         int  cfd        = op.stream_fd(i);
         int* sfd        = stream_fd[i];
         const char* file= op.stream_file(i);
         bool append     = op.stream_append(i);
 
+        // A pipeline stage gets the given pipe ends instead of the redirect.
+        // Only the parent end of a stage pipe sets up output forwarding.
+        bool staged     = stage_fds && (stage_fds[i][RD] >= 0 || stage_fds[i][WR] >= 0);
+        if (staged) {
+            sfd[RD] = stage_fds[i][RD];
+            sfd[WR] = stage_fds[i][WR];
+            if (sfd[crw == RD ? WR : RD] < 0)
+                continue;
+        }
+
         // Optionally setup stdout redirect
         switch (cfd) {
             case REDIRECT_CLOSE:
@@ -871,7 +3090,19 @@ pid_t start_child(CmdOptions& op, std::string& error)
                     fprintf(stderr, "  Redirecting [%s -> %s]\r\n", stream[i], fd_type(cfd).c_str());
                 break;
             case REDIRECT_ERL:
-                if (open_pipe(sfd, stream[i], err) < 0) {
+            case REDIRECT_TAIL:
+                if (!staged && open_pipe(sfd, stream[i], err) < 0) {
+                    error = err.c_str();
+                    return -1;
+                }
+                // {Stream, {tee, File, Sink}}
+                if (file[0] != '\0' && open_tee(op.tee(i), file, append, stream[i], op.cmd(), err) < 0) {
+                    error = err.c_str();
+                    return -1;
+                }
+                break;
+            case REDIRECT_SINK:
+                if ((!staged && open_pipe(sfd, stream[i], err) < 0) || op.sink(i).open(stream[i], err) < 0) {
                     error = err.c_str();
                     return -1;
                 }
@@ -905,14 +3136,62 @@ pid_t start_child(CmdOptions& op, std::string& error)
             fd_type(stream_fd[STDERR_FILENO][RD]).c_str()
         );
 
-    pid_t pid = fork();
+    EXEC_PROBE1(spawn_start, op.cmd());
+
+    // When performance counters are requested, the child waits on this pipe
+    // until the parent attaches the counters to it, so that the counting
+    // starts on its execve(2).
+    int sync_fd[2] = { -1, -1 };
+
+    if (!op.perf_events().empty() && pipe(sync_fd) < 0) {
+        err.write("Failed to create a pipe for perf counters: %s", strerror(errno));
+        error = err.c_str();
+        return -1;
+    }
+
+    // Messages sent by the child on the {msg, Fd} channel
+    int msg_fd[2] = { -1, -1 };
+
+    if (op.msg_fd() > 0 && open_pipe(msg_fd, "messages", err) < 0) {
+        error = err.c_str();
+        if (sync_fd[RD] >= 0) {
+            close(sync_fd[RD]);
+            close(sync_fd[WR]);
+        }
+        return -1;
+    }
+
+    bool  in_cgroup;
+    pid_t pid = fork_child(op, in_cgroup);
 
     if (pid < 0) {
         error = strerror(errno);
+        EXEC_PROBE2(spawn_end, pid, op.cmd());
+        for (int i=RD; i <= WR; i++) {
+            if (sync_fd[i] >= 0) close(sync_fd[i]);
+            if (msg_fd[i]  >= 0) close(msg_fd[i]);
+        }
         return pid;
     } else if (pid == 0) {
         // I am the child
 
+        // Without clone3(2) the child moves itself to its cgroup
+        if (!in_cgroup && !op.cgroup_path().empty())
+            cgroup_write(op.cgroup_path(), "cgroup.procs", "0");
+
+        // Descendants stay in the process group so that they are signaled with the child
+        if (op.setsid() && ::setsid() < 0) {
+            err.write("Cannot create a session");
+            perror(err.c_str());
+            _exit(EXIT_FAILURE);
+        }
+
+        if (sync_fd[RD] >= 0) {
+            char c;
+            close(sync_fd[WR]);
+            while (read(sync_fd[RD], &c, 1) < 0 && errno == EINTR);
+        }
+
         // Setup stdin/stdout/stderr redirect
         for (int fd=STDIN_FILENO; fd <= STDERR_FILENO; fd++) {
             int  crw = fd==STDIN_FILENO ? RD : WR;
@@ -937,47 +3216,75 @@ pid_t start_child(CmdOptions& op, std::string& error)
             }
         }
 
+        if (msg_fd[WR] >= 0) {
+            close(msg_fd[RD]);
+            if (msg_fd[WR] != op.msg_fd())
+                dup2(msg_fd[WR], op.msg_fd());
+        }
+
         for(int i=STDERR_FILENO+1; i < max_fds; i++)
-            close(i);
+            if (i != op.msg_fd())
+                close(i);
+
+        // Done before switching the user while the port's CAP_SYS_NICE is retained
+        if (set_child_sched(op, err) < 0) {
+            perror(err.c_str());
+            _exit(EXIT_FAILURE);
+        }
 
         #if !defined(__CYGWIN__) && !defined(__WIN32)
         if (op.user() != INT_MAX && setresuid(op.user(), op.user(), op.user()) < 0) {
             err.write("Cannot set effective user to %d", op.user());
             perror(err.c_str());
-            return EXIT_FAILURE;
+            _exit(EXIT_FAILURE);
         }
         #endif
 
         if (op.group() != INT_MAX && setgid(op.group()) < 0) {
             err.write("Cannot set effective group to %d", op.group());
             perror(err.c_str());
-            return EXIT_FAILURE;
+            _exit(EXIT_FAILURE);
+        }
+
+        // SIGXCPU is sent at the CPU limit, and SIGKILL a second later
+        // if the process handles it
+        struct rlimit cpu = { (rlim_t)op.cpu_limit(), (rlim_t)op.cpu_limit() + 1 };
+        if (op.cpu_limit() > 0 && setrlimit(RLIMIT_CPU, &cpu) < 0) {
+            err.write("Cannot set CPU time limit to %ds", op.cpu_limit());
+            perror(err.c_str());
+            _exit(EXIT_FAILURE);
         }
 
         const char* const argv[] = { getenv("SHELL"), "-c", op.cmd(), (char*)NULL };
         if (op.cd() != NULL && op.cd()[0] != '\0' && chdir(op.cd()) < 0) {
             err.write("Cannot chdir to '%s'", op.cd());
             perror(err.c_str());
-            return EXIT_FAILURE;
+            _exit(EXIT_FAILURE);
         }
 
         // Setup process environment
         if (op.init_cenv() < 0) {
             perror(err.c_str());
-            return EXIT_FAILURE;
+            _exit(EXIT_FAILURE);
         }
 
         // Execute the process
         if (execve((const char*)argv[0], (char* const*)argv, op.env()) < 0) {
             err.write("Cannot execute '%s'", op.cmd());
             perror(err.c_str());
-            return EXIT_FAILURE;
+            _exit(EXIT_FAILURE);
         }
         // On success execve never returns
-        return EXIT_FAILURE;
+        _exit(EXIT_FAILURE);
     }
 
     // I am the parent
+    if (sync_fd[RD] >= 0) {
+        close(sync_fd[RD]);
+        open_perf_counters(pid, op);
+        close(sync_fd[WR]); // Let the child proceed with execve(2)
+    }
+
     for (int i=0; i < 3; i++) {
         int  wr  = i==0 ? WR : RD;
         int& cfd = op.stream_fd(i);
@@ -1003,12 +3310,115 @@ pid_t start_child(CmdOptions& op, std::string& error)
         }
     }
 
+    if (msg_fd[RD] >= 0) {
+        close(msg_fd[WR]);
+        set_nonblock_flag(pid, msg_fd[RD], true);
+        op.msg_pipe() = msg_fd[RD];
+        if (debug)
+            fprintf(stderr, "  Setup reading end of pid %d messages (fd=%d, child fd=%d)\r\n",
+                pid, msg_fd[RD], op.msg_fd());
+    }
+
     if (op.nice() != INT_MAX && setpriority(PRIO_PROCESS, pid, op.nice()) < 0) {
         err.write("Cannot set priority of pid %d to %d", pid, op.nice());
         error = err.c_str();
         if (debug)
             fprintf(stderr, "%s\r\n", error.c_str());
     }
+
+    EXEC_PROBE2(spawn_end, pid, op.cmd());
+    return pid;
+}
+
+pid_t start_pipeline(CmdOptions& op, std::string& error, std::list<PidStatusT>& stages)
+{
+    enum { RD = 0, WR = 1 };
+
+    const std::list<std::string>& cmds = op.stages();
+
+    // Stdin redirect applies to the first stage and stdout redirect to the
+    // last one.  Stderr of all stages sent to Erlang is merged into the
+    // pipe read by the last stage's CmdInfo.
+    int  err_type = op.stream_fd(STDERR_FILENO);
+    int  err_fd[2]= { -1, -1 };
+    int  in_fd    = -1;     // Reading end of the previous stage's stdout
+    int  n        = 0;
+    int  last     = cmds.size() - 1;
+    pid_t pid     = -1;
+
+    if (err_type == REDIRECT_ERL || err_type == REDIRECT_TAIL || err_type == REDIRECT_SINK) {
+        // The read end is selected on as the last stage's stderr
+        ei::StringBuffer<128> err;
+        if (open_pipe(err_fd, "stderr", err) < 0) {
+            error = err.c_str();
+            return -1;
+        }
+    }
+
+    for (std::list<std::string>::const_iterator it = cmds.begin(); it != cmds.end(); ++it, ++n) {
+        int fds[3][2] = { { in_fd, -1 }, { -1, -1 }, { -1, -1 } };
+        int out[2]    = { -1, -1 };
+
+        if (n < last) {
+            if (pipe(out) < 0) {
+                error = std::string("Failed to create a pipe between stages: ") + strerror(errno);
+                pid   = -1;
+                break;
+            }
+            fds[STDOUT_FILENO][WR] = out[WR];
+            if (err_fd[WR] >= 0)
+                fds[STDERR_FILENO][WR] = dup(err_fd[WR]);
+        } else if (err_fd[RD] >= 0) {
+            fds[STDERR_FILENO][RD] = err_fd[RD];
+            fds[STDERR_FILENO][WR] = err_fd[WR];
+            err_fd[RD] = err_fd[WR] = -1;
+        }
+
+        op.cmd(*it);
+        in_fd = out[RD];
+
+        if ((pid = start_child(op, error, fds)) < 0) {
+            for (int i=STDIN_FILENO; i <= STDERR_FILENO; i++)
+                for (int j=RD; j <= WR; j++)
+                    if (fds[i][j] >= 0) close(fds[i][j]);
+            break;
+        }
+
+        if (debug)
+            fprintf(stderr, "Started stage %d/%d of pipeline: %d '%s'\r\n",
+                n+1, last+1, pid, it->c_str());
+        stages.push_back(PidStatusT(pid, INT_MIN));
+    }
+
+    for (int j=RD; j <= WR; j++)
+        if (err_fd[j] >= 0) close(err_fd[j]);
+
+    if (pid < 0) {
+        if (in_fd >= 0)
+            close(in_fd);
+        // The first stage left the writing end of its stdin pipe in the options
+        if (op.stream_fd(STDIN_FILENO) >= 0) {
+            close(op.stream_fd(STDIN_FILENO));
+            op.stream_fd(STDIN_FILENO) = REDIRECT_CLOSE;
+        }
+        // Don't leave a partial pipeline behind
+        for (std::list<PidStatusT>::iterator s = stages.begin(); s != stages.end(); ++s) {
+            erl_exec_kill(s->first, SIGKILL);
+            while (waitpid(s->first, NULL, 0) < 0 && errno == EINTR);
+        }
+        stages.clear();
+        return -1;
+    }
+
+    // The last stage stands for the pipeline (see run_child())
+    std::list<std::string>::const_iterator c = cmds.begin();
+    for (std::list<PidStatusT>::iterator s = stages.begin(); s->first != pid; ++s, ++c) {
+        CmdInfo ci(c->c_str(), "", s->first, false,
+                   REDIRECT_NONE, REDIRECT_NONE, REDIRECT_NONE, op.kill_timeout());
+        ci.pipeline = pid;
+        ci.group    = op.setsid();
+        children[s->first] = ci;
+    }
     return pid;
 }
 
@@ -1016,13 +3426,32 @@ int stop_child(CmdInfo& ci, int transId, const TimeVal& now, bool notify)
 {
     bool use_kill = false;
 
+    // Stopping a pipeline stops all of its stages
+    if (!ci.stages.empty()) {
+        for (std::list<PidStatusT>::iterator s = ci.stages.begin(); s != ci.stages.end(); ++s) {
+            MapChildrenT::iterator it;
+            if (s->first != ci.cmd_pid && (it = children.find(s->first)) != children.end())
+                stop_child(it->second, 0, now, false);
+        }
+        if (ci.reaped) {
+            if (notify) send_ok(transId);
+            return 0;
+        }
+    } else if (ci.reaped) {
+        // The command is waiting for a restart - cancel it
+        ci.sigterm = true;
+        if (notify) send_ok(transId);
+        return 0;
+    }
+
     if (ci.sigkill)     // Kill signal already sent
         return 0;
     else if (ci.kill_cmd_pid > 0 || ci.sigterm) {
         // There was already an attempt to kill it.
         if (ci.sigterm && now.diff(ci.deadline) > 0) {
             // More than KILL_TIMEOUT_SEC secs elapsed since the last kill attempt
-            erl_exec_kill(ci.cmd_pid, SIGKILL);
+            if (!ci.group || erl_exec_kill_group(ci.cmd_pid, SIGKILL) < 0)
+                erl_exec_kill(ci.cmd_pid, SIGKILL);
             if (ci.kill_cmd_pid > 0)
                 erl_exec_kill(ci.kill_cmd_pid, SIGKILL);
 
@@ -1090,7 +3519,7 @@ void stop_child(pid_t pid, int transId, const TimeVal& now)
     if (it == children.end()) {
         send_error_str(transId, false, "pid not alive");
         return;
-    } else if ((n = erl_exec_kill(pid, 0)) < 0) {
+    } else if (!it->second.reaped && (n = erl_exec_kill(pid, 0)) < 0) {
         send_error_str(transId, false, "pid not alive (err: %d)", n);
         return;
     }
@@ -1099,9 +3528,26 @@ void stop_child(pid_t pid, int transId, const TimeVal& now)
 
 int kill_child(pid_t pid, int signal, int transId, bool notify)
 {
+    // A signal sent to a pipeline is delivered to all of its stages
+    MapChildrenT::iterator it = children.find(pid);
+    bool group = it != children.end() && it->second.group;
+    if (it != children.end() && !it->second.stages.empty()) {
+        for (std::list<PidStatusT>::iterator s = it->second.stages.begin(); s != it->second.stages.end(); ++s)
+            if (s->first != pid && s->second == INT_MIN &&
+                (!group || erl_exec_kill_group(s->first, signal) < 0))
+                erl_exec_kill(s->first, signal);
+        if (it->second.reaped) {
+            if (notify) send_ok(transId);
+            return 0;
+        }
+    }
+
     // We can't use -pid here to kill the whole process group, because our process is
-    // the group leader.
-    int err = erl_exec_kill(pid, signal);
+    // the group leader, unless the child was started in a session of its own.  Until
+    // the child calls setsid(2) its group doesn't exist and the child is signaled alone.
+    int err = group ? erl_exec_kill_group(pid, signal) : -1;
+    if (!group || (err < 0 && errno == ESRCH))
+        err = erl_exec_kill(pid, signal);
     switch (err) {
         case 0:
             if (notify) send_ok(transId);
@@ -1136,6 +3582,8 @@ bool process_pid_input(CmdInfo& ci)
 
         while ((n = write(fd, p, len)) < 0 && errno == EINTR);
 
+        EXEC_PROBE3(input_write, ci.cmd_pid, n, len - n);
+
         if (debug) {
             if (n < 0)
                 fprintf(stderr, "Error writing %d bytes to stdin (fd=%d) of pid %d: %s\r\n",
@@ -1168,22 +3616,39 @@ bool process_pid_input(CmdInfo& ci)
     return true;
 }
 
-void process_pid_output(CmdInfo& ci, int maxsize)
+// Read at most <maxsize> bytes from each of the child's output streams, or only
+// from <stream> if it is not -1.  No single read() asks for more than what is
+// left of <maxsize>, so that an output_rate budget isn't overrun.
+int process_pid_output(CmdInfo& ci, int maxsize, int stream)
 {
     char buf[4096];
+    int  total = 0;
 
     for (int i=STDOUT_FILENO; i <= STDERR_FILENO; i++) {
         int& fd = ci.stream_fd[i];
 
-        if (fd >= 0) {
-            for(int got = 0, n = sizeof(buf); got < maxsize && n == sizeof(buf); got += n) {
-                while ((n = read(fd, buf, sizeof(buf))) < 0 && errno == EINTR);
+        if (fd >= 0 && (stream < 0 || stream == i)) {
+            for(int got = 0, n = 0, want = 0; got < maxsize; got += n) {
+                want = std::min((int)sizeof(buf), maxsize - got);
+                while ((n = ci.tee[i].active() ? ci.tee[i].read(fd, buf, want)
+                                               : read(fd, buf, want)) < 0 && errno == EINTR);
+                EXEC_PROBE3(output_read, ci.cmd_pid, i, n);
                 if (debug > 1)
                     fprintf(stderr, "Read %d bytes from pid %d's %s (fd=%d): %s\r\n",
                         n, ci.cmd_pid, ci.stream_name(i), fd, n > 0 ? "ok" : strerror(errno));
                 if (n > 0) {
-                    send_ospid_output(ci.cmd_pid, ci.stream_name(i), buf, n);
-                    if (n < (int)sizeof(buf))
+                    int len = ci.max_output > 0 ? limit_pid_output(ci, i, n) : n;
+                    total  += n;
+                    if (len > 0)
+                        deliver_pid_output(ci, i, buf, len);
+                    // Over {max_output, Bytes, drop} the child gets EPIPE on next write
+                    if (ci.max_output > 0 && ci.output_total > ci.max_output &&
+                        ci.max_output_action == LIMIT_DROP) {
+                        close_pid_output(ci, STDOUT_FILENO);
+                        close_pid_output(ci, STDERR_FILENO);
+                        break;
+                    }
+                    if (n < want)
                         break;
                 } else if (n < 0 && errno == EAGAIN)
                     break;
@@ -1191,13 +3656,435 @@ void process_pid_output(CmdInfo& ci, int maxsize)
                     if (debug)
                         fprintf(stderr, "Eof reading pid %d's %s, closing fd=%d: %s\r\n",
                             ci.cmd_pid, ci.stream_name(i), fd, strerror(errno));
-                    close(fd);
-                    fd = REDIRECT_CLOSE;
+                    close_pid_output(ci, i);
+                    break;
+                }
+            }
+        }
+    }
+
+    return total;
+}
+
+void deliver_pid_output(CmdInfo& ci, int stream, const char* data, int len)
+{
+    if (!ci.pool.empty() && stream == STDOUT_FILENO)
+        process_pool_output(ci, data, len);
+    else if (ci.sink[stream].active()) {
+        ci.sink[stream].write(data, len);
+        if (ci.sink[stream].progress_due())
+            send_spooled(ci.cmd_pid, ci.sink[stream]);
+    }
+    else if (ci.tail[stream].capacity > 0)
+        ci.tail[stream].append(data, len);
+    else if (ci.sync_trans)
+        collect_sync_output(ci, stream, data, len);
+    else if (ci.zip[stream].active())
+        send_compressed_output(ci, stream, data, len);
+    else if (ci.framing[stream].type == FRAMING_NONE)
+        send_ospid_output(ci.cmd_pid, ci.stream_name(stream), data, len);
+    else
+        send_framed_output(ci, stream, data, len);
+}
+
+void close_pid_output(CmdInfo& ci, int stream)
+{
+    int& fd = ci.stream_fd[stream];
+
+    if (fd < 0)
+        return;
+
+    flush_framed_output(ci, stream);
+    if (ci.zip[stream].active())
+        send_compressed_output(ci, stream, NULL, 0, true);
+    close(fd);
+    fd = REDIRECT_CLOSE;
+}
+
+int limit_pid_output(CmdInfo& ci, int stream, int len)
+{
+    size_t before = ci.output_total;
+    size_t left   = ci.max_output - std::min(ci.max_output, before);
+    int    n      = (int)std::min((size_t)len, left);
+
+    ci.output_total      += len;
+    ci.discarded[stream] += len - n;
+
+    // Act once, when the output first goes over the limit
+    if (before <= ci.max_output && ci.output_total > ci.max_output) {
+        if (debug)
+            fprintf(stderr, "Pid %d output exceeded %lu bytes\r\n",
+                ci.cmd_pid, (unsigned long)ci.max_output);
+        if (ci.max_output_action == LIMIT_KILL)
+            stop_child(ci, 0, TimeVal(TimeVal::NOW), false);
+    }
+    return n;
+}
+
+void process_pid_messages(CmdInfo& ci, int maxsize)
+{
+    char buf[4096];
+
+    for(int got = 0, n = sizeof(buf); ci.msg_fd >= 0 && got < maxsize && n == sizeof(buf); got += n) {
+        while ((n = read(ci.msg_fd, buf, sizeof(buf))) < 0 && errno == EINTR);
+        if (debug > 1)
+            fprintf(stderr, "Read %d bytes from pid %d's messages (fd=%d): %s\r\n",
+                n, ci.cmd_pid, ci.msg_fd, n > 0 ? "ok" : strerror(errno));
+        if (n < 0 && errno == EAGAIN)
+            break;
+        if (n > 0)
+            ci.msg_buf.append(buf, n);
+        else if (!ci.msg_buf.empty())
+            ci.msg_error = "incomplete message";
+        // The child gets EPIPE on writing to a channel closed on error
+        if (n <= 0 || forward_pid_messages(ci) < 0) {
+            if (debug)
+                fprintf(stderr, "Closing pid %d's messages (fd=%d)%s%s\r\n", ci.cmd_pid, ci.msg_fd,
+                    ci.msg_error.empty() ? "" : ": ", ci.msg_error.c_str());
+            close(ci.msg_fd);
+            ci.msg_fd = REDIRECT_CLOSE;
+            ci.msg_buf.clear();
+        }
+    }
+}
+
+/// Return the size of a term in the external format at the beginning of
+/// <buf> or -1 if it's malformed or longer than <len>.  Pids, ports,
+/// references and funs are rejected since a child can't produce them.
+static int etf_term_size(const char* buf, int len)
+{
+    const unsigned char* s = (const unsigned char*)buf;
+    size_t pos = 0, size = len;
+
+    for (unsigned long long terms = 1; terms > 0; terms--) {
+        if (pos >= size)
+            return -1;
+
+        int    tag = s[pos++];
+        int    hdr = 0;     // Size of the length field following the tag
+        size_t n   = 0;     // Value of the length field
+        size_t skip= 0;     // Size of the payload following the length field
+
+        switch (tag) {
+            case ERL_SMALL_ATOM_EXT: case ERL_SMALL_ATOM_UTF8_EXT:
+            case ERL_SMALL_BIG_EXT:  case ERL_SMALL_TUPLE_EXT:
+                hdr = 1; break;
+            case ERL_ATOM_EXT: case ERL_ATOM_UTF8_EXT: case ERL_STRING_EXT:
+                hdr = 2; break;
+            case ERL_LARGE_BIG_EXT: case ERL_LARGE_TUPLE_EXT: case ERL_LIST_EXT:
+            case ERL_BINARY_EXT:    case ERL_BIT_BINARY_EXT:  case ERL_MAP_EXT:
+                hdr = 4; break;
+        }
+        if (size - pos < (size_t)hdr)
+            return -1;
+        for (int i=0; i < hdr; i++)
+            n = n << 8 | s[pos++];
+
+        switch (tag) {
+            case ERL_SMALL_INTEGER_EXT: skip = 1;       break;
+            case ERL_INTEGER_EXT:       skip = 4;       break;
+            case ERL_FLOAT_EXT:         skip = 31;      break;
+            case ERL_NEW_FLOAT_EXT:     skip = 8;       break;
+            case ERL_NIL_EXT:                           break;
+            case ERL_SMALL_ATOM_EXT: case ERL_SMALL_ATOM_UTF8_EXT:
+            case ERL_ATOM_EXT:       case ERL_ATOM_UTF8_EXT:
+            case ERL_STRING_EXT:     case ERL_BINARY_EXT:
+                skip = n;       break;
+            case ERL_SMALL_BIG_EXT:  case ERL_LARGE_BIG_EXT:
+            case ERL_BIT_BINARY_EXT:                    // sign or trailing bits byte
+                skip = n + 1;   break;
+            case ERL_SMALL_TUPLE_EXT: case ERL_LARGE_TUPLE_EXT:
+                terms += n;     break;
+            case ERL_LIST_EXT:                          // elements and the tail
+                terms += n + 1; break;
+            case ERL_MAP_EXT:
+                terms += 2 * (unsigned long long)n; break;
+            default:
+                return -1;
+        }
+        // Each of the remaining terms takes at least one byte
+        if (size - pos < skip || size - pos - skip < terms - 1)
+            return -1;
+        pos += skip;
+    }
+    return (int)pos;
+}
+
+int forward_pid_messages(CmdInfo& ci)
+{
+    // Message: <<Len:32, 131, Term:(Len-1)/binary>>
+    const char* p   = ci.msg_buf.c_str();
+    size_t      len = ci.msg_buf.size(), pos = 0;
+
+    while (len - pos >= 4) {
+        const unsigned char* h = (const unsigned char*)p + pos;
+        size_t sz = (size_t)h[0] << 24 | (size_t)h[1] << 16 | (size_t)h[2] << 8 | (size_t)h[3];
+
+        if (sz < 2 || sz > MAX_MSG_SIZE) {
+            ci.msg_error = "invalid message size";
+            return -1;
+        } else if (len - pos - 4 < sz)
+            break;
+
+        const char* term = p + pos + 4;
+        if ((unsigned char)term[0] != ERL_VERSION_MAGIC || etf_term_size(term+1, sz-1) != (int)sz-1) {
+            ci.msg_error = "invalid message term";
+            return -1;
+        }
+
+        // The term is forwarded in a binary decoded with the `safe' option
+        // by Erlang, so that it can't break the port packet or create atoms:
+        // {msg, OsPid, <<131, Term/binary>>}
+        eis.reset();
+        eis.encodeTupleSize(2);
+        eis.encode(0);
+        eis.encodeTupleSize(3);
+        eis.encode(atom_t("msg"));
+        eis.encode(ci.cmd_pid);
+        eis.encode(term, (int)sz);
+        eis.write();
+
+        pos += 4 + sz;
+    }
+
+    ci.msg_buf.erase(0, pos);
+    return 0;
+}
+
+void collect_sync_output(CmdInfo& ci, int stream, const char* data, int len)
+{
+    std::string& out = ci.sync_out[stream];
+    size_t n = std::min((size_t)len, ci.sync_limit - std::min(ci.sync_limit, out.size()));
+    out.append(data, n);
+    ci.discarded[stream] += len - n;
+}
+
+void send_compressed_output(CmdInfo& ci, int stream, const char* data, int len, bool finish)
+{
+    #ifdef HAVE_ZLIB
+    StreamCompressor& z = ci.zip[stream];
+
+    if (z.pending == 0)
+        z.pending_time = time(NULL);
+    z.pending += len;
+
+    // Sync-flush on the configured boundary, or when called without data
+    // by the idle timer
+    int mode = finish ? Z_FINISH
+             : (len == 0 || z.pending >= z.flush_bytes) ? Z_SYNC_FLUSH : Z_NO_FLUSH;
+
+    if (z.deflate(data, len, mode, z.out) < 0) {
+        if (debug)
+            fprintf(stderr, "Failed to compress pid %d's %s\r\n", ci.cmd_pid, ci.stream_name(stream));
+        z.finished = true;
+        return;
+    }
+    if (mode == Z_NO_FLUSH)
+        return;
+
+    send_ospid_output(ci.cmd_pid, ci.stream_name(stream), z.out.c_str(), z.out.size());
+    z.out.clear();
+    z.pending  = 0;
+    z.finished = finish;
+    #endif
+}
+
+void flush_pid_output(CmdInfo& ci)
+{
+    for (int i=STDOUT_FILENO; i <= STDERR_FILENO; i++) {
+        flush_framed_output(ci, i);
+        if (ci.zip[i].active())
+            send_compressed_output(ci, i, NULL, 0, true);
+        if (ci.sink[i].active()) {
+            ci.sink[i].flush();
+            // The final report of the spooled size
+            if (ci.sink[i].spool)
+                send_spooled(ci.cmd_pid, ci.sink[i]);
+        }
+    }
+}
+
+/// Accumulates records of framed output of a child into a single
+/// {Stream, OsPid, [Record::binary()]} message.
+class RecordBatch {
+    pid_t       m_pid;
+    const char* m_stream;
+    int         m_count;
+    int         m_idx;
+    size_t      m_bytes;
+public:
+    RecordBatch(pid_t pid, const char* stream)
+        : m_pid(pid), m_stream(stream), m_count(0), m_idx(0), m_bytes(0)
+    {}
+    ~RecordBatch() { flush(); }
+
+    void add(StreamFraming& f, const char* data, size_t len) {
+        if (f.filtered() && !f.accept(data, len))
+            return;
+        add(data, len);
+    }
+
+    void add(StreamFraming& f, const std::string& s) { add(f, s.c_str(), s.size()); }
+
+    void add(const char* data, size_t len) {
+        if (m_count > 0 && m_bytes + len > MAX_BATCH_SIZE)
+            flush();
+        if (m_count == 0) {
+            eis.reset();
+            eis.encodeTupleSize(2);
+            eis.encode(0);
+            eis.encodeTupleSize(3);
+            eis.encode(atom_t(m_stream));
+            eis.encode(m_pid);
+            m_idx = eis.encodeListBegin();
+        }
+        eis.encode(data, len);
+        m_count++;
+        m_bytes += len;
+    }
+
+    int flush() {
+        if (m_count == 0)
+            return 0;
+        eis.encodeListEnd(m_count, m_idx);
+        m_count = 0;
+        m_bytes = 0;
+        return eis.write();
+    }
+};
+
+/// Split <data> into records of the framing <f> and pass complete records
+/// to <sink> (see RecordBatch).
+template <class Sink>
+void split_records(StreamFraming& f, const char* data, int len, Sink& sink)
+{
+    const char*    p   = data;
+    const char*    end = data + len;
+
+    if (f.type == FRAMING_DELIMITER) {
+        while (p < end) {
+            // memchr(3) is vectorized by the C library, so scanning is
+            // done in 16-32 byte steps
+            const char* e = (const char*)memchr(p, f.delim, end - p);
+            size_t      n = (e ? e : end) - p;
+
+            if (f.pending.size() + n > f.max_record) {
+                // The record is too long - deliver its head as a separate record
+                size_t take = f.max_record - f.pending.size();
+                f.pending.append(p, take);
+                sink.add(f, f.pending);
+                f.pending.clear();
+                p += take;
+            } else if (!e) {
+                f.pending.append(p, n);
+                break;
+            } else if (f.pending.empty()) {
+                sink.add(f, p, n);
+                p = e+1;
+            } else {
+                f.pending.append(p, n);
+                sink.add(f, f.pending);
+                f.pending.clear();
+                p = e+1;
+            }
+        }
+    } else {
+        while (p < end) {
+            if (f.remaining == 0) {
+                // Read the length header of the next record
+                while (f.hdr_got < f.hdr_size && p < end)
+                    f.hdr[f.hdr_got++] = *p++;
+                if (f.hdr_got < f.hdr_size)
                     break;
+                f.hdr_got = 0;
+                for (int i=0; i < f.hdr_size; i++)
+                    f.remaining = (f.remaining << 8) | f.hdr[i];
+                if (f.remaining == 0) {
+                    sink.add(f, p, 0);
+                    continue;
+                }
+            }
+
+            size_t take = std::min(std::min(f.remaining, (size_t)(end - p)),
+                                   f.max_record - f.pending.size());
+            bool   done = take == f.remaining || f.pending.size() + take == f.max_record;
+
+            if (done && f.pending.empty())
+                sink.add(f, p, take);
+            else {
+                f.pending.append(p, take);
+                if (done) {
+                    sink.add(f, f.pending);
+                    f.pending.clear();
                 }
             }
+            p           += take;
+            f.remaining -= take;
+        }
+    }
+}
+
+void send_framed_output(CmdInfo& ci, int stream, const char* data, int len)
+{
+    RecordBatch batch(ci.cmd_pid, ci.stream_name(stream));
+    split_records(ci.framing[stream], data, len, batch);
+}
+
+/// Replies to the request being served by a pool worker with every
+/// complete response record (see split_records).
+class PoolReply {
+    CmdInfo&    m_ci;
+public:
+    PoolReply(CmdInfo& ci) : m_ci(ci) {}
+
+    void add(StreamFraming&, const char* data, size_t len) {
+        if (m_ci.pool_trans == 0) {
+            if (debug)
+                fprintf(stderr, "Pool worker %d sent %ld bytes with no pending request, discarding\r\n",
+                    m_ci.cmd_pid, (long)len);
+            return;
+        }
+        eis.reset();
+        eis.encodeTupleSize(2);
+        eis.encode(m_ci.pool_trans);
+        eis.encodeTupleSize(2);
+        eis.encode(atom_t("ok"));
+        eis.encode(data, len);
+        eis.write();
+
+        m_ci.pool_trans = 0;
+        MapPoolT::iterator it = pools.find(m_ci.pool);
+        if (it != pools.end()) {
+            it->second.idle.push_back(m_ci.cmd_pid);
+            dispatch_pool_requests(it->second);
         }
     }
+
+    void add(StreamFraming& f, const std::string& s) { add(f, s.c_str(), s.size()); }
+};
+
+void process_pool_output(CmdInfo& ci, const char* data, int len)
+{
+    PoolReply reply(ci);
+    split_records(ci.framing[STDOUT_FILENO], data, len, reply);
+}
+
+void flush_framed_output(CmdInfo& ci, int stream)
+{
+    StreamFraming& f = ci.framing[stream];
+
+    // An incomplete response of a pool worker is never delivered
+    if (!ci.pool.empty() && stream == STDOUT_FILENO)
+        f.pending.clear();
+
+    // Deliver the incomplete last record
+    if (!f.pending.empty()) {
+        RecordBatch batch(ci.cmd_pid, ci.stream_name(stream));
+        batch.add(f, f.pending);
+        f.pending.clear();
+    }
+    f.remaining = 0;
+    f.hdr_got   = 0;
 }
 
 void erase_child(MapChildrenT::iterator& it)
@@ -1209,6 +4096,41 @@ void erase_child(MapChildrenT::iterator& it)
             close(it->second.stream_fd[i]);
         }
 
+    if (it->second.msg_fd >= 0)
+        close(it->second.msg_fd);
+
+    for (PerfFdListT::iterator p = it->second.perf_fds.begin(), e = it->second.perf_fds.end(); p != e; ++p)
+        close(p->second);
+
+    for (int i=STDOUT_FILENO; i <= STDERR_FILENO; i++) {
+        it->second.framing[i].free_filters();
+        it->second.tee[i].close();
+        it->second.sink[i].close();
+        it->second.zip[i].free();
+    }
+
+    delete it->second.restart_opts;
+    cgroup_release(it->second.cgroup, it->second.cgroup_name);
+
+    if (!it->second.timeout_at.zero()) {
+        std::pair<MapTimeoutT::iterator, MapTimeoutT::iterator> r = timeouts.equal_range(it->second.timeout_at);
+        for (MapTimeoutT::iterator t = r.first; t != r.second; ++t)
+            if (t->second == it->first) {
+                timeouts.erase(t);
+                break;
+            }
+    }
+
+    // Make room for commands waiting for admission
+    if (!it->second.managed && it->second.pool.empty() &&
+        (it->second.pipeline == 0 || it->second.pipeline == it->first))
+        running_jobs--;
+    if (!it->second.job_class.empty()) {
+        MapJobClassT::iterator jc = class_jobs.find(it->second.job_class);
+        if (jc != class_jobs.end() && --jc->second <= 0)
+            class_jobs.erase(jc);
+    }
+
     children.erase(it);
 }
 
@@ -1217,9 +4139,15 @@ int check_children(int& isTerminated, bool notify)
     if (debug > 2)
         fprintf(stderr, "Checking %ld exited children\r\n", exited_children.size());
 
+    if (subreaper)
+        reap_orphans();
+
     for (MapChildrenT::iterator it=children.begin(), end=children.end(); it != end; ++it) {
         TimeVal now(TimeVal::NOW);
 
+        if (it->second.reaped)  // Last stage of a pipeline waiting for other stages
+            continue;
+
         int   status = ECHILD;
         pid_t pid = it->first;
         int n = erl_exec_kill(pid, 0);
@@ -1229,7 +4157,7 @@ int check_children(int& isTerminated, bool notify)
             if (!it->second.deadline.zero() && now.diff(it->second.deadline) > 0)
                 stop_child(it->second, 0, now, false);
 
-            while ((n = waitpid(pid, &status, WNOHANG)) < 0 && errno == EINTR);
+            n = reap_child(pid, status);
 
             if (n > 0) {
                 if (WIFEXITED(status) || WIFSIGNALED(status)) {
@@ -1254,17 +4182,58 @@ int check_children(int& isTerminated, bool notify)
     while (!isTerminated && !exited_children.empty()) {
         PidStatusT& item = exited_children.front();
 
+        // CPU time of the child tells the kill by its cpu_limit from a SIGKILL of
+        // exec:kill/2, kill_tag or the OOM killer
+        long long cpu_usec = -1;
+        std::map<pid_t, long long>::iterator c = exited_cpu.find(item.first);
+        if (c != exited_cpu.end()) {
+            cpu_usec = c->second;
+            exited_cpu.erase(c);
+        }
+
         MapChildrenT::iterator i = children.find(item.first);
         MapKillPidT::iterator j;
-        if (i != children.end()) {
+        if (i != children.end() && i->second.reaped && i->second.restart_opts) {
+            // Already waiting for a restart
+        } else if (i != children.end()) {
             process_pid_output(i->second, INT_MAX);
+            process_pid_messages(i->second, INT_MAX);
+            if (!i->second.msg_buf.empty())
+                i->second.msg_error = "incomplete message";
+            flush_pid_output(i->second);
+            // Descendants of a stopped command left in its process group are killed
+            if (i->second.group && i->second.sigterm)
+                erl_exec_kill_group(item.first, SIGKILL);
+            // Killed by SIGXCPU at the soft limit, or by SIGKILL at the hard one a
+            // second later
+            if (i->second.cpu_limit > 0 && !i->second.timed_out && WIFSIGNALED(item.second)) {
+                int       sig   = WTERMSIG(item.second);
+                long long limit = (long long)(i->second.cpu_limit + (sig == SIGKILL)) * 1000000;
+                i->second.cpu_out = (sig == SIGXCPU || sig == SIGKILL) &&
+                                    cpu_usec >= limit - CPU_LIMIT_SLACK_USEC;
+            }
             // Override status code if termination was requested by Erlang
-            PidStatusT ps(item.first, i->second.sigterm ? 0 : item.second);
-            if (notify && send_pid_status_term(ps) < 0) {
-                isTerminated = 1;
-                return -1;
+            PidStatusT ps(item.first, i->second.sigterm && !i->second.timed_out ? 0 : item.second);
+            EXEC_PROBE2(child_reap, ps.first, ps.second);
+            if (i->second.pipeline) {
+                if (pipeline_stage_exited(i, ps, notify) < 0) {
+                    isTerminated = 1;
+                    return -1;
+                }
+            } else {
+                if (i->second.restart_opts && schedule_restart(i->second, item.second)) {
+                    exited_children.pop_front();
+                    continue;
+                } else if (!i->second.pool.empty())
+                    pool_worker_exited(i->second);
+                else if (i->second.dag)
+                    dag_node_exited(i->second, item.second);
+                else if (notify && send_pid_status_term(ps, &i->second) < 0) {
+                    isTerminated = 1;
+                    return -1;
+                }
+                erase_child(i);
             }
-            erase_child(i);
         } else if ((j = transient_pids.find(item.first)) != transient_pids.end()) {
             // the pid is one of the custom 'kill' commands started by us.
             transient_pids.erase(j);
@@ -1273,7 +4242,71 @@ int check_children(int& isTerminated, bool notify)
         exited_children.pop_front();
     }
 
-    return 0;
+    return 0;
+}
+
+void reap_orphans()
+{
+    // SIGCHLD signals of several processes are merged into one, so the children
+    // of exited commands reparented to the port program are reaped in bulk
+    int   status;
+    pid_t pid;
+
+    while ((pid = reap_child(-1, status)) > 0) {
+        if (children.find(pid) != children.end() || transient_pids.find(pid) != transient_pids.end())
+            exited_children.push_back(std::make_pair(pid, status));
+        else {
+            exited_cpu.erase(pid);
+            if (debug)
+                fprintf(stderr, "Reaped orphaned process %d (status=%d)\r\n", pid, status);
+        }
+    }
+}
+
+int pipeline_stage_exited(MapChildrenT::iterator& it, const PidStatusT& ps, bool notify)
+{
+    MapChildrenT::iterator last = children.find(it->second.pipeline);
+
+    if (last == children.end()) {
+        erase_child(it);
+        return 0;
+    }
+
+    CmdInfo& ci   = last->second;
+    bool     done = true;
+
+    if (it == last && ci.reaped)    // Already reported by the SIGCHLD handler
+        return 0;
+
+    for (std::list<PidStatusT>::iterator s = ci.stages.begin(); s != ci.stages.end(); ++s) {
+        if (s->first == ps.first)
+            s->second = ps.second;
+        done = done && s->second != INT_MIN;
+    }
+
+    if (it == last) {
+        ci.reaped      = true;
+        ci.exit_status = ps.second;
+    } else {
+        erase_child(it);
+        // Deliver stderr written by the stages that exited after the last one
+        if (ci.reaped) {
+            process_pid_output(ci, INT_MAX);
+            flush_pid_output(ci);
+        }
+    }
+
+    if (debug)
+        fprintf(stderr, "Stage %d of pipeline %d exited with status %d%s\r\n",
+            ps.first, last->first, ps.second, done && ci.reaped ? " (pipeline done)" : "");
+
+    // A single notification reports the exit status of all stages
+    if (!done || !ci.reaped)
+        return 0;
+
+    int rc = notify ? send_pid_status_term(PidStatusT(last->first, ci.exit_status), &ci) : 0;
+    erase_child(last);
+    return rc < 0 ? -1 : 0;
 }
 
 int send_pid_list(int transId, const MapChildrenT& children)
@@ -1289,6 +4322,108 @@ int send_pid_list(int transId, const MapChildrenT& children)
     return eis.write();
 }
 
+int send_pid_list(int transId, const std::list<pid_t>& pids)
+{
+    // Reply: {TransId, [OsPid::integer()]}
+    eis.reset();
+    eis.encodeTupleSize(2);
+    eis.encode(transId);
+    if (!pids.empty())
+        eis.encodeListSize(pids.size());
+    for (std::list<pid_t>::const_iterator it=pids.begin(); it != pids.end(); ++it)
+        eis.encode(*it);
+    eis.encodeListEnd();
+    return eis.write();
+}
+
+void tagged_children(const std::string& tag, std::list<pid_t>& pids, bool reaped)
+{
+    for (MapChildrenT::iterator it=children.begin(), end=children.end(); it != end; ++it) {
+        const std::list<std::string>& tags = it->second.tags;
+        if ((reaped || !it->second.reaped) && std::find(tags.begin(), tags.end(), tag) != tags.end())
+            pids.push_back(it->first);
+    }
+}
+
+int read_proc_stat(pid_t pid, unsigned long long& ticks, long long& rss_pages)
+{
+    #ifdef __linux__
+    char path[64], buf[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+
+    FILE* f = fopen(path, "r");
+    if (!f)
+        return -1;
+    size_t n = fread(buf, 1, sizeof(buf)-1, f);
+    fclose(f);
+    buf[n] = '\0';
+
+    // Fields following the command name, which may contain spaces and parentheses:
+    //   state ppid pgrp session tty_nr tpgid flags minflt cminflt majflt cmajflt
+    //   utime stime cutime cstime priority nice num_threads itrealvalue starttime vsize rss
+    unsigned long utime, stime;
+    long cutime, cstime, rss;
+    const char* p = strrchr(buf, ')');
+    if (!p || sscanf(p+1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu %ld %ld"
+                          " %*d %*d %*d %*d %*u %*u %ld",
+                     &utime, &stime, &cutime, &cstime, &rss) != 5)
+        return -1;
+
+    ticks     += utime + stime + cutime + cstime;
+    rss_pages += rss;
+    return 0;
+    #else
+    return -1;
+    #endif
+}
+
+int send_tag_stats(int transId, const std::list<pid_t>& pids)
+{
+    // Reply: {TransId, {ok, [{count, N}, {cpu_usec, Usec}, {rss, Bytes}]}}
+    // CPU time includes the waited-for children of commands, and all stages
+    // of a pipeline are accounted for.
+    unsigned long long ticks = 0;
+    long long          rss   = 0;
+
+    for (std::list<pid_t>::const_iterator p = pids.begin(); p != pids.end(); ++p) {
+        MapChildrenT::iterator it = children.find(*p);
+        if (it == children.end() || it->second.stages.empty())
+            read_proc_stat(*p, ticks, rss);
+        else
+            for (std::list<PidStatusT>::iterator s = it->second.stages.begin(); s != it->second.stages.end(); ++s)
+                if (s->second == INT_MIN)
+                    read_proc_stat(s->first, ticks, rss);
+    }
+
+    #ifdef __linux__
+    static const long clk_tck   = sysconf(_SC_CLK_TCK);
+    static const long page_size = sysconf(_SC_PAGESIZE);
+    const int         n = 3;
+    #else
+    const int         n = 1;
+    #endif
+
+    eis.reset();
+    eis.encodeTupleSize(2);
+    eis.encode(transId);
+    eis.encodeTupleSize(2);
+    eis.encode(atom_t("ok"));
+    eis.encodeListSize(n);
+    eis.encodeTupleSize(2);
+    eis.encode(atom_t("count"));
+    eis.encode((long)pids.size());
+    #ifdef __linux__
+    eis.encodeTupleSize(2);
+    eis.encode(atom_t("cpu_usec"));
+    eis.encode((long long)(ticks * 1000000ull / clk_tck));
+    eis.encodeTupleSize(2);
+    eis.encode(atom_t("rss"));
+    eis.encode(rss * page_size);
+    #endif
+    eis.encodeListEnd();
+    return eis.write();
+}
+
 int send_error_str(int transId, bool asAtom, const char* fmt, ...)
 {
     char str[MAXATOMLEN];
@@ -1321,15 +4456,151 @@ int send_ok(int transId, pid_t pid)
     return eis.write();
 }
 
-int send_pid_status_term(const PidStatusT& stat)
+int send_pid_status_term(const PidStatusT& stat, const CmdInfo* ci)
 {
+    // Reply: {0, {exit_status, OsPid, Status} | {exit_status, OsPid, Status, Info}}
+    //  Sync: {TransId, {ok, Status, Stdout, Stderr} | {ok, Status, Stdout, Stderr, Info}}
+    bool sync    = ci && ci->sync_trans;
+    bool perf    = ci && !ci->perf_fds.empty();
+    bool dropped = ci && (ci->framing[STDOUT_FILENO].filtered() || ci->framing[STDERR_FILENO].filtered());
+    bool tail[3] = { false, ci && ci->tail[STDOUT_FILENO].capacity > 0,
+                            ci && ci->tail[STDERR_FILENO].capacity > 0 };
+    bool truncated = ci && (ci->discarded[STDOUT_FILENO] || ci->discarded[STDERR_FILENO]);
+    bool msgerr  = ci && !ci->msg_error.empty();
+    bool stages  = ci && !ci->stages.empty();
+    bool timeout = ci && ci->timed_out;
+    bool cpu_out = ci && ci->cpu_out && !timeout;
+    bool cgroup  = ci && !ci->cgroup.empty();
+    int  info    = perf + dropped + tail[STDOUT_FILENO] + tail[STDERR_FILENO] + truncated + msgerr + stages
+                 + (timeout || cpu_out) + cgroup;
+
     eis.reset();
     eis.encodeTupleSize(2);
-    eis.encode(0);
-    eis.encodeTupleSize(3);
-    eis.encode(atom_t("exit_status"));
-    eis.encode(stat.first);
-    eis.encode(stat.second);
+    if (sync) {
+        eis.encode(ci->sync_trans);
+        eis.encodeTupleSize(info ? 5 : 4);
+        eis.encode(atom_t("ok"));
+        eis.encode(stat.second);
+        for (int i=STDOUT_FILENO; i <= STDERR_FILENO; i++)
+            eis.encode(ci->sync_out[i].c_str(), ci->sync_out[i].size());
+    } else {
+        eis.encode(0);
+        eis.encodeTupleSize(info ? 4 : 3);
+        eis.encode(atom_t("exit_status"));
+        eis.encode(stat.first);
+        eis.encode(stat.second);
+    }
+
+    if (info)
+        eis.encodeListSize(info);
+
+    if (perf) {
+        // {perf_counters, [{Event, Count}]}
+        std::list<std::pair<const char*, unsigned long long> > counters;
+        #ifdef __linux__
+        for (PerfFdListT::const_iterator it = ci->perf_fds.begin(), end = ci->perf_fds.end(); it != end; ++it) {
+            unsigned long long value;
+            if (read_perf_counter(it->second, value) == 0)
+                counters.push_back(std::make_pair(perf_events[it->first].name, value));
+        }
+        #endif
+        eis.encodeTupleSize(2);
+        eis.encode(atom_t("perf_counters"));
+        if (!counters.empty()) {
+            eis.encodeListSize(counters.size());
+            for (std::list<std::pair<const char*, unsigned long long> >::const_iterator
+                    it = counters.begin(), end = counters.end(); it != end; ++it) {
+                eis.encodeTupleSize(2);
+                eis.encode(atom_t(it->first));
+                eis.encode(it->second);
+            }
+        }
+        eis.encodeListEnd();
+    }
+
+    if (dropped) {
+        // {dropped, [{Stream, Records, Bytes}]}
+        eis.encodeTupleSize(2);
+        eis.encode(atom_t("dropped"));
+        eis.encodeListSize(2);
+        for (int i=STDOUT_FILENO; i <= STDERR_FILENO; i++) {
+            eis.encodeTupleSize(3);
+            eis.encode(atom_t(ci->stream_name(i)));
+            eis.encode(ci->framing[i].dropped_records);
+            eis.encode(ci->framing[i].dropped_bytes);
+        }
+        eis.encodeListEnd();
+    }
+
+    if (truncated) {
+        // {truncated, [{Stream, Bytes}]}
+        eis.encodeTupleSize(2);
+        eis.encode(atom_t("truncated"));
+        eis.encodeListSize(2);
+        for (int i=STDOUT_FILENO; i <= STDERR_FILENO; i++) {
+            eis.encodeTupleSize(2);
+            eis.encode(atom_t(ci->stream_name(i)));
+            eis.encode(ci->discarded[i]);
+        }
+        eis.encodeListEnd();
+    }
+
+    if (msgerr) {
+        // {msg_error, Reason::string()}
+        eis.encodeTupleSize(2);
+        eis.encode(atom_t("msg_error"));
+        eis.encode(ci->msg_error);
+    }
+
+    if (cgroup) {
+        // {cgroup, [{Stat, Value::integer()}]}
+        std::list<std::pair<const char*, unsigned long long> > stats;
+        cgroup_stats(ci->cgroup, stats);
+        eis.encodeTupleSize(2);
+        eis.encode(atom_t("cgroup"));
+        if (!stats.empty()) {
+            eis.encodeListSize(stats.size());
+            for (std::list<std::pair<const char*, unsigned long long> >::const_iterator
+                    it = stats.begin(), end = stats.end(); it != end; ++it) {
+                eis.encodeTupleSize(2);
+                eis.encode(atom_t(it->first));
+                eis.encode(it->second);
+            }
+        }
+        eis.encodeListEnd();
+    }
+
+    if (timeout || cpu_out) {
+        // {timeout, Msec::integer()} | {cpu_limit, Sec::integer()}
+        eis.encodeTupleSize(2);
+        eis.encode(atom_t(timeout ? "timeout" : "cpu_limit"));
+        eis.encode(timeout ? ci->timeout : ci->cpu_limit);
+    }
+
+    if (stages) {
+        // {stages, [{OsPid, Status}]} in the order of the pipeline
+        eis.encodeTupleSize(2);
+        eis.encode(atom_t("stages"));
+        eis.encodeListSize(ci->stages.size());
+        for (std::list<PidStatusT>::const_iterator s = ci->stages.begin(); s != ci->stages.end(); ++s) {
+            eis.encodeTupleSize(2);
+            eis.encode(s->first);
+            eis.encode(s->second);
+        }
+        eis.encodeListEnd();
+    }
+
+    for (int i=STDOUT_FILENO; i <= STDERR_FILENO; i++)
+        if (tail[i]) {
+            // {stdout_tail | stderr_tail, Data::binary()}
+            std::string data = ci->tail[i].str();
+            eis.encodeTupleSize(2);
+            eis.encode(atom_t(i == STDOUT_FILENO ? "stdout_tail" : "stderr_tail"));
+            eis.encode(data.c_str(), data.size());
+        }
+
+    if (info)
+        eis.encodeListEnd();
     return eis.write();
 }
 
@@ -1345,42 +4616,496 @@ int send_ospid_output(int pid, const char* type, const char* data, int len)
     return eis.write();
 }
 
-int open_file(const char* file, bool append, const char* stream,
-              const char* cmd, ei::StringBuffer<128>& err)
+int open_file(const char* file, bool append, const char* stream,
+              const char* cmd, ei::StringBuffer<128>& err)
+{
+    int flags = O_RDWR | O_CREAT | (append ? O_APPEND : O_TRUNC);
+    int mode  = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
+    int fd    = open(file, flags, mode);
+    if (fd < 0) {
+        err.write("Failed to redirect %s to file: %s", stream, strerror(errno));
+        return -1;
+    }
+    if (debug)
+        fprintf(stderr, "  Redirecting %s of cmd '%s' to file: '%s' (fd=%d)\r\n",
+            stream, cmd, file, fd);
+
+    return fd;
+}
+
+int open_pipe(int fds[2], const char* stream, ei::StringBuffer<128>& err)
+{
+    if (pipe(fds) < 0) {
+        err.write("Failed to create a pipe for %s: %s", stream, strerror(errno));
+        return -1;
+    }
+    // The fds are multiplexed with select(2), so they must fit in an fd_set
+    if (fds[1] > max_fds || fds[1] >= FD_SETSIZE) {
+        close(fds[0]);
+        close(fds[1]);
+        err.write("Exceeded number of available file descriptors (fd=%d)", fds[1]);
+        return -1;
+    }
+    if (debug)
+        fprintf(stderr, "  Redirecting [%s -> pipe(rd=%d, wr=%d)]\r\n", stream, fds[0], fds[1]);
+
+    return 0;
+}
+
+int open_tee(TeeSink& tee, const char* file, bool append, const char* stream,
+             const char* cmd, ei::StringBuffer<128>& err)
+{
+    if ((tee.file_fd = open_file(file, append, stream, cmd, err)) < 0)
+        return -1;
+    fcntl(tee.file_fd, F_SETFD, FD_CLOEXEC);
+
+    #ifdef __linux__
+    if (open_pipe(tee.dup_fd, stream, err) < 0) {
+        tee.close();
+        return -1;
+    }
+    fcntl(tee.dup_fd[0], F_SETFD, FD_CLOEXEC);
+    fcntl(tee.dup_fd[1], F_SETFD, FD_CLOEXEC);
+    tee.copy = false;
+    #endif
+    return 0;
+}
+
+static ssize_t read_all(int fd, char* buf, size_t len)
+{
+    size_t got = 0;
+    for (ssize_t n; got < len; got += n)
+        if ((n = ::read(fd, buf + got, len - got)) < 0 && errno == EINTR)
+            n = 0;
+        else if (n <= 0)
+            return -1;
+    return got;
+}
+
+static ssize_t write_all(int fd, const char* buf, size_t len)
+{
+    size_t wrote = 0;
+    for (ssize_t n; wrote < len; wrote += n)
+        if ((n = ::write(fd, buf + wrote, len - wrote)) < 0 && errno == EINTR)
+            n = 0;
+        else if (n <= 0)
+            return -1;
+    return wrote;
+}
+
+int TeeSink::read(int fd, char* buf, size_t len)
+{
+    ssize_t n;
+
+    #ifdef __linux__
+    if (!copy) {
+        // Duplicate pending data without consuming it and move it to the file
+        if ((n = tee(fd, dup_fd[1], len, SPLICE_F_NONBLOCK)) <= 0)
+            return n;
+
+        ssize_t done = 0;
+        for (ssize_t m; done < n; done += m)
+            if ((m = splice(fd, NULL, file_fd, NULL, n - done, SPLICE_F_MOVE)) < 0 && errno == EINTR)
+                m = 0;
+            else if (m <= 0)
+                break;
+
+        // The duplicate is what gets delivered to Erlang
+        if (read_all(dup_fd[0], buf, n) < 0)
+            return -1;
+        if (done == n)
+            return n;
+
+        // The file doesn't support splice(2): consume the rest of the data
+        // (identical to its duplicate) and copy it through user space
+        if (debug)
+            fprintf(stderr, "splice(2) to fd=%d failed (%s), copying output\r\n",
+                file_fd, strerror(errno));
+        copy = true;
+        if (read_all(fd, buf + done, n - done) < 0)
+            return -1;
+        if (write_all(file_fd, buf + done, n - done) < 0 && debug)
+            fprintf(stderr, "Failed to write to fd=%d: %s\r\n", file_fd, strerror(errno));
+        return n;
+    }
+    #endif
+
+    if ((n = ::read(fd, buf, len)) > 0 && write_all(file_fd, buf, n) < 0 && debug)
+        fprintf(stderr, "Failed to write to fd=%d: %s\r\n", file_fd, strerror(errno));
+    return n;
+}
+
+int FileSink::open(const char* stream, ei::StringBuffer<128>& err)
+{
+    struct stat st;
+    void* p;
+
+    int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (spool ? O_TRUNC : O_APPEND);
+
+    if ((fd = ::open(path.c_str(), flags, 0644)) < 0) {
+        err.write("Failed to open %s file %s: %s", stream, path.c_str(), strerror(errno));
+        return -1;
+    }
+    // The buffer is page aligned so that flushes are aligned writes
+    if (posix_memalign(&p, SINK_ALIGN, buf_size) != 0) {
+        err.write("Failed to allocate %s buffer of %lu bytes", stream, (unsigned long)buf_size);
+        ::close(fd);
+        fd = -1;
+        return -1;
+    }
+    buf     = (char*)p;
+    buf_len = 0;
+    size    = fstat(fd, &st) == 0 ? st.st_size : 0;
+    opened  = report_time = time(NULL);
+
+    if (debug)
+        fprintf(stderr, "  Writing %s to file: '%s' (fd=%d, size=%llu)\r\n",
+            stream, path.c_str(), fd, size);
+    return 0;
+}
+
+int FileSink::write(const char* data, size_t len)
+{
+    time_t now = time(NULL);
+
+    // Don't let a file grow over max_size unless a single write is larger
+    if (!spool &&
+        ((max_size && size + buf_len + len > max_size && size + buf_len > 0) ||
+         (max_age  && now - opened >= max_age)))
+    {
+        if (flush() < 0 || rotate() < 0)
+            return -1;
+    }
+
+    while (len > 0) {
+        if (buf_len == 0)
+            buf_time = now;
+        size_t n = std::min(len, buf_size - buf_len);
+        memcpy(buf + buf_len, data, n);
+        buf_len += n;
+        data    += n;
+        len     -= n;
+        if (buf_len == buf_size && flush() < 0)
+            return -1;
+    }
+
+    return buf_len > 0 && now - buf_time >= SINK_FLUSH_SEC ? flush(spool) : 0;
+}
+
+int FileSink::flush(bool aligned)
+{
+    // An aligned flush writes whole blocks only, keeping the file offset aligned
+    size_t n = aligned ? buf_len - buf_len % SINK_ALIGN : buf_len;
+    if (n == 0)
+        return 0;
+
+    int rc = write_all(fd, buf, n) < 0 ? -1 : 0;
+    if (rc < 0 && debug)
+        fprintf(stderr, "Failed to write %lu bytes to %s: %s\r\n",
+            (unsigned long)n, path.c_str(), strerror(errno));
+    else
+        size += n;
+
+    buf_len -= n;
+    if (buf_len > 0) {
+        memmove(buf, buf + n, buf_len);
+        buf_time = time(NULL);
+    }
+    return rc;
+}
+
+int FileSink::rotate()
+{
+    // File.N-1 -> File.N, ..., File -> File.1
+    std::stringstream from, to;
+    for (int i=count; i > 0; i--) {
+        from.str(""); to.str("");
+        if (i > 1) from << path << '.' << (i-1);
+        else       from << path;
+        to << path << '.' << i;
+        if (rename(from.str().c_str(), to.str().c_str()) < 0 && errno != ENOENT && debug)
+            fprintf(stderr, "Failed to rename %s to %s: %s\r\n",
+                from.str().c_str(), to.str().c_str(), strerror(errno));
+    }
+
+    int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (count > 0 ? O_APPEND : O_TRUNC);
+    int newfd = ::open(path.c_str(), flags, 0644);
+    if (newfd < 0) {
+        if (debug)
+            fprintf(stderr, "Failed to open %s: %s\r\n", path.c_str(), strerror(errno));
+        return -1;
+    }
+    // Keep the same fd number so that it stays valid in copies of this sink
+    dup2(newfd, fd);
+    ::close(newfd);
+
+    size   = 0;
+    opened = time(NULL);
+
+    if (debug)
+        fprintf(stderr, "Rotated file %s (fd=%d)\r\n", path.c_str(), fd);
+    return 0;
+}
+
+void FileSink::tick(time_t now)
+{
+    if (!spool && max_age && now - opened >= max_age && size + buf_len > 0) {
+        flush();
+        rotate();
+    } else if (buf_len > 0 && now - buf_time >= SINK_FLUSH_SEC)
+        flush(spool);
+}
+
+void FileSink::close()
+{
+    if (fd >= 0) {
+        flush();
+        ::close(fd);
+    }
+    free(buf);
+    fd  = -1;
+    buf = NULL;
+}
+
+void tick_buffered_output()
+{
+    time_t now = time(NULL);
+    for (MapChildrenT::iterator it=children.begin(), end=children.end(); it != end; ++it)
+        for (int i=STDOUT_FILENO; i <= STDERR_FILENO; i++) {
+            FileSink& sink = it->second.sink[i];
+            StreamCompressor& zip = it->second.zip[i];
+            if (sink.active()) {
+                sink.tick(now);
+                if (sink.report_due(now))
+                    send_spooled(it->first, sink);
+            }
+            if (zip.active() && zip.pending > 0 && now - zip.pending_time >= SINK_FLUSH_SEC)
+                send_compressed_output(it->second, i, NULL, 0);
+        }
+}
+
+int send_spooled(pid_t pid, FileSink& sink)
+{
+    // {0, {spooled, OsPid, File::string(), Bytes::integer()}}
+    sink.reported    = sink.size;
+    sink.report_time = time(NULL);
+
+    eis.reset();
+    eis.encodeTupleSize(2);
+    eis.encode(0);
+    eis.encodeTupleSize(4);
+    eis.encode(atom_t("spooled"));
+    eis.encode(pid);
+    eis.encode(sink.path);
+    eis.encode(sink.size);
+    return eis.write();
+}
+
+int StreamCompressor::init()
+{
+    #ifdef HAVE_ZLIB
+    zs = new z_stream;
+    memset(zs, 0, sizeof(z_stream));
+    if (deflateInit(zs, level) != Z_OK) {
+        delete zs;
+        zs = NULL;
+        return -1;
+    }
+    return 0;
+    #else
+    return -1;
+    #endif
+}
+
+int StreamCompressor::deflate(const char* data, size_t len, int mode, std::string& out)
+{
+    #ifdef HAVE_ZLIB
+    char chunk[16384];
+    zs->next_in  = (Bytef*)data;
+    zs->avail_in = len;
+    do {
+        zs->next_out  = (Bytef*)chunk;
+        zs->avail_out = sizeof(chunk);
+        int rc = ::deflate(zs, mode);
+        if (rc == Z_STREAM_ERROR)
+            return -1;
+        out.append(chunk, sizeof(chunk) - zs->avail_out);
+    } while (zs->avail_out == 0);
+    return 0;
+    #else
+    return -1;
+    #endif
+}
+
+void StreamCompressor::free()
+{
+    #ifdef HAVE_ZLIB
+    if (zs) {
+        deflateEnd(zs);
+        delete zs;
+        zs = NULL;
+    }
+    #endif
+}
+
+int perf_event_index(const std::string& name)
+{
+    #ifdef __linux__
+    for (int i=0; i < (int)(sizeof(perf_events) / sizeof(perf_events[0])); i++)
+        if (name == perf_events[i].name)
+            return i;
+    #endif
+    return -1;
+}
+
+void open_perf_counters(pid_t pid, CmdOptions& op)
+{
+    #ifdef __linux__
+    const PerfEventListT& events = op.perf_events();
+
+    for (PerfEventListT::const_iterator it = events.begin(), end = events.end(); it != end; ++it) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size           = sizeof(attr);
+        attr.type           = perf_events[*it].type;
+        attr.config         = perf_events[*it].config;
+        attr.read_format    = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        attr.disabled       = 1;
+        attr.inherit        = 1;    // Include processes forked by the child
+        attr.enable_on_exec = 1;    // Start counting at execve(2) of the child
+
+        int fd = syscall(__NR_perf_event_open, &attr, pid, -1, -1, 0);
+
+        // Unprivileged users may only be allowed to count user-space events
+        // (see /proc/sys/kernel/perf_event_paranoid)
+        if (fd < 0 && (errno == EACCES || errno == EPERM)) {
+            attr.exclude_kernel = 1;
+            attr.exclude_hv     = 1;
+            fd = syscall(__NR_perf_event_open, &attr, pid, -1, -1, 0);
+        }
+
+        if (fd < 0) {
+            if (debug)
+                fprintf(stderr, "Cannot open perf counter '%s' for pid %d: %s\r\n",
+                    perf_events[*it].name, pid, strerror(errno));
+            continue;
+        }
+
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        op.perf_fds().push_back(std::make_pair(*it, fd));
+
+        if (debug)
+            fprintf(stderr, "  Opened perf counter '%s' for pid %d (fd=%d)\r\n",
+                perf_events[*it].name, pid, fd);
+    }
+    #endif
+}
+
+int read_perf_counter(int fd, unsigned long long& value)
+{
+    unsigned long long v[3];    // value, time_enabled, time_running
+    int n;
+
+    while ((n = read(fd, v, sizeof(v))) < 0 && errno == EINTR);
+
+    if (n != (int)sizeof(v))
+        return -1;
+
+    // Scale the value if the counter was multiplexed with other events
+    if (v[2] > 0 && v[2] < v[1])
+        value = (unsigned long long)((double)v[0] * v[1] / v[2]);
+    else
+        value = v[0];
+    return 0;
+}
+
+int open_capture(const char* file)
 {
-    int flags = O_RDWR | O_CREAT | (append ? O_APPEND : O_TRUNC);
-    int mode  = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
-    int fd    = open(file, flags, mode);
-    if (fd < 0) {
-        err.write("Failed to redirect %s to file: %s", stream, strerror(errno));
+    if ((capture_file = fopen(file, "ab")) == NULL) {
+        fprintf(stderr, "Cannot open capture file %s: %s\r\n", file, strerror(errno));
         return -1;
     }
+    setvbuf(capture_file, NULL, _IOFBF, 64*1024);
+
+    // Write the magic header only when starting a new file
+    if (ftell(capture_file) == 0 &&
+        fwrite(CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)-1, 1, capture_file) != 1) {
+        fprintf(stderr, "Cannot write capture file %s: %s\r\n", file, strerror(errno));
+        fclose(capture_file);
+        capture_file = NULL;
+        return -1;
+    }
+
+    eis.hook(capture_packet);
+
     if (debug)
-        fprintf(stderr, "  Redirecting %s of cmd '%s' to file: '%s' (fd=%d)\r\n",
-            stream, cmd, file, fd);
+        fprintf(stderr, "Capturing protocol packets to %s\r\n", file);
+    return 0;
+}
 
-    return fd;
+// Stop capturing on the first write error (e.g. a full disk), so that the
+// file is only ever truncated at a record boundary instead of having holes
+void close_capture(const char* what)
+{
+    fprintf(stderr, "Cannot %s capture file: %s - capture stopped\r\n",
+            what, strerror(errno));
+    eis.hook(NULL);
+    fclose(capture_file);
+    capture_file = NULL;
 }
 
-int open_pipe(int fds[2], const char* stream, ei::StringBuffer<128>& err)
+void capture_packet(bool inbound, const char* data, size_t len, void*)
 {
-    if (pipe(fds) < 0) {
-        err.write("Failed to create a pipe for %s: %s", stream, strerror(errno));
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    unsigned long long ns = (unsigned long long)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+
+    byte hdr[13];
+    hdr[0] = inbound ? 'I' : 'O';
+    for (int i=0; i < 8; i++) hdr[1+i] = (byte)(ns  >> (56 - 8*i));
+    for (int i=0; i < 4; i++) hdr[9+i] = (byte)(len >> (24 - 8*i));
+
+    if (fwrite(hdr,  sizeof(hdr), 1, capture_file) != 1 ||
+        fwrite(data, len,         1, capture_file) != 1)
+        close_capture("write");
+}
+
+int CmdOptions::ei_decode_pipeline(ei::Serializer& ei)
+{
+    // {[Cmd::string()], [Option]}
+    std::list<std::string> stages;
+    int sz = eis.decodeListSize();
+
+    if (sz <= 0) {
+        m_err << "badarg: non-empty list of pipeline commands expected";
         return -1;
     }
-    if (fds[1] > max_fds) {
-        close(fds[0]);
-        close(fds[1]);
-        err.write("Exceeded number of available file descriptors (fd=%d)", fds[1]);
+    for (int i=0; i < sz; i++) {
+        std::string cmd;
+        if (eis.decodeString(cmd) < 0) {
+            m_err << "badarg: pipeline command #" << i << " must be a string";
+            return -1;
+        }
+        stages.push_back(cmd);
+    }
+    if (eis.decodeListEnd() < 0) {
+        m_err << "badarg: proper list of pipeline commands expected";
+        return -1;
+    }
+
+    if (ei_decode(ei) < 0)
+        return -1;
+    else if (m_msg_fd > 0 || !m_perf_events.empty() || m_restart != RESTART_NEVER) {
+        m_err << "msg, perf_counters and restart options are not supported by pipelines";
         return -1;
     }
-    if (debug)
-        fprintf(stderr, "  Redirecting [%s -> pipe(rd=%d, wr=%d)]\r\n", stream, fds[0], fds[1]);
 
+    m_stages.swap(stages);
+    m_cmd = m_stages.back();
     return 0;
 }
 
-int CmdOptions::ei_decode(ei::Serializer& ei, bool getCmd)
+int CmdOptions::ei_decode(ei::Serializer& ei, bool getCmd, const char** allowed)
 {
     // {Cmd::string(), [Option]}
     //      Option = {env, Strings} | {cd, Dir} | {kill, Cmd}
@@ -1389,10 +5114,35 @@ int CmdOptions::ei_decode(ei::Serializer& ei, bool getCmd)
 
     m_err.str("");
     m_cmd.clear();
+    m_stages.clear();
     m_kill_cmd.clear();
     m_env.clear();
 
     m_nice = INT_MAX;
+    m_sync_limit = 0;
+    m_output_rate = 0;
+    m_max_output = 0;
+    m_max_output_action = LIMIT_TRUNCATE;
+    m_msg_fd = 0;
+    m_job_class.clear();
+    m_job_class_max = 0;
+    m_priority = 0;
+    m_queue_timeout = DEF_QUEUE_TIMEOUT;
+    m_restart = RESTART_NEVER;
+    m_timeout = 0;
+    m_cpu_limit = 0;
+    m_cgroup = CgroupSpec();
+    m_cpus.clear();
+    m_numa_node = -1;
+    m_ioprio = -1;
+    m_sched_policy = -1;
+    m_sched_priority = 0;
+    m_setsid = subreaper;
+    m_tags.clear();
+    m_perf_events.clear();
+    m_perf_fds.clear();
+    for (int i=STDOUT_FILENO; i <= STDERR_FILENO; i++)
+        m_framing[i] = StreamFraming();
 
     if (getCmd && eis.decodeString(m_cmd) < 0) {
         m_err << "badarg: cmd string expected or string size too large";
@@ -1403,10 +5153,16 @@ int CmdOptions::ei_decode(ei::Serializer& ei, bool getCmd)
     }
 
     // Note: The STDIN, STDOUT, STDERR enums must occupy positions 0, 1, 2!!!
-    enum OptionT       { STDIN,  STDOUT,  STDERR,  CD,  ENV,  KILL,  KILL_TIMEOUT,  NICE,  USER,  GROUP} opt;
-    const char* opts[]={"stdin","stdout","stderr","cd","env","kill","kill_timeout","nice","user","group"};
+    enum OptionT       { STDIN,  STDOUT,  STDERR,  CD,  ENV,  KILL,  KILL_TIMEOUT,  NICE,  USER,  GROUP,
+                         PERF_COUNTERS,  SYNC,  OUTPUT_RATE,  MAX_OUTPUT,  MSG,  JOB_CLASS,  PRIORITY,
+                         QUEUE_TIMEOUT,  RESTART,  TIMEOUT,  CPU_LIMIT,  CGROUP,  CPU_AFFINITY,
+                         NUMA_NODE,  IOPRIO,  SCHED_POLICY,  SETSID,  TAGS} opt;
+    const char* opts[]={"stdin","stdout","stderr","cd","env","kill","kill_timeout","nice","user","group",
+                        "perf_counters","sync","output_rate","max_output","msg","job_class","priority",
+                        "queue_timeout","restart","timeout","cpu_limit","cgroup","cpu_affinity",
+                        "numa_node","ioprio","sched_policy","setsid","tags"};
 
-    bool seen_opt[STDERR+1] = {false};
+    bool seen_opt[sizeof(opts)/sizeof(opts[0])] = {false};
 
     for(int i=0; i < sz; i++) {
         int arity, type = eis.decodeType(arity);
@@ -1414,9 +5170,11 @@ int CmdOptions::ei_decode(ei::Serializer& ei, bool getCmd)
         if (type == ERL_ATOM_EXT && (int)(opt = (OptionT)eis.decodeAtomIndex(opts, op)) >= 0)
             arity = 1;
         else if (type != ERL_SMALL_TUPLE_EXT ||
-                   eis.decodeTupleSize() != 2  ||
-                   (int)(opt = (OptionT)eis.decodeAtomIndex(opts, op)) < 0) {
-            m_err << "badarg: cmd option must be {Cmd, Opt} or atom";
+                   eis.decodeTupleSize() != arity ||
+                   (int)(opt = (OptionT)eis.decodeAtomIndex(opts, op)) < 0 ||
+                   (opt == SCHED_POLICY ? arity < 2 || arity > 3 :
+                    arity != (opt == RESTART ? 5 : opt == MAX_OUTPUT || opt == JOB_CLASS || opt == IOPRIO ? 3 : 2))) {
+            m_err << "badarg: cmd option must be {Cmd, Opt}, {Cmd, Opt, Opt} or atom";
             return -1;
         }
 
@@ -1424,6 +5182,14 @@ int CmdOptions::ei_decode(ei::Serializer& ei, bool getCmd)
             m_err << "duplicate " << op << " option specified";
             return -1;
         }
+        if (allowed) {
+            const char** p = allowed;
+            while (*p && op != *p) p++;
+            if (!*p) {
+                m_err << op << " option is not supported";
+                return -1;
+            }
+        }
         seen_opt[opt] = true;
 
         switch (opt) {
@@ -1489,6 +5255,254 @@ int CmdOptions::ei_decode(ei::Serializer& ei, bool getCmd)
                 }
                 break;
 
+            case PERF_COUNTERS: {
+                // {perf_counters, [Event::atom()]}
+                #ifndef __linux__
+                m_err << op << " option is not supported on this platform";
+                return -1;
+                #endif
+                int n = eis.decodeListSize();
+                if (n < 0) {
+                    m_err << op << " list of events expected";
+                    return -1;
+                }
+                for (int i=0; i < n; i++) {
+                    int idx;
+                    if (eis.decodeAtom(val) < 0 || (idx = perf_event_index(val)) < 0) {
+                        m_err << op << " invalid event #" << i;
+                        return -1;
+                    }
+                    m_perf_events.push_back(idx);
+                }
+                if (n > 0 && eis.decodeListEnd() < 0) {
+                    m_err << op << " invalid list of events";
+                    return -1;
+                }
+                break;
+            }
+
+            case TAGS: {
+                // {tags, [Tag::string()]}
+                int n = eis.decodeListSize();
+                for (int j=0; j < n; j++) {
+                    if (eis.decodeString(val) < 0 || val.empty()) { n = -1; break; }
+                    m_tags.push_back(val);
+                }
+                if (n <= 0 || eis.decodeListEnd() < 0) {
+                    m_err << op << " must be a non-empty list of strings";
+                    return -1;
+                }
+                break;
+            }
+
+            case SETSID:
+                // setsid
+                if (arity != 1) {
+                    m_err << op << " option takes no value";
+                    return -1;
+                }
+                m_setsid = true;
+                break;
+
+            case SYNC: {
+                // sync | {sync, MaxBytes::integer()}
+                long n = DEF_SYNC_LIMIT;
+                if (arity != 1 && (eis.decodeInt(n) < 0 || n <= 0 || n > MAX_SYNC_LIMIT)) {
+                    m_err << op << " limit must be an integer between 1 and " << MAX_SYNC_LIMIT;
+                    return -1;
+                }
+                m_sync_limit = n;
+                break;
+            }
+
+            case OUTPUT_RATE:
+                // {output_rate, BytesPerSec::integer()}
+                if (eis.decodeInt(m_output_rate) < 0 || m_output_rate <= 0) {
+                    m_err << op << " must be a positive integer";
+                    return -1;
+                }
+                break;
+
+            case JOB_CLASS: {
+                // {job_class, Class::atom(), MaxJobs::integer()}
+                long n;
+                if (eis.decodeAtom(m_job_class) < 0) {
+                    m_err << op << " class must be an atom";
+                    return -1;
+                } else if (eis.decodeInt(n) < 0 || n <= 0) {
+                    m_err << op << " max jobs must be a positive integer";
+                    return -1;
+                }
+                m_job_class_max = n;
+                break;
+            }
+
+            case PRIORITY:
+                // {priority, Priority::integer()}
+                if (eis.decodeInt(m_priority) < 0) {
+                    m_err << op << " must be an integer";
+                    return -1;
+                }
+                break;
+
+            case QUEUE_TIMEOUT:
+                // {queue_timeout, Sec::integer() | infinity}
+                if (eis.decodeType(arity) == ERL_ATOM_EXT) {
+                    if (eis.decodeAtom(val) < 0 || val != "infinity") {
+                        m_err << op << " must be a positive integer or infinity";
+                        return -1;
+                    }
+                    m_queue_timeout = 0;
+                } else if (eis.decodeInt(m_queue_timeout) < 0 || m_queue_timeout <= 0) {
+                    m_err << op << " must be a positive integer or infinity";
+                    return -1;
+                }
+                break;
+
+            case RESTART: {
+                // {restart, permanent | transient, MaxRestarts::integer(),
+                //           WithinSec::integer(), BackoffMsec::integer()}
+                long max, within, backoff;
+                if (eis.decodeAtom(val) < 0 || (val != "permanent" && val != "transient")) {
+                    m_err << op << " policy must be permanent or transient";
+                    return -1;
+                } else if (eis.decodeInt(max) < 0 || max <= 0 ||
+                           eis.decodeInt(within) < 0 || within <= 0 ||
+                           eis.decodeInt(backoff) < 0 || backoff < 0) {
+                    m_err << op << " must be {restart, Policy, MaxRestarts, WithinSec, BackoffMsec}";
+                    return -1;
+                }
+                m_restart         = val == "permanent" ? RESTART_PERMANENT : RESTART_TRANSIENT;
+                m_max_restarts    = max;
+                m_restart_within  = within;
+                m_restart_backoff = backoff;
+                break;
+            }
+
+            case TIMEOUT:
+            case CPU_LIMIT: {
+                // {timeout, Msec::integer()} | {cpu_limit, Sec::integer()}
+                long n;
+                if (eis.decodeInt(n) < 0 || n <= 0 || n > INT_MAX) {
+                    m_err << op << " must be a positive integer";
+                    return -1;
+                }
+                (opt == TIMEOUT ? m_timeout : m_cpu_limit) = n;
+                break;
+            }
+
+            case CGROUP:
+                // {cgroup, [CgroupOpt]}
+                if (ei_decode_cgroup(eis) < 0)
+                    return -1;
+                break;
+
+            case CPU_AFFINITY:
+            case NUMA_NODE:
+            case IOPRIO:
+            case SCHED_POLICY: {
+                #ifndef __linux__
+                m_err << op << " option is not supported on this platform";
+                return -1;
+                #else
+                long n, ncpus = sysconf(_SC_NPROCESSORS_CONF);
+                if (opt == CPU_AFFINITY) {
+                    // {cpu_affinity, [Cpu::integer()]}
+                    // Lists of small integers are encoded as strings
+                    int sz;
+                    ei::StringBuffer<64> str;
+                    if (eis.decodeType(sz) == ERL_STRING_EXT && (n = eis.decodeString(str)) >= 0) {
+                        for (int j=0; j < n; j++)
+                            m_cpus.push_back((unsigned char)str.c_str()[j]);
+                    } else if ((n = eis.decodeListSize()) > 0) {
+                        for (int j=0; j < n; j++) {
+                            long cpu;
+                            if (eis.decodeInt(cpu) < 0) { n = -1; break; }
+                            m_cpus.push_back(cpu);
+                        }
+                        if (n > 0 && eis.decodeListEnd() < 0) n = -1;
+                    }
+                    bool ok = n >= 0 && !m_cpus.empty();
+                    for (std::list<int>::iterator it=m_cpus.begin(); ok && it != m_cpus.end(); ++it)
+                        ok = *it >= 0 && *it < ncpus && *it < CPU_SETSIZE;
+                    if (!ok) {
+                        m_err << op << " must be a non-empty list of CPUs between 0 and " << ncpus-1;
+                        return -1;
+                    }
+                } else if (opt == NUMA_NODE) {
+                    // {numa_node, Node::integer()}
+                    if (eis.decodeInt(n) < 0 || n < 0 || n >= MAX_NUMA_NODES) {
+                        m_err << op << " must be an integer between 0 and " << MAX_NUMA_NODES-1;
+                        return -1;
+                    }
+                    m_numa_node = n;
+                } else if (opt == IOPRIO) {
+                    // {ioprio, realtime | best_effort | idle, Level::integer()}
+                    const int cnt = sizeof(ioprio_classes)/sizeof(ioprio_classes[0]);
+                    int cls = eis.decodeAtom(val) < 0 ? cnt : 0;
+                    while (cls < cnt && val != ioprio_classes[cls])
+                        cls++;
+                    if (cls == cnt || eis.decodeInt(n) < 0 || n < 0 || n > 7) {
+                        m_err << op << " must be {ioprio, realtime | best_effort | idle, 0..7}";
+                        return -1;
+                    }
+                    m_ioprio = ((cls+1) << IOPRIO_SHIFT) | n;
+                } else {
+                    // {sched_policy, other | batch | idle} | {sched_policy, fifo | rr, Priority}
+                    const SchedPolicyT* p   = NULL;
+                    const int           cnt = sizeof(sched_policies)/sizeof(sched_policies[0]);
+                    if (eis.decodeAtom(val) == 0)
+                        for (int j=0; j < cnt && !p; j++)
+                            if (val == sched_policies[j].name)
+                                p = &sched_policies[j];
+                    if (!p || p->realtime != (arity == 3)) {
+                        m_err << op << " must be {sched_policy, other | batch | idle} or"
+                                       " {sched_policy, fifo | rr, Priority}";
+                        return -1;
+                    }
+                    m_sched_policy = p->policy;
+                    if (arity == 3 && (eis.decodeInt(n) < 0 ||
+                                       n < sched_get_priority_min(p->policy) ||
+                                       n > sched_get_priority_max(p->policy))) {
+                        m_err << op << " priority must be an integer between "
+                              << sched_get_priority_min(p->policy) << " and "
+                              << sched_get_priority_max(p->policy);
+                        return -1;
+                    }
+                    m_sched_priority = arity == 3 ? n : 0;
+                }
+                break;
+                #endif
+            }
+
+            case MSG: {
+                // msg | {msg, Fd::integer()}
+                long fd = DEF_MSG_FD;
+                if (arity != 1 && (eis.decodeInt(fd) < 0 || fd <= STDERR_FILENO || fd >= max_fds)) {
+                    m_err << op << " fd must be an integer between 3 and " << max_fds-1;
+                    return -1;
+                }
+                m_msg_fd = fd;
+                break;
+            }
+
+            case MAX_OUTPUT: {
+                // {max_output, Bytes::integer(), truncate | drop | kill}
+                long n;
+                if (eis.decodeInt(n) < 0 || n <= 0) {
+                    m_err << op << " size must be a positive integer";
+                    return -1;
+                } else if (eis.decodeAtom(val) < 0 ||
+                           (val != "truncate" && val != "drop" && val != "kill")) {
+                    m_err << op << " action must be one of truncate, drop or kill";
+                    return -1;
+                }
+                m_max_output        = n;
+                m_max_output_action = val == "kill" ? LIMIT_KILL
+                                    : val == "drop" ? LIMIT_DROP : LIMIT_TRUNCATE;
+                break;
+            }
+
             case ENV: {
                 // {env, [NameEqualsValue::string()]}
                 // passed in env variables are appended to the existing ones
@@ -1543,16 +5557,39 @@ int CmdOptions::ei_decode(ei::Serializer& ei, bool getCmd)
                     std::string s, fop;
                     type = eis.decodeType(sz);
 
-                    if (type == ERL_ATOM_EXT)
+                    if (type == ERL_LIST_EXT && opt != STDIN) {
+                        if (ei_decode_stream_opts(eis, opt) < 0)
+                            return -1;
+                        stream_redirect(opt, REDIRECT_ERL);
+                    } else if (type == ERL_SMALL_TUPLE_EXT && sz == 3 && opt != STDIN) {
+                        // {tee, File, Sink} | {rotate, File, [RotateOpt]} | {spool, File, [SpoolOpt]}
+                        if (eis.decodeTupleSize() != 3 || eis.decodeAtom(fop) < 0 ||
+                            (fop != "tee" && fop != "rotate" && fop != "spool")) {
+                            m_err << op << " {tee, File, Sink}, {rotate, File, Opts} or"
+                                           " {spool, File, Opts} tuple expected";
+                            return -1;
+                        }
+                        if ((fop == "tee" ? ei_decode_tee(eis, opt) : ei_decode_sink(eis, opt, fop)) < 0)
+                            return -1;
+                    } else if (type == ERL_ATOM_EXT)
                         eis.decodeAtom(s);
                     else if (type == ERL_STRING_EXT)
                         eis.decodeString(s);
-                    else if (! (type == ERL_SMALL_TUPLE_EXT && sz == 2 &&
+                    else if (type == ERL_SMALL_TUPLE_EXT && sz == 2 &&
                         eis.decodeTupleSize() == 2 &&
-                        eis.decodeAtom(fop) == 0 &&
-                        eis.decodeString(s) == 0 && fop == "append"))
+                        eis.decodeAtom(fop) == 0 && fop == "tail" && opt != STDIN)
+                    {
+                        long n;
+                        if (eis.decodeInt(n) < 0 || n <= 0 || n > MAX_TAIL_SIZE) {
+                            m_err << op << " tail size must be an integer between 1 and " << MAX_TAIL_SIZE;
+                            return -1;
+                        }
+                        m_tail_size[opt] = n;
+                        stream_redirect(opt, REDIRECT_TAIL);
+                    }
+                    else if (!(fop == "append" && eis.decodeString(s) == 0))
                     {
-                        m_err << "atom, string or {append, Name} tuple required for option " << op;
+                        m_err << "atom, string, {append, Name} or {tail, Bytes} tuple required for option " << op;
                         return -1;
                     }
 
@@ -1596,6 +5633,22 @@ int CmdOptions::ei_decode(ei::Serializer& ei, bool getCmd)
         return -1;
     }
 
+    if (m_restart != RESTART_NEVER && (m_sync_limit > 0 || !m_perf_events.empty())) {
+        m_err << "restart option is not supported with sync or perf_counters";
+        return -1;
+    }
+
+    #ifdef __linux__
+    // Without cpu_affinity the command runs on the CPUs of its NUMA node
+    std::list<int> node_cpus;
+    if (m_numa_node >= 0 && numa_node_cpus(m_numa_node, node_cpus) < 0) {
+        m_err << "numa_node " << m_numa_node << " doesn't exist";
+        return -1;
+    }
+    if (m_cpus.empty())
+        m_cpus.swap(node_cpus);
+    #endif
+
     if (debug > 1)
         fprintf(stderr, "Parsed cmd '%s' options\r\n  (stdin=%s, stdout=%s, stderr=%s)\r\n",
             m_cmd.c_str(), stream_fd_type(0), stream_fd_type(1), stream_fd_type(2));
@@ -1603,6 +5656,274 @@ int CmdOptions::ei_decode(ei::Serializer& ei, bool getCmd)
     return 0;
 }
 
+int CmdOptions::ei_decode_stream_opts(ei::Serializer& ei, int i)
+{
+    // [{framing, line | {delimiter, Byte} | {packet, 1|2|4}} | {max_record, Bytes}]
+    const char* stream = i == STDOUT_FILENO ? "stdout" : "stderr";
+    StreamFraming& f   = m_framing[i];
+    int n = eis.decodeListSize();
+
+    for (int j=0; j < n; j++) {
+        std::string op, val;
+        int sz;
+        long v;
+
+        if (eis.decodeTupleSize() != 2 || eis.decodeAtom(op) < 0) {
+            m_err << stream << " option must be a {Opt, Value} tuple";
+            return -1;
+        }
+
+        if (op == "framing") {
+            int type = eis.decodeType(sz);
+            if (type == ERL_ATOM_EXT && eis.decodeAtom(val) == 0 && val == "line") {
+                f.type  = FRAMING_DELIMITER;
+                f.delim = '\n';
+            } else if (type == ERL_SMALL_TUPLE_EXT && sz == 2 && eis.decodeTupleSize() == 2 &&
+                       eis.decodeAtom(val) == 0 && eis.decodeInt(v) == 0) {
+                if (val == "delimiter" && v >= 0 && v <= 255) {
+                    f.type  = FRAMING_DELIMITER;
+                    f.delim = (char)v;
+                } else if (val == "packet" && (v == 1 || v == 2 || v == 4)) {
+                    f.type     = FRAMING_PACKET;
+                    f.hdr_size = v;
+                } else {
+                    m_err << stream << " invalid framing {" << val << ", " << v << "}";
+                    return -1;
+                }
+            } else {
+                m_err << stream << " invalid framing option";
+                return -1;
+            }
+        } else if (op == "include" || op == "exclude") {
+            RegexListT& list = op == "include" ? f.include : f.exclude;
+            int m = eis.decodeListSize();
+            if (m < 0) {
+                m_err << stream << " " << op << " list of patterns expected";
+                return -1;
+            }
+            for (int k=0; k < m; k++) {
+                if (eis.decodeBinary(val) < 0) {
+                    m_err << stream << " " << op << " pattern must be a binary";
+                    return -1;
+                }
+                regex_t* re = new regex_t;
+                int rc = regcomp(re, val.c_str(), REG_EXTENDED | REG_NOSUB);
+                if (rc != 0) {
+                    char buf[128];
+                    regerror(rc, re, buf, sizeof(buf));
+                    delete re;
+                    m_err << stream << " invalid " << op << " pattern '" << val << "': " << buf;
+                    return -1;
+                }
+                list.push_back(re);
+            }
+            if (m > 0 && eis.decodeListEnd() < 0) {
+                m_err << stream << " invalid " << op << " list";
+                return -1;
+            }
+        } else if (op == "compress") {
+            #ifndef HAVE_ZLIB
+            m_err << stream << " compression is not supported by this build";
+            return -1;
+            #endif
+            if (eis.decodeInt(v) < 0 || v < 0 || v > 9) {
+                m_err << stream << " compress level must be an integer between 0 and 9";
+                return -1;
+            }
+            m_zip[i].level = v;
+        } else if (op == "compress_flush") {
+            if (eis.decodeInt(v) < 0 || v <= 0 || v > MAX_COMPRESS_FLUSH) {
+                m_err << stream << " compress_flush must be an integer between 1 and " << MAX_COMPRESS_FLUSH;
+                return -1;
+            }
+            m_zip[i].flush_bytes = v;
+        } else if (op == "max_record") {
+            if (eis.decodeInt(v) < 0 || v <= 0 || v > MAX_BATCH_SIZE) {
+                m_err << stream << " max_record must be an integer between 1 and " << MAX_BATCH_SIZE;
+                return -1;
+            }
+            f.max_record = v;
+        } else {
+            m_err << stream << " invalid option: " << op;
+            return -1;
+        }
+    }
+
+    if (n > 0 && eis.decodeListEnd() < 0) {
+        m_err << stream << " invalid option list";
+        return -1;
+    }
+
+    // Compressed output is sent as is
+    if (m_zip[i].level >= 0) {
+        if (f.type != FRAMING_NONE || f.filtered()) {
+            m_err << stream << " compress option can't be combined with framing or filters";
+            return -1;
+        }
+        if (m_zip[i].init() < 0) {
+            m_err << stream << " failed to initialize compression";
+            return -1;
+        }
+    }
+
+    // Filters are applied on line boundaries unless another framing is given
+    if (f.filtered() && f.type == FRAMING_NONE) {
+        f.type  = FRAMING_DELIMITER;
+        f.delim = '\n';
+    }
+    return 0;
+}
+
+int CmdOptions::ei_decode_tee(ei::Serializer& ei, int i)
+{
+    // {tee, File::string() | {append, File::string()}, erlang | {tail, Bytes}}
+    // (the tuple header and the 'tee' atom are already decoded)
+    const char* stream = i == STDOUT_FILENO ? "stdout" : "stderr";
+    std::string op, file;
+    bool append = false;
+    long n = 0;
+    int  sz, type = eis.decodeType(sz);
+
+    if (type == ERL_SMALL_TUPLE_EXT && sz == 2) {
+        append = eis.decodeTupleSize() == 2 && eis.decodeAtom(op) == 0 && op == "append";
+        if (!append || eis.decodeString(file) < 0) {
+            m_err << stream << " tee file must be a string or {append, File}";
+            return -1;
+        }
+    } else if (eis.decodeString(file) < 0 || file.empty()) {
+        m_err << stream << " tee file must be a string or {append, File}";
+        return -1;
+    }
+
+    type = eis.decodeType(sz);
+    if (type == ERL_ATOM_EXT && eis.decodeAtom(op) == 0 && op == "erlang")
+        stream_redirect(i, REDIRECT_ERL);
+    else if (type == ERL_SMALL_TUPLE_EXT && sz == 2 && eis.decodeTupleSize() == 2 &&
+             eis.decodeAtom(op) == 0 && op == "tail" &&
+             eis.decodeInt(n) == 0 && n > 0 && n <= MAX_TAIL_SIZE) {
+        m_tail_size[i] = n;
+        stream_redirect(i, REDIRECT_TAIL);
+    } else {
+        m_err << stream << " tee sink must be erlang or {tail, Bytes} (Bytes <= " << MAX_TAIL_SIZE << ")";
+        return -1;
+    }
+
+    m_std_stream[i]        = file;
+    m_std_stream_append[i] = append;
+    return 0;
+}
+
+int CmdOptions::ei_decode_sink(ei::Serializer& ei, int i, const std::string& type)
+{
+    // {rotate, File::string(), [RotateOpt]} | {spool, File::string(), [SpoolOpt]}
+    // (the tuple header and the type atom are already decoded)
+    const char* stream = i == STDOUT_FILENO ? "stdout" : "stderr";
+    FileSink&   sink   = m_sink[i];
+    bool        spool  = type == "spool";
+    int n;
+
+    if (spool) {
+        sink.spool    = true;
+        sink.buf_size = DEF_SPOOL_BUFFER;
+    }
+
+    if (eis.decodeString(sink.path) < 0 || sink.path.empty()) {
+        m_err << stream << " " << type << " file must be a string";
+        return -1;
+    }
+    if ((n = eis.decodeListSize()) < 0) {
+        m_err << stream << " " << type << " options must be a list";
+        return -1;
+    }
+
+    for (int j=0; j < n; j++) {
+        std::string op;
+        long v;
+
+        if (eis.decodeTupleSize() != 2 || eis.decodeAtom(op) < 0 || eis.decodeInt(v) < 0 || v < 0) {
+            m_err << stream << " " << type << " option must be a {Opt, Value::integer()} tuple";
+            return -1;
+        }
+
+        if      (op == "size"     && !spool) sink.max_size = v;
+        else if (op == "time"     && !spool) sink.max_age  = v;
+        else if (op == "count"    && !spool) sink.count    = v;
+        else if (op == "progress" &&  spool) sink.progress = v;
+        else if (op == "buffer" && v > 0 && v <= MAX_SINK_BUFFER)
+            sink.buf_size = v;
+        else {
+            m_err << stream << " invalid " << type << " option {" << op << ", " << v << "}";
+            return -1;
+        }
+    }
+
+    if (n > 0 && eis.decodeListEnd() < 0) {
+        m_err << stream << " invalid " << type << " option list";
+        return -1;
+    }
+
+    stream_redirect(i, REDIRECT_SINK);
+    return 0;
+}
+
+int CmdOptions::ei_decode_cgroup(ei::Serializer& ei)
+{
+    // [{name, Name::string()} | {cpu_max, QuotaUsec, PeriodUsec} | {cpu_weight, Weight} |
+    //  {memory_max, Bytes} | {io_max, Limits::string()} | {pids_max, N}]
+    CgroupSpec& cg = m_cgroup;
+    int n;
+
+    if ((n = eis.decodeListSize()) < 0) {
+        m_err << "cgroup options must be a list";
+        return -1;
+    }
+
+    for (int j=0; j < n; j++) {
+        std::string op;
+        long v = 0, period = 0;
+        int  arity = eis.decodeTupleSize();
+
+        if (arity < 2 || eis.decodeAtom(op) < 0) {
+            m_err << "cgroup option must be a {Opt, Value} tuple";
+            return -1;
+        } else if (op == "name" && arity == 2) {
+            if (eis.decodeString(cg.name) < 0 || cg.name.empty() || cg.name[0] == '.' ||
+                cg.name.find('/') != std::string::npos || cg.name.compare(0, 4, "cmd-") == 0) {
+                m_err << "cgroup name must be a non-empty string without '/' not starting with 'cmd-'";
+                return -1;
+            }
+            continue;
+        } else if (op == "io_max" && arity == 2) {
+            if (eis.decodeString(cg.io_max) < 0 || cg.io_max.empty()) {
+                m_err << "cgroup io_max must be a non-empty string";
+                return -1;
+            }
+            continue;
+        } else if (eis.decodeInt(v) < 0 || v <= 0 ||
+                   (arity == 3 && (eis.decodeInt(period) < 0 || period <= 0))) {
+            m_err << "cgroup " << op << " must be a positive integer";
+            return -1;
+        }
+
+        if      (op == "cpu_max"    && arity == 3)  { cg.cpu_quota = v; cg.cpu_period = period; }
+        else if (op == "cpu_weight" && arity == 2 && v <= 10000) cg.cpu_weight = v;
+        else if (op == "memory_max" && arity == 2)  cg.memory_max = v;
+        else if (op == "pids_max"   && arity == 2)  cg.pids_max   = v;
+        else {
+            m_err << "invalid cgroup option " << op;
+            return -1;
+        }
+    }
+
+    if (n > 0 && eis.decodeListEnd() < 0) {
+        m_err << "invalid cgroup option list";
+        return -1;
+    }
+
+    cg.enabled = true;
+    return 0;
+}
+
 /* This exists just to make sure that we don't inadvertently do a
  * kill(-1, SIGKILL), which will cause all kinds of bad things to
  * happen. */
@@ -1621,6 +5942,22 @@ int erl_exec_kill(pid_t pid, int signal) {
     return kill(pid, signal);
 }
 
+/* Signal the process group of a child started with the setsid option. */
+
+int erl_exec_kill_group(pid_t pid, int signal) {
+    if (pid <= 1) {
+        if (debug)
+            fprintf(stderr, "kill(%d, %d) attempt prohibited!\r\n", -pid, signal);
+
+        return -1;
+    }
+
+    if (debug && signal > 0)
+        fprintf(stderr, "Calling kill(pgid=%d, sig=%d)\r\n", pid, signal);
+
+    return kill(-pid, signal);
+}
+
 int set_nonblock_flag(pid_t pid, int fd, bool value)
 {
     int oldflags = fcntl(fd, F_GETFL, 0);
@@ -0,0 +1,147 @@
+/*
+    exec-loadgen.cpp
+
+    Author:   Serge Aleynikov
+    Created:  2026/10/18
+
+    Description:
+    ============
+
+    Synthetic child process used by the exec_bench soak scenarios.
+    It prints fixed size lines to stdout (or stderr) at a configurable
+    rate, optionally echoes every line read from stdin back to stdout,
+    and exits with a given exit code after a given lifetime.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/time.h>
+#include <string>
+
+static long long now_usec()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (long long)tv.tv_sec * 1000000ll + tv.tv_usec;
+}
+
+static int write_all(int fd, const char* p, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n; len -= n;
+    }
+    return 0;
+}
+
+void usage(char* progname) {
+    fprintf(stderr,
+        "Usage:\n"
+        "   %s [-rate N] [-size N] [-lines N] [-stderr] [-echo] [-exit N] [-lifetime Ms]\n"
+        "Options:\n"
+        "   -rate N         - Print N lines per second (default 0 - no output)\n"
+        "   -size N         - Size of every printed line including the newline (default 80)\n"
+        "   -lines N        - Stop printing after N lines (default unlimited)\n"
+        "   -stderr         - Print lines to stderr instead of stdout\n"
+        "   -echo           - Echo every line read from stdin to stdout\n"
+        "   -exit N         - Exit with status N (default 0)\n"
+        "   -lifetime Ms    - Exit after Ms milliseconds (default: when stdin is closed\n"
+        "                     with -echo, or when all lines are printed otherwise)\n"
+        "Description:\n"
+        "   Load generator used for soak testing of the exec-port program.\n",
+        progname);
+    exit(1);
+}
+
+int main(int argc, char* argv[])
+{
+    long      rate     = 0;
+    long      size     = 80;
+    long long lines    = -1;
+    long long lifetime = -1;
+    int       code     = 0;
+    int       out_fd   = STDOUT_FILENO;
+    bool      echo     = false;
+
+    for (int i = 1; i < argc; i++) {
+        bool more = i+1 < argc;
+        if      (strcmp(argv[i], "-rate")     == 0 && more) rate     = atol(argv[++i]);
+        else if (strcmp(argv[i], "-size")     == 0 && more) size     = atol(argv[++i]);
+        else if (strcmp(argv[i], "-lines")    == 0 && more) lines    = atoll(argv[++i]);
+        else if (strcmp(argv[i], "-exit")     == 0 && more) code     = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-lifetime") == 0 && more) lifetime = atoll(argv[++i]) * 1000;
+        else if (strcmp(argv[i], "-stderr")   == 0)         out_fd   = STDERR_FILENO;
+        else if (strcmp(argv[i], "-echo")     == 0)         echo     = true;
+        else usage(argv[0]);
+    }
+
+    if (size < 1) size = 1;
+
+    std::string line(size, 'x');
+    line[size-1] = '\n';
+
+    if (lifetime < 0 && !echo && (rate == 0 || lines < 0)) {
+        fprintf(stderr, "Either -lifetime, -echo or -rate with -lines must be given\r\n");
+        exit(1);
+    }
+
+    const long long start = now_usec();
+    long long printed = 0;
+    char      buf[4096];
+    std::string pending;    // Partially read stdin line
+
+    while (true) {
+        long long now = now_usec();
+
+        if (lifetime >= 0 && now - start >= lifetime)
+            break;
+
+        // Number of lines that should have been printed by now
+        if (rate > 0 && (lines < 0 || printed < lines)) {
+            long long due = (now - start) * rate / 1000000ll + 1;
+            if (lines >= 0 && due > lines) due = lines;
+            for (; printed < due; printed++)
+                if (write_all(out_fd, line.c_str(), line.size()) < 0)
+                    return code;
+        }
+
+        if (rate > 0 && printed == lines && lifetime < 0 && !echo)
+            break;
+
+        // Sleep until the next line is due, lifetime expires or stdin has data
+        long long wait = lifetime >= 0 ? lifetime - (now - start) : 1000000ll;
+        if (rate > 0 && (lines < 0 || printed < lines)) {
+            long long next = start + printed * 1000000ll / rate;
+            if (next - now < wait) wait = next - now;
+        }
+        if (wait < 0) wait = 0;
+
+        struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+        int n = poll(&pfd, echo ? 1 : 0, (int)((wait + 999) / 1000));
+
+        if (n > 0 && echo) {
+            ssize_t got = read(STDIN_FILENO, buf, sizeof(buf));
+            if (got <= 0) {
+                if (got < 0 && errno == EINTR) continue;
+                echo = false;           // stdin closed
+                if (lifetime < 0) break;
+                continue;
+            }
+            pending.append(buf, got);
+            std::string::size_type pos = pending.rfind('\n');
+            if (pos != std::string::npos) {
+                if (write_all(STDOUT_FILENO, pending.c_str(), pos+1) < 0)
+                    return code;
+                pending.erase(0, pos+1);
+            }
+        }
+    }
+
+    return code;
+}
@@ -34,7 +34,13 @@
 %%%         Option = debug | {debug, Level::integer()} |
 %%%                  verbose | {args, Args} | {alarm, Secs} |
 %%%                  {user, User} | {limit_users, Users} |
-%%%                  {portexe, Exe::string()} | {env, Env::list()}
+%%%                  {portexe, Exe::string()} | {env, Env::list()} |
+%%%                  {capture, File::string()} |
+%%%                  {max_jobs, N::integer()} | {max_load, Load::number()} |
+%%%                  {max_mem_pressure, Percent::number()} |
+%%%                  {cgroup, Dir::string()} |
+%%%                  {port_cpu_affinity, [Cpu::integer()]} |
+%%%                  subreaper
 %%%         Users  = [User]
 %%%         User   = Acount::string().
 %%%     Options passed to the exec process at startup.
@@ -57,6 +63,46 @@
 %%%         <dd>Limit execution of external commands to these set of users.
 %%%             This option is only valid when the port program is owned
 %%%             by root.</dd>
+%%%     <dt>{capture, File}</dt>
+%%%         <dd>Append every packet exchanged between Erlang and the port
+%%%             program to `File' together with its monotonic timestamp.
+%%%             The capture can be replayed against another build of the
+%%%             port program with {@link exec_replay:run/2}.</dd>
+%%%     <dt>{max_jobs, N}</dt>
+%%%         <dd>Admission control: at most `N' commands started by the port
+%%%             program run at a time.  Excess {@link run/2} requests are
+%%%             queued by the port program in the order of their `priority'
+%%%             option and started as earlier commands exit.  The caller of
+%%%             {@link run/2} waits until its command is started or its
+%%%             `queue_timeout' expires.</dd>
+%%%     <dt>{max_load, Load}</dt>
+%%%         <dd>Queue commands while the 1-minute load average of the host is
+%%%             over `Load' and some commands are running.</dd>
+%%%     <dt>{max_mem_pressure, Percent}</dt>
+%%%         <dd>(Linux only) Queue commands while some tasks spend more than
+%%%             `Percent' of time stalled on memory (the `avg10' value of
+%%%             `/proc/pressure/memory') and some commands are running.</dd>
+%%%     <dt>{cgroup, Dir}</dt>
+%%%         <dd>(Linux only) Directory of a cgroup v2 delegated to the port
+%%%             program (e.g. by systemd's `Delegate=yes'), in which the
+%%%             cgroups of commands with the `cgroup' option are created.
+%%%             The port program enables the `cpu', `memory', `io' and
+%%%             `pids' controllers available in `Dir' for its children.
+%%%             The port program itself must not run in `Dir'.  When `Dir'
+%%%             isn't usable, commands run without their cgroups.</dd>
+%%%     <dt>{port_cpu_affinity, Cpus}</dt>
+%%%         <dd>(Linux only) Run the port program on the given list of CPUs
+%%%             to keep it away from the cores of latency-critical commands.
+%%%             Commands without the `cpu_affinity' option still run on the
+%%%             CPUs the port program was started with.</dd>
+%%%     <dt>subreaper</dt>
+%%%         <dd>Run every command as with the `setsid' option, so that
+%%%             {@link stop/1}, {@link kill/2} and the `timeout' option act
+%%%             on the whole process tree of the command.  On Linux the port
+%%%             program also becomes a child subreaper (see `PR_SET_CHILD_SUBREAPER'
+%%%             in prctl(2)), so that descendants orphaned by exited commands
+%%%             are reparented to and reaped by the port program rather than
+%%%             init.</dd>
 %%%     <dt>{portexe, Exe}</dt>
 %%%         <dd>Provide an alternative location of the port program.
 %%%             This option is useful when this application is stored
@@ -74,12 +120,45 @@
 %%%                       {kill_timeout, Sec::integer()} |
 %%%                       {user, RunAsUser::string()} |
 %%%                       {nice, Priority::integer()} |
+%%%                       setsid |
+%%%                       {tags, [Tag::atom() | string()]} |
+%%%                       {cpu_affinity, [Cpu::integer()]} | {numa_node, Node::integer()} |
+%%%                       {ioprio, realtime | best_effort | idle, Level::integer()} |
+%%%                       {sched_policy, other | batch | idle} |
+%%%                       {sched_policy, fifo | rr, Priority::integer()} |
+%%%                       {perf_counters, [PerfEvent::atom()]} |
+%%%                       sync | {sync, MaxBytes::integer()} |
+%%%                       {output_rate, BytesPerSec::integer()} |
+%%%                       {max_output, Bytes::integer(), truncate | drop | kill} |
+%%%                       msg | {msg, Fd::integer()} |
+%%%                       {priority, Priority::integer()} |
+%%%                       {job_class, Class::atom(), MaxJobs::integer()} |
+%%%                       {queue_timeout, Sec::integer() | infinity} |
+%%%                       {timeout, Msec::integer()} | {cpu_limit, Sec::integer()} |
+%%%                       {cgroup, [CgroupOpt]} |
+%%%                       {restart, permanent | transient, MaxRestarts::integer(),
+%%%                                 WithinSec::integer(), BackoffMsec::integer()} |
 %%%                       stdin | stdout | stderr |
 %%%                       {stdout, Device} | {stderr, Device} |
+%%%                       {stdout, [StreamOpt]} | {stderr, [StreamOpt]} |
+%%%                       {stdout, Device, [StreamOpt]} |
+%%%                       {stderr, Device, [StreamOpt]} |
 %%%                       monitor
 %%%         Env         = [VarEqVal]
 %%%         VarEqVal    = string() | {Var::string(), Value::string()}
-%%%         Device      = null | stdout | stderr | File | {append, File} | true
+%%%         Device      = null | stdout | stderr | File | {append, File} |
+%%%                       {tail, Bytes::integer()} |
+%%%                       {tee, File | {append, File}, erlang | {tail, Bytes::integer()}} |
+%%%                       {rotate, File, [RotateOpt]} |
+%%%                       {spool, File} | {spool, File, [SpoolOpt]} | true
+%%%         RotateOpt   = {size, Bytes::integer()} | {time, Sec::integer()} |
+%%%                       {count, Files::integer()} | {buffer, Bytes::integer()}
+%%%         SpoolOpt    = {progress, Bytes::integer()} | {buffer, Bytes::integer()}
+%%%         CgroupOpt   = {name, Name::atom() | string()} |
+%%%                       {cpu_max, QuotaUsec::integer(), PeriodUsec::integer()} |
+%%%                       {cpu_weight, Weight::integer()} |
+%%%                       {memory_max, Bytes::integer()} |
+%%%                       {io_max, Limits::string()} | {pids_max, N::integer()}
 %%%         File        = string().
 %%%     Command options:
 %%%     <dl>
@@ -111,6 +190,164 @@
 %%%         <dd>Set process priority between -20 and 20. Note that
 %%%             negative values can be specified only when `exec-port'
 %%%             is started with a root suid bit set.</dd>
+%%%     <dt>setsid</dt>
+%%%         <dd>Run the process in a new session and process group of its
+%%%             own (see setsid(2)).  Signals of {@link stop/1},
+%%%             {@link kill/2} and the `timeout' option are sent to the
+%%%             whole group, and the descendants left in the group of a
+%%%             stopped process are killed with `SIGKILL' when it exits.</dd>
+%%%     <dt>{tags, Tags}</dt>
+%%%         <dd>Tag the process (e.g. by the tenant it runs for), so that
+%%%             all processes with a tag can be stopped, signaled, listed
+%%%             and accounted for with a single request to the port program
+%%%             by {@link stop_tag/1}, {@link kill_tag/2}, {@link list_tag/1}
+%%%             and {@link tag_stats/1}.  Atom and string tags of the same
+%%%             name are the same tag.</dd>
+%%%     <dt>{cpu_affinity, Cpus}</dt>
+%%%         <dd>(Linux only) Run the process only on the given list of CPUs
+%%%             (see sched_setaffinity(2)).</dd>
+%%%     <dt>{numa_node, Node}</dt>
+%%%         <dd>(Linux only) Allocate memory of the process on NUMA `Node'
+%%%             while it has free memory, and, unless `cpu_affinity' is
+%%%             given, run the process on the CPUs of the node.</dd>
+%%%     <dt>{ioprio, Class, Level}</dt>
+%%%         <dd>(Linux only) Set the I/O scheduling class (`realtime',
+%%%             `best_effort' or `idle') and priority level between 0
+%%%             (highest) and 7 of the process (see ioprio_set(2)).</dd>
+%%%     <dt>{sched_policy, Policy} | {sched_policy, Policy, Priority}</dt>
+%%%         <dd>(Linux only) Set the scheduling policy of the process to
+%%%             `other', `batch' or `idle', or to the real-time `fifo' or
+%%%             `rr' policy with a static `Priority' between 1 and 99
+%%%             (see sched(7)).  The `cpu_affinity', `numa_node', `ioprio'
+%%%             and `sched_policy' options are applied by the forked process
+%%%             before switching to the `user' and calling execve(2).
+%%%             Real-time policies and the `realtime' I/O class require
+%%%             `exec-port' to be started with a root suid bit set.  The
+%%%             process exits with status 1 when they can't be applied.</dd>
+%%%     <dt>{perf_counters, Events}</dt>
+%%%         <dd>(Linux only) Count performance events of the process and its
+%%%             descendants using perf_event_open(2). `Events' is a list of
+%%%             `cycles | instructions | cache_references | cache_misses |
+%%%             branches | branch_misses | task_clock | page_faults |
+%%%             context_switches | cpu_migrations'. Counting starts when the
+%%%             command is executed.  When the process exits, the process
+%%%             that started it receives
+%%%             `{exit_info, OsPid, [{perf_counters, [{Event, Count}]}]}'
+%%%             message ahead of its exit notification.  Events not supported
+%%%             by the hardware or not permitted by the
+%%%             `kernel.perf_event_paranoid' setting are omitted.  When
+%%%             kernel events are not permitted only the user-space portion
+%%%             of events is counted.</dd>
+%%%     <dt>sync</dt>
+%%%     <dt>{sync, MaxBytes}</dt>
+%%%         <dd>Run the command synchronously: the port program collects up
+%%%             to `MaxBytes' (default 1048576) of the process' `stdout' and
+%%%             `stderr' output (only of the streams given as `stdout' and
+%%%             `stderr' options) and {@link run/2} returns
+%%%             `{ok, Status, Stdout, Stderr}' once the process exits.
+%%%             No Erlang process is associated with the OS process, so
+%%%             the `monitor' and `link' options are ignored and output
+%%%             can't be redirected to a pid or a fun.  When the process
+%%%             produced more output than `MaxBytes' or other exit
+%%%             information is available, the return value is
+%%%             `{ok, Status, Stdout, Stderr, Info}', e.g.
+%%%             `Info = [{truncated, [{stdout, Bytes}, {stderr, Bytes}]}]'.</dd>
+%%%     <dt>{output_rate, BytesPerSec}</dt>
+%%%         <dd>Limit the rate at which the port program reads the process'
+%%%             `stdout' and `stderr' output to `BytesPerSec' (with bursts of
+%%%             up to `BytesPerSec' bytes).  While the process is over the
+%%%             rate the port program stops reading its output pipes, so a
+%%%             process writing faster blocks on a full pipe instead of
+%%%             slowing down the output of other processes.</dd>
+%%%     <dt>{max_output, Bytes, Action}</dt>
+%%%         <dd>Limit the total size of the process' `stdout' and `stderr'
+%%%             output to `Bytes'.  When the process goes over the limit the
+%%%             rest of its output is discarded and `Action' is taken:
+%%%             `truncate' - keep reading and discarding the output;
+%%%             `drop' - close the output pipes, so that the next write of
+%%%             the process fails with `EPIPE' (or `SIGPIPE');
+%%%             `kill' - stop the process like {@link stop/1}.  The number of
+%%%             discarded bytes is reported to the process that started the
+%%%             command by
+%%%             `{exit_info, OsPid, [{truncated, [{stdout, B}, {stderr, B}]}]}'
+%%%             message ahead of its exit notification.</dd>
+%%%     <dt>msg</dt>
+%%%     <dt>{msg, Fd}</dt>
+%%%         <dd>Give the process a pipe open on the file descriptor `Fd'
+%%%             (default 3) for sending messages to Erlang.  Each message is
+%%%             a 4-byte big-endian length followed by a term in the
+%%%             external term format (i.e. the result of
+%%%             `term_to_binary/1').  The port program checks that the term
+%%%             is well-formed and forwards it without re-encoding, and the
+%%%             process that started the command receives
+%%%             `{msg, OsPid, Term}'.  Pids, ports, references and funs are
+%%%             not accepted.  A malformed message closes the pipe and is
+%%%             reported by `{exit_info, OsPid, [{msg_error, Reason}]}'
+%%%             ahead of the exit notification.  A message that can't be
+%%%             decoded with `binary_to_term(Bin, [safe])' (e.g. one that
+%%%             would create new atoms) is dropped and reported by the same
+%%%             `exit_info' message.  Not supported with `sync'.</dd>
+%%%     <dt>{priority, Priority}</dt>
+%%%         <dd>Order of starting the command when it's queued by admission
+%%%             control (see the `max_jobs' option of {@link start/1}).
+%%%             Commands of higher priority start first, those of the same
+%%%             priority in the order of arrival (default 0).</dd>
+%%%     <dt>{job_class, Class, MaxJobs}</dt>
+%%%         <dd>Run at most `MaxJobs' commands of the job class `Class' at a
+%%%             time.  Commands over the limit are queued like those over
+%%%             the `max_jobs' limit.</dd>
+%%%     <dt>{queue_timeout, Sec}</dt>
+%%%         <dd>Give up on a queued command if it's not started in `Sec'
+%%%             seconds (default 25), in which case {@link run/2} returns
+%%%             `{error, queue_timeout}'.</dd>
+%%%     <dt>{timeout, Msec}</dt>
+%%%         <dd>Stop the process like {@link stop/1} if it's still running
+%%%             `Msec' milliseconds after it was started.  The exit status
+%%%             of a stopped process is that of the signal that killed it,
+%%%             and `{exit_info, OsPid, [{timeout, Msec}]}' is sent ahead
+%%%             of its exit notification (with `sync' the `Info' element
+%%%             of the return value contains `{timeout, Msec}').  The Erlang
+%%%             process associated with the OS process exits with reason
+%%%             `timeout' instead of `{exit_status, Status}'.</dd>
+%%%     <dt>{cpu_limit, Sec}</dt>
+%%%         <dd>Limit the CPU time of the process to `Sec' seconds
+%%%             (`RLIMIT_CPU').  The process gets `SIGXCPU' at the limit and
+%%%             `SIGKILL' a second later.  A process killed by the limit is
+%%%             reported like the one over its `timeout', with
+%%%             `{cpu_limit, Sec}' exit info and the `cpu_limit' exit
+%%%             reason.</dd>
+%%%     <dt>{cgroup, [CgroupOpt]}</dt>
+%%%         <dd>(Linux only) Run the process in a cgroup v2 group created by
+%%%             the port program under the directory given by the `cgroup'
+%%%             option of {@link start/1}.  By default every command gets a
+%%%             group of its own, and `{name, Name}' puts all commands with
+%%%             the same `Name' in a shared group, which is removed when the
+%%%             last of them exits.  Names starting with `cmd-' are reserved
+%%%             for the groups of their own.  The other options set the
+%%%             `cpu.max', `cpu.weight' (1..10000), `memory.max', `io.max'
+%%%             (e.g. `"8:0 rbps=1048576"') and `pids.max' limits of the
+%%%             group.  The process is started right in the group with
+%%%             `clone3(2)' where available.  The exit notification carries
+%%%             `{cgroup, [{Stat, Value}]}' exit info with the `cpu_usec',
+%%%             `user_usec', `system_usec', `memory_peak', `oom_kills' and
+%%%             `pids_peak' statistics of the group (those supported by the
+%%%             kernel).  Without a usable delegated cgroup, or for limits
+%%%             of controllers not delegated to it, the process runs without
+%%%             them.</dd>
+%%%     <dt>{restart, Policy, MaxRestarts, WithinSec, BackoffMsec}</dt>
+%%%         <dd>Restart the command by the port program when it exits
+%%%             (`Policy' is `permanent'), or when it exits with a non-zero
+%%%             status (`Policy' is `transient').  The command is restarted
+%%%             `BackoffMsec' milliseconds after it exits, and the delay is
+%%%             doubled on every restart within the last `WithinSec'
+%%%             seconds.  If the command exits more than `MaxRestarts'
+%%%             times within `WithinSec' seconds, or it's stopped by
+%%%             {@link stop/1}, its exit status is delivered as usual.  On
+%%%             every restart the process that started the command receives
+%%%             `{restarted, OsPid, NewOsPid, Status}', and the command's
+%%%             output keeps being delivered to the same destinations with
+%%%             output files appended to.  Not supported with `sync' and
+%%%             `perf_counters', as well as by pipelines, pools and dags.</dd>
 %%%     <dt>stdin</dt>
 %%%         <dd>Enable communication with an OS process via its `stdin'. The
 %%%             input to the process is sent by `exec:send(OsPid, Data)'.</dd>
@@ -122,11 +359,65 @@
 %%%         <dd>Option for redirecting process's standard output stream</dd>
 %%%     <dt>{stderr, output_device()}</dt>
 %%%         <dd>Option for redirecting process's standard error stream</dd>
+%%%     <dt>{stdout | stderr, [stream_option()]}</dt>
+%%%         <dd>Same as `{stdout | stderr, self(), StreamOpts}'.</dd>
+%%%     <dt>{stdout | stderr, output_device(), [stream_option()]}</dt>
+%%%         <dd>Redirect the stream to a pid, a function or `print'
+%%%             with the given stream options.</dd>
+%%%     </dl>
+%%% @type stream_option() = {framing, Framing} | {max_record, Bytes::integer()} |
+%%%                          {include, [Regex]} | {exclude, [Regex]} |
+%%%                          {compress, Level::integer()} |
+%%%                          {compress_flush, Bytes::integer()}
+%%%         Framing = line | {delimiter, Byte::integer()} | {packet, 1 | 2 | 4}
+%%%         Regex   = string() | binary().
+%%%     Output stream options:
+%%%     <dl>
+%%%     <dt>{framing, Framing}</dt>
+%%%         <dd>The port program splits the output into records and delivers
+%%%             batches of complete records as `{Stream, OsPid, [Record::binary()]}'
+%%%             instead of raw chunks of data.  With `line' framing the records
+%%%             are separated by `\n', with `{delimiter, Byte}' - by `Byte'.
+%%%             Delimiters are not included in the records.  With `{packet, N}'
+%%%             framing every record is preceded by its N-byte big-endian length.
+%%%             An incomplete last record is delivered when the stream is closed.</dd>
+%%%     <dt>{max_record, Bytes}</dt>
+%%%         <dd>Records longer than `Bytes' (default 16384, maximum 60000)
+%%%             are delivered in pieces of up to `Bytes' bytes.</dd>
+%%%     <dt>{include, Patterns}</dt>
+%%%         <dd>Only deliver records matching at least one of the POSIX
+%%%             extended regular expressions in the `Patterns' list.
+%%%             Filtering is done inside the port program, so the dropped
+%%%             records never reach the Erlang VM.  Unless another framing
+%%%             is given, `line' framing is used.</dd>
+%%%     <dt>{exclude, Patterns}</dt>
+%%%         <dd>Don't deliver records matching any of the `Patterns'.
+%%%             When a filtered process exits, the process that started it
+%%%             receives `{exit_info, OsPid, [{dropped, [{Stream, Records, Bytes}]}]}'
+%%%             with the number of records and bytes that were filtered out.</dd>
+%%%     <dt>{compress, Level}</dt>
+%%%         <dd>Compress the output with zlib at the given `Level' (0..9)
+%%%             inside the port program (if it was built with zlib).  The
+%%%             binaries delivered in `{Stream, OsPid, Data}' messages form a
+%%%             single zlib stream that can be forwarded as is or decompressed
+%%%             incrementally with `zlib:inflate/2' using a context opened by
+%%%             `zlib:inflateInit/1'.  Every message ends on a sync-flush
+%%%             boundary, so its data can be decompressed as soon as it
+%%%             arrives.  The stream is finished when the process closes
+%%%             its output.  Can't be combined with framing or filters.</dd>
+%%%     <dt>{compress_flush, Bytes}</dt>
+%%%         <dd>Send compressed output after every `Bytes' (default 65536)
+%%%             of input.  Output is also sent when no more data arrives
+%%%             within a second.</dd>
 %%%     </dl>
 %%% @type output_device() = null | close | stdout | stderr | print | pid() |
-%%%         OutputFun | Filename | {append, Filename}
+%%%         OutputFun | Filename | {append, Filename} | {tail, Bytes} |
+%%%         {tee, Filename | {append, Filename}, erlang | {tail, Bytes}} |
+%%%         {rotate, Filename, [RotateOpt]} | {spool, Filename} |
+%%%         {spool, Filename, [SpoolOpt]}
 %%%         OutputFun = fun((stdout | stderr, integer(), binary()) -> none())
-%%%         Filename  = string().
+%%%         Filename  = string()
+%%%         Bytes     = integer().
 %%%     Output device option:
 %%%     <dl>
 %%%     <dt>null</dt><dd>Suppress output.</dd>
@@ -141,6 +432,48 @@
 %%%             console shell</dd>
 %%%     <dt>Filename</dt><dd>Save output to file by overwriting it.</dd>
 %%%     <dt>{append, Filename}</dt><dd>Append output to file.</dd>
+%%%     <dt>{tail, Bytes}</dt>
+%%%         <dd>Keep only the last `Bytes' (at most 1048576) bytes of output
+%%%             in a ring buffer inside the port program instead of delivering
+%%%             it.  When the process exits, the process that started it
+%%%             receives `{exit_info, OsPid, [{stdout_tail | stderr_tail, Data}]}'
+%%%             just before the exit notification.</dd>
+%%%     <dt>{tee, Filename | {append, Filename}, Sink}</dt>
+%%%         <dd>Write output to the file and also deliver it to `Sink', which
+%%%             is either `erlang' (send `{stdout | stderr, OsPid, Data}'
+%%%             messages to the caller) or `{tail, Bytes}' (keep only the
+%%%             last bytes as with the `{tail, Bytes}' device).  On Linux
+%%%             the port program moves data to the file with tee(2) and
+%%%             splice(2) without copying it through user space (files
+%%%             opened for appending fall back to regular writes).</dd>
+%%%     <dt>{rotate, Filename, [RotateOpt]}</dt>
+%%%         <dd>The process writes output to a pipe and the port program
+%%%             appends it to `Filename' with buffered writes, so the file
+%%%             can be rotated without involving the process:
+%%%             <dl>
+%%%             <dt>{size, Bytes}</dt><dd>Rotate the file before it grows over
+%%%                 `Bytes' (default 10485760, 0 - don't rotate by size)</dd>
+%%%             <dt>{time, Sec}</dt><dd>Rotate the file `Sec' seconds after
+%%%                 it was opened (default 0 - don't rotate by time)</dd>
+%%%             <dt>{count, N}</dt><dd>Number of rotated files
+%%%                 `Filename.1' (newest) ... `Filename.N' to keep (default 5)</dd>
+%%%             <dt>{buffer, Bytes}</dt><dd>Size of the write buffer (default
+%%%                 65536).  Buffered output is written to the file at least
+%%%                 once a second.</dd>
+%%%             </dl></dd>
+%%%     <dt>{spool, Filename, [SpoolOpt]}</dt>
+%%%         <dd>The port program writes output to `Filename' (truncating it)
+%%%             in page-aligned blocks and the data never enters the Erlang VM.
+%%%             Instead the process that started the command receives
+%%%             `{spooled, OsPid, Filename, Bytes}' messages with the number
+%%%             of bytes written to the file at most once a second while it
+%%%             grows, and a final one when the OS process exits:
+%%%             <dl>
+%%%             <dt>{progress, Bytes}</dt><dd>Also report every time another
+%%%                 `Bytes' are written (default 0 - only report periodically)</dd>
+%%%             <dt>{buffer, Bytes}</dt><dd>Size of the write buffer (default
+%%%                 1048576)</dd>
+%%%             </dl></dd>
 %%%     </dl>
 %%% @end
 %%%------------------------------------------------------------------------
@@ -154,8 +487,10 @@
 
 %% External exports
 -export([
-    start/1, start_link/1, run/2, run_link/2, manage/2, send/2,
-    which_children/0, kill/2, stop/1, ospid/1, pid/1, status/1, signal/1
+    start/1, start_link/1, run/2, run_link/2, pipeline/2, manage/2, send/2,
+    which_children/0, kill/2, stop/1, ospid/1, pid/1, status/1, signal/1,
+    start_pool/4, call/2, call/3, stop_pool/1, dag/3, stop_dag/1,
+    stop_tag/1, kill_tag/2, list_tag/1, tag_stats/1
 ]).
 
 %% Internal exports
@@ -170,7 +505,7 @@
 -record(state, {
     port,
     last_trans  = 0,            % Last transaction number sent to port
-    trans       = queue:new(),  % Queue of outstanding transactions sent to port
+    trans       = gb_trees:empty(), % Outstanding transactions sent to port by number
     limit_users = [],           % Restricted list of users allowed to run commands
     registry,                   % Pids to notify when an OsPid exits
     debug       = false
@@ -186,7 +521,14 @@
     | {user, string()}
     | {limit_users, [string(), ...]}
     | {portexe, string()}
-    | {env, [{string(), string()}, ...]}.
+    | {env, [{string(), string()}, ...]}
+    | {capture, string()}
+    | {max_jobs, pos_integer()}
+    | {max_load, number()}
+    | {max_mem_pressure, number()}
+    | {cgroup, string()}
+    | {port_cpu_affinity, [non_neg_integer(), ...]}
+    | subreaper.
 
 -type cmd_options() :: [cmd_option()].
 -type cmd_option()  ::
@@ -196,15 +538,56 @@
     | {kill, non_neg_integer()}
     | {user, string()}
     | {nice, integer()}
+    | setsid
+    | {tags, [atom() | string(), ...]}
+    | {cpu_affinity, [non_neg_integer(), ...]}
+    | {numa_node, non_neg_integer()}
+    | {ioprio, realtime | best_effort | idle, 0..7}
+    | {sched_policy, other | batch | idle}
+    | {sched_policy, fifo | rr, 1..99}
+    | {perf_counters, [perf_event()]}
+    | sync   | {sync, pos_integer()}
+    | {output_rate, pos_integer()}
+    | {max_output, pos_integer(), truncate | drop | kill}
+    | msg    | {msg, pos_integer()}
+    | {priority, integer()}
+    | {job_class, atom(), pos_integer()}
+    | {queue_timeout, pos_integer() | infinity}
+    | {timeout, pos_integer()}
+    | {cpu_limit, pos_integer()}
+    | {cgroup, [{name, atom() | string()} | {cpu_max, pos_integer(), pos_integer()} |
+                {cpu_weight | memory_max | pids_max, pos_integer()} | {io_max, string()}]}
+    | {restart, permanent | transient, pos_integer(), pos_integer(), non_neg_integer()}
     | stdin  | {stdin,  null | close | string() | true}
     | stdout
     | {stdout, null | close | stdout | stderr | print |
                fun((stdout, integer(), binary()) -> none()) | pid() |
-               string() | {append, string()}}
+               string() | {append, string()} | {tail, pos_integer()} |
+               {tee, string() | {append, string()}, erlang | {tail, pos_integer()}} |
+               {rotate, string(), [{size | time | count | buffer, non_neg_integer()}]} |
+               {spool, string()} | {spool, string(), [{progress | buffer, non_neg_integer()}]}}
     | stderr
     | {stderr, null | close | stdout | stderr | print |
                fun((stderr, integer(), binary()) -> none()) | pid() |
-               string() | {append, string()}}.
+               string() | {append, string()} | {tail, pos_integer()} |
+               {tee, string() | {append, string()}, erlang | {tail, pos_integer()}} |
+               {rotate, string(), [{size | time | count | buffer, non_neg_integer()}]} |
+               {spool, string()} | {spool, string(), [{progress | buffer, non_neg_integer()}]}}
+    | {stdout | stderr, [stream_option(), ...]}
+    | {stdout | stderr, print | pid() |
+               fun((stdout | stderr, integer(), [binary()]) -> none()),
+               [stream_option(), ...]}.
+
+-type stream_option() ::
+      {framing, line | {delimiter, byte()} | {packet, 1 | 2 | 4}}
+    | {max_record, pos_integer()}
+    | {include | exclude, [string() | binary()]}
+    | {compress, 0..9}
+    | {compress_flush, pos_integer()}.
+
+-type perf_event() ::
+      cycles | instructions | cache_references | cache_misses | branches
+    | branch_misses | task_clock | page_faults | context_switches | cpu_migrations.
 
 -type ospid() :: integer().
 %% Representation of OS process ID.
@@ -228,11 +611,15 @@ start(Options) when is_list(Options) ->
 
 %%-------------------------------------------------------------------------
 %% @doc Run an external program. `OsPid' is the OS process identifier of
-%%      the new process.
+%%      the new process.  With the `sync' option the call returns when
+%%      the program exits with its exit status and collected output.
 %% @end
 %%-------------------------------------------------------------------------
 -spec run(Exe::string(), Options::cmd_options()) ->
-    {ok, pid(), ospid()} | {error, any()}.
+    {ok, pid(), ospid()} |
+    {ok, Status::integer(), Stdout::binary(), Stderr::binary()} |
+    {ok, Status::integer(), Stdout::binary(), Stderr::binary(), Info::list()} |
+    {error, any()}.
 run(Exe, Options) when is_list(Exe), is_list(Options) ->
     do_run({run, Exe, Options}, Options).
 
@@ -248,6 +635,28 @@ run(Exe, Options) when is_list(Exe), is_list(Options) ->
 run_link(Exe, Options) when is_list(Exe), is_list(Options) ->
     do_run({run, Exe, Options}, [link | Options]).
 
+%%-------------------------------------------------------------------------
+%% @doc Run a pipeline of external programs, where `stdout' of every
+%%      command is connected to `stdin' of the next one by a pipe, like
+%%      `"Cmd1 | Cmd2 | ..."' in a shell but without the shell.  The
+%%      returned `OsPid' is that of the last command, and it stands for
+%%      the whole pipeline: {@link stop/1}, {@link kill/2} and the `link'
+%%      option apply to every command.  `stdin' options apply to the first
+%%      command, `stdout' options to the last one, and `stderr' of all
+%%      commands is merged.  The exit notification is sent when all
+%%      commands have exited, with the exit status of the last one and
+%%      `{stages, [{OsPid, Status}]}' exit info of every command in the
+%%      pipeline order.  The `msg' and `perf_counters' options are not
+%%      supported.
+%% @end
+%%-------------------------------------------------------------------------
+-spec pipeline(Cmds::[string(), ...], Options::cmd_options()) ->
+    {ok, pid(), ospid()} |
+    {ok, Status::integer(), Stdout::binary(), Stderr::binary(), Info::list()} |
+    {error, any()}.
+pipeline([_|_] = Cmds, Options) when is_list(Options) ->
+    do_run({pipeline, Cmds, Options}, Options).
+
 -spec do_run(Cmd::any(), Options::cmd_options()) ->
     {ok, pid(), ospid()} | {error, any()}.
 do_run(Cmd, Options) ->
@@ -257,7 +666,15 @@ do_run(Cmd, Options) ->
           _    -> nolink
           end,
     Cmd2 = {port, {Cmd, Link}},
-    case {Mon, gen_server:call(?MODULE, Cmd2, 30000)} of
+    % A sync command replies when the OS process exits, and a command
+    % queued by admission control when it's started
+    Timeout = case {proplists:get_value(sync, Options),
+                    proplists:get_value(queue_timeout, Options)} of
+              {undefined, undefined} -> 30000;
+              {undefined, I} when is_integer(I) -> I*1000 + 30000;
+              _                      -> infinity
+              end,
+    case {Mon, gen_server:call(?MODULE, Cmd2, Timeout)} of
     {true, {ok, Pid, _} = R} ->
         monitor(process, Pid),
         R;
@@ -337,6 +754,126 @@ pid(OsPid) when is_integer(OsPid) ->
 send(OsPid, Data) when (is_integer(OsPid) orelse is_pid(OsPid)) andalso is_binary(Data) ->
     gen_server:call(?MODULE, {port, {send, OsPid, Data}}).
 
+%%-------------------------------------------------------------------------
+%% @doc Start a pool of `Size' long-running workers running `Cmd', which
+%%      serve requests of call/2.  A worker reads a request from stdin as
+%%      `<<Len:32, Request/binary>>' and writes its response to stdout in
+%%      the same format.  A worker that exits fails its current request
+%%      with `{error, worker_exited}' and is restarted.  Only `cd', `env',
+%%      `kill', `kill_timeout', `user', `group', `nice', `cpu_affinity',
+%%      `numa_node', `ioprio', `sched_policy', `setsid' and `tags' options
+%%      are supported.
+%% @end
+%%-------------------------------------------------------------------------
+-spec start_pool(Name::atom(), Cmd::string(), Size::pos_integer(),
+                 Options::cmd_options()) -> ok | {error, any()}.
+start_pool(Name, Cmd, Size, Options)
+  when is_atom(Name), is_list(Cmd), is_integer(Size), Size > 0, is_list(Options) ->
+    gen_server:call(?MODULE, {port, {pool, Name, Size, Cmd, Options}}, 30000).
+
+%%-------------------------------------------------------------------------
+%% @equiv call(Pool, Request, 30000)
+%% @end
+%%-------------------------------------------------------------------------
+-spec call(Pool::atom(), Request::binary()) -> {ok, binary()} | {error, any()}.
+call(Pool, Request) ->
+    call(Pool, Request, 30000).
+
+%%-------------------------------------------------------------------------
+%% @doc Send a `Request' to an idle worker of the `Pool' started with
+%%      start_pool/4 and return its response.  Requests are queued while
+%%      all workers are busy.
+%% @end
+%%-------------------------------------------------------------------------
+-spec call(Pool::atom(), Request::binary(), Timeout::timeout()) ->
+    {ok, binary()} | {error, any()}.
+call(Pool, Request, Timeout) when is_atom(Pool), is_binary(Request) ->
+    gen_server:call(?MODULE, {port, {call, Pool, Request}}, Timeout).
+
+%%-------------------------------------------------------------------------
+%% @doc Stop workers of the `Pool'.  Pending requests fail with
+%%      `{error, pool_stopped}'.
+%% @end
+%%-------------------------------------------------------------------------
+-spec stop_pool(Pool::atom()) -> ok | {error, any()}.
+stop_pool(Pool) when is_atom(Pool) ->
+    gen_server:call(?MODULE, {port, {stop_pool, Pool}}, 30000).
+
+%%-------------------------------------------------------------------------
+%% @doc Run a graph of commands with dependencies.  `Nodes' is a list of
+%%      `{NodeId, Cmd, Options}' and `Edges' is a list of `{From, To}'
+%%      meaning that node `To' starts after node `From' exits with status
+%%      0.  Commands whose predecessors have exited are started by the
+%%      port program without a round trip to Erlang, at most `N' at a
+%%      time with the `{max_parallel, N}' option.  When a command fails,
+%%      all of its dependants are cancelled.  The calling process receives
+%%      outcomes of the nodes in batches as
+%%      `{dag, DagId, [{NodeId, {exit_status, Status} | cancelled |
+%%      {error, Reason}}]}' followed by `{dag_done, DagId, ok | failed}'.
+%%      Output, messages and exit info of the commands can't be sent to
+%%      Erlang, so the `sync', `msg', `restart', `perf_counters',
+%%      `timeout', `cpu_limit' and `max_output' options and the `tail'
+%%      and `spool' redirects of `stdout' and `stderr' are not supported.
+%% @end
+%%-------------------------------------------------------------------------
+-spec dag(Nodes::[{NodeId::term(), Cmd::string(), Options::cmd_options()}],
+          Edges::[{From::term(), To::term()}],
+          Options::[{max_parallel, pos_integer()}]) ->
+    {ok, DagId::integer()} | {error, any()}.
+dag(Nodes, Edges, Options) when is_list(Nodes), is_list(Edges), is_list(Options) ->
+    gen_server:call(?MODULE, {port, {dag, Nodes, Edges, Options}}, 30000).
+
+%%-------------------------------------------------------------------------
+%% @doc Stop running commands of the graph started by dag/3 and cancel
+%%      the commands that haven't started yet.
+%% @end
+%%-------------------------------------------------------------------------
+-spec stop_dag(DagId::integer()) -> ok | {error, any()}.
+stop_dag(DagId) when is_integer(DagId) ->
+    gen_server:call(?MODULE, {port, {stop_dag, DagId}}, 30000).
+
+%%-------------------------------------------------------------------------
+%% @doc Stop all OS processes started with the `Tag' in their `tags'
+%%      option as stop/1 does, including the ones waiting for a restart.
+%%      Returns the number of processes being stopped.
+%% @end
+%%-------------------------------------------------------------------------
+-spec stop_tag(Tag::atom() | string()) -> {ok, Count::integer()} | {error, any()}.
+stop_tag(Tag) when is_atom(Tag); is_list(Tag) ->
+    gen_server:call(?MODULE, {port, {stop_tag, Tag}}, 30000).
+
+%%-------------------------------------------------------------------------
+%% @doc Send a `Signal' to all OS processes started with the `Tag' in
+%%      their `tags' option.  Returns the number of signaled processes.
+%% @end
+%%-------------------------------------------------------------------------
+-spec kill_tag(Tag::atom() | string(), Signal::integer()) ->
+    {ok, Count::integer()} | {error, any()}.
+kill_tag(Tag, Signal) when (is_atom(Tag) orelse is_list(Tag)), is_integer(Signal) ->
+    gen_server:call(?MODULE, {port, {kill_tag, Tag, Signal}}).
+
+%%-------------------------------------------------------------------------
+%% @doc Get a list of running OS processes started with the `Tag' in their
+%%      `tags' option.
+%% @end
+%%-------------------------------------------------------------------------
+-spec list_tag(Tag::atom() | string()) -> [ospid()] | {error, any()}.
+list_tag(Tag) when is_atom(Tag); is_list(Tag) ->
+    gen_server:call(?MODULE, {port, {list_tag, Tag}}).
+
+%%-------------------------------------------------------------------------
+%% @doc Get the number of running OS processes started with the `Tag' in
+%%      their `tags' option together with their total CPU time in
+%%      microseconds (including their waited-for children) and resident
+%%      memory in bytes.  The `cpu_usec' and `rss' values are only
+%%      reported on Linux.
+%% @end
+%%-------------------------------------------------------------------------
+-spec tag_stats(Tag::atom() | string()) ->
+    {ok, [{count | cpu_usec | rss, non_neg_integer()}]} | {error, any()}.
+tag_stats(Tag) when is_atom(Tag); is_list(Tag) ->
+    gen_server:call(?MODULE, {port, {tag_stats, Tag}}).
+
 %%-------------------------------------------------------------------------
 %% @doc Decode the program's exit_status.  If the program exited by signal
 %%      the function returns `{signal, Signal, Core}' where the `Signal'
@@ -410,6 +947,7 @@ default() ->
      {alarm, 12},
      {user, ""},        % Run port program as this user
      {limit_users, []}, % Restricted list of users allowed to run commands
+     {capture, ""},     % Record port protocol traffic to this file
      {portexe, default(portexe)}].
 
 %% @private
@@ -435,16 +973,26 @@ default(Option) ->
 init([Options]) ->
     process_flag(trap_exit, true),
     Opts0 = proplists:normalize(Options,
-                    [{expand, [{debug,   {debug, 1}},
-                               {verbose, {verbose, true}}]}]),
-    Opts1 = [T || T = {O,_} <- Opts0, 
-                lists:member(O, [debug, verbose, args, alarm, user])],
+                    [{expand, [{debug,     {debug, 1}},
+                               {verbose,   {verbose, true}},
+                               {subreaper, {subreaper, true}}]}]),
+    Opts1 = [case T of
+             {port_cpu_affinity, L} -> {port_cpu_affinity, cpu_list(L)};
+             _                      -> T
+             end || T = {O,_} <- Opts0,
+                lists:member(O, [debug, verbose, args, alarm, user, capture,
+                                 max_jobs, max_load, max_mem_pressure, cgroup,
+                                 port_cpu_affinity, subreaper])],
     Opts  = proplists:normalize(Opts1, [{aliases, [{args, ''}]}]),
     Args  = lists:foldl(
         fun({Opt, I}, Acc) when is_list(I), I =/= ""   ->
                 [" -"++atom_to_list(Opt)++" "++I | Acc];
            ({Opt, I}, Acc) when is_integer(I) ->
                 [" -"++atom_to_list(Opt)++" "++integer_to_list(I) | Acc];
+           ({Opt, F}, Acc) when is_float(F) ->
+                [" -"++atom_to_list(Opt)++" "++?FMT("~w", [F]) | Acc];
+           ({subreaper, true}, Acc) ->
+                [" -subreaper" | Acc];
            (_, Acc) -> Acc
         end, [], Opts),
     Exe   = proplists:get_value(portexe,     Options, default(portexe)) ++ lists:flatten([" -n"|Args]),
@@ -456,7 +1004,7 @@ init([Options]) ->
             end,
     try
         debug(Debug, "exec: port program: ~s\n env: ~p\n", [Exe, Env]),
-        PortOpts = Env ++ [binary, exit_status, {packet, 2}, nouse_stdio, hide],
+        PortOpts = Env ++ [binary, exit_status, {packet, 4}, nouse_stdio, hide],
         Port = erlang:open_port({spawn, Exe}, PortOpts),
         Tab  = ets:new(exec_mon, [protected,named_table]),
         {ok, #state{port=Port, limit_users=Users, debug=Debug, registry=Tab}}
@@ -482,7 +1030,8 @@ handle_call({port, Instruction}, From, #state{last_trans=Last} = State) ->
     {ok, Term, Link, PidOpts} ->
         Next = next_trans(Last),
         erlang:port_command(State#state.port, term_to_binary({Next, Term})),
-        {noreply, State#state{trans = queue:in({Next, From, Link, PidOpts}, State#state.trans)}}
+        Trans = gb_trees:enter(Next, {From, Link, PidOpts}, State#state.trans),
+        {noreply, State#state{last_trans = Next, trans = Trans}}
     catch _:{error, Why} ->
         {reply, {error, Why}, State}
     end;
@@ -518,22 +1067,65 @@ handle_info({Port, {data, Bin}}, #state{port=Port, debug=Debug} = State) ->
     debug(Debug, "~w got msg from port: ~p\n", [?MODULE, Msg]),
     case Msg of
     {N, Reply} when N =/= 0 ->
-        case get_transaction(State#state.trans, N) of
-        {true, {Pid,_} = From, MonType, PidOpts, Q} ->
+        % Replies of sync runs, pool calls and queued runs come after the
+        % ones of later requests, so transactions are matched by number
+        case gb_trees:lookup(N, State#state.trans) of
+        {value, {{Pid,_} = From, MonType, PidOpts}} ->
             NewReply = maybe_add_monitor(Reply, Pid, MonType, PidOpts, Debug),
-            gen_server:reply(From, NewReply);
-        {false, Q} ->
-            ok
-        end,
-        {noreply, State#state{trans=Q}};
+            gen_server:reply(From, NewReply),
+            {noreply, State#state{trans = gb_trees:delete(N, State#state.trans)}};
+        none ->
+            {noreply, State}
+        end;
     {0, {Stream, OsPid, Data}} when Stream =:= stdout; Stream =:= stderr ->
         send_to_ospid_owner(OsPid, {Stream, Data}),
         {noreply, State};
+    {0, {spooled, OsPid, File, Bytes}} ->
+        send_to_ospid_owner(OsPid, {spooled, File, Bytes}),
+        {noreply, State};
+    {0, {msg, OsPid, Bin}} ->
+        % The term comes from the child, so it must not create atoms or
+        % crash this server
+        try binary_to_term(Bin, [safe]) of
+        Term -> send_to_ospid_owner(OsPid, {msg, Term})
+        catch _:_ ->
+            send_to_ospid_owner(OsPid, {exit_info, [{msg_error, "invalid message term"}]})
+        end,
+        {noreply, State};
+    {0, {dag, Id, Events}} ->
+        send_to_ospid_owner({dag, Id}, {dag, Id, Events}),
+        {noreply, State};
+    {0, {dag_done, Id, Result}} ->
+        send_to_ospid_owner({dag, Id}, {dag_done, Id, Result}),
+        ets:delete(exec_mon, {dag, Id}),
+        {noreply, State};
+    {0, {restarted, OsPid, NewOsPid, Status}} ->
+        debug(Debug, "Pid ~w exited with status ~w and was restarted as ~w\n",
+            [OsPid, Status, NewOsPid]),
+        case ets:lookup(exec_mon, OsPid) of
+        [{_, LWP}] ->
+            ets:delete(exec_mon, OsPid),
+            ets:insert(exec_mon, [{NewOsPid, LWP}, {LWP, NewOsPid}]),
+            LWP ! {restarted, NewOsPid, Status};
+        [] ->
+            ok
+        end,
+        {noreply, State};
     {0, {exit_status, OsPid, Status}} ->
         debug(Debug, "Pid ~w exited with status: ~s{~w,~w}\n",
             [OsPid, if (((Status band 16#7F)+1) bsr 1) > 0 -> "signaled "; true -> "" end,
              (Status band 16#FF00 bsr 8), Status band 127]),
-        notify_ospid_owner(OsPid, Status),
+        notify_ospid_owner(OsPid, {exit_status, Status}),
+        {noreply, State};
+    {0, {exit_status, OsPid, Status, Info}} ->
+        debug(Debug, "Pid ~w exited with status: ~w ~p\n", [OsPid, Status, Info]),
+        send_to_ospid_owner(OsPid, {exit_info, Info}),
+        % A process stopped by its time limits exits with a distinct reason
+        Reason = case [R || {R, _} <- Info, R =:= timeout orelse R =:= cpu_limit] of
+                 [R|_] -> R;
+                 []    -> {exit_status, Status}
+                 end,
+        notify_ospid_owner(OsPid, Reason),
         {noreply, State};
     {0, Ignore} ->
         error_logger:warning_msg("~w [~w] unknown msg: ~p\n", [self(), ?MODULE, Ignore]),
@@ -600,6 +1192,10 @@ maybe_add_monitor({ok, OsPid}, Pid, MonType, PidOpts, Debug) when is_integer(OsP
     LWP  = spawn_link(fun() -> ospid_init(Pid, OsPid, MonType, Self, PidOpts, Debug) end),
     ets:insert(exec_mon, [{OsPid, LWP}, {LWP, OsPid}]),
     {ok, LWP, OsPid};
+maybe_add_monitor({ok, {dag, Id}}, Pid, _MonType, _PidOpts, _Debug) ->
+    % Outcomes of the graph's nodes are sent to the process that started it
+    ets:insert(exec_mon, {{dag, Id}, Pid}),
+    {ok, Id};
 maybe_add_monitor(Reply, _Pid, _MonType, _PidOpts, _Debug) ->
     Reply.
 
@@ -629,12 +1225,24 @@ ospid_loop({Pid, OsPid, Parent, StdOut, StdErr, Debug} = State) ->
     {{From, Ref}, ospid} ->
         From ! {Ref, OsPid},
         ospid_loop(State);
-    {stdout, Data} when is_binary(Data) ->
+    {stdout, Data} when is_binary(Data); is_list(Data) ->
         ospid_deliver_output(StdOut, {stdout, OsPid, Data}),
         ospid_loop(State);
-    {stderr, Data} when is_binary(Data) ->
+    {stderr, Data} when is_binary(Data); is_list(Data) ->
         ospid_deliver_output(StdErr, {stderr, OsPid, Data}),
         ospid_loop(State);
+    {exit_info, Info} ->
+        Pid ! {exit_info, OsPid, Info},
+        ospid_loop(State);
+    {spooled, File, Bytes} ->
+        Pid ! {spooled, OsPid, File, Bytes},
+        ospid_loop(State);
+    {msg, Term} ->
+        Pid ! {msg, OsPid, Term},
+        ospid_loop(State);
+    {restarted, NewOsPid, Status} ->
+        Pid ! {restarted, OsPid, NewOsPid, Status},
+        ospid_loop({Pid, NewOsPid, Parent, StdOut, StdErr, Debug});
     {'DOWN', OsPid, {exit_status, Status}} ->
         debug(Debug, "~w ~w got down message (~w)\n", [self(), OsPid, status(Status)]),
         % OS process died
@@ -642,6 +1250,10 @@ ospid_loop({Pid, OsPid, Parent, StdOut, StdErr, Debug} = State) ->
         0 -> exit(normal);
         _ -> exit({exit_status, Status})
         end;
+    {'DOWN', OsPid, Reason} ->
+        % OS process was stopped by its timeout or cpu_limit
+        debug(Debug, "~w ~w got down message (~w)\n", [self(), OsPid, Reason]),
+        exit(Reason);
     {'EXIT', Pid, Reason} ->
         % Pid died
         debug(Debug, "~w ~w got exit from linked ~w: ~p\n", [self(), OsPid, Pid, Reason]),
@@ -660,12 +1272,12 @@ ospid_deliver_output(DestPid, Msg) when is_pid(DestPid) ->
 ospid_deliver_output(DestFun, {Stream, OsPid, Data}) when is_function(DestFun) ->
     DestFun(Stream, OsPid, Data).
 
-notify_ospid_owner(OsPid, Status) ->
+notify_ospid_owner(OsPid, Reason) ->
     % See if there is a Pid owner of this OsPid. If so, sent the 'DOWN' message.
     case ets:lookup(exec_mon, OsPid) of
     [{_OsPid, Pid}] ->
         unlink(Pid),
-        Pid ! {'DOWN', OsPid, {exit_status, Status}},
+        Pid ! {'DOWN', OsPid, Reason},
         ets:delete(exec_mon, {Pid, OsPid}),
         ets:delete(exec_mon, {OsPid, Pid});
     [] ->
@@ -702,21 +1314,46 @@ do_unlink_ospid(Pid, _Reason, State) ->
         ok 
     end.
 
-get_transaction(Q, I) -> 
-    get_transaction(Q, I, Q).
-get_transaction(Q, I, OldQ) ->
-    case queue:out(Q) of
-    {{value, {I, From, LinkType, PidOpts}}, Q2} ->
-        {true, From, LinkType, PidOpts, Q2};
-    {empty, _} ->
-        {false, OldQ};
-    {_, Q2} ->
-        get_transaction(Q2, I, OldQ)
-    end.
-    
-is_port_command({{run, Cmd, Options}, Link}, Pid, State) ->
+is_port_command({{Run, Cmd, Options}, Link}, Pid, State) when Run =:= run; Run =:= pipeline ->
+    {PortOpts, Other} = check_cmd_options(Options, Pid, State, [], []),
+    case proplists:get_value(sync, PortOpts) of
+    undefined ->
+        {ok, {Run, Cmd, PortOpts}, Link, Other};
+    _ ->
+        % Output of a sync command is collected by the port program
+        % and returned in the reply to the caller
+        [throw({error, ?FMT("Option ~p is not supported with sync", [O])})
+            || {Std, Dev} = O <- Other, Std =:= stdin orelse Dev =/= Pid],
+        [throw({error, ?FMT("Option ~p is not supported with sync", [O])})
+            || {Std, [T1|_]} = O <- PortOpts, Std =:= stdout orelse Std =:= stderr,
+               is_tuple(T1)],
+        [throw({error, ?FMT("Option ~p is not supported with sync", [O])})
+            || O <- PortOpts, O =:= msg orelse is_tuple(O) andalso element(1, O) =:= msg],
+        {ok, {Run, Cmd, PortOpts}, nolink, []}
+    end;
+is_port_command({pool, Name, Size, Cmd, Options}, Pid, State) ->
     {PortOpts, Other} = check_cmd_options(Options, Pid, State, [], []),
-    {ok, {run, Cmd, PortOpts}, Link, Other};
+    [throw({error, ?FMT("Option ~p is not supported by pools", [O])})
+        || O <- PortOpts ++ Other, O =/= setsid,
+           not is_tuple(O) orelse
+           not lists:member(element(1, O), [cd, env, kill, kill_timeout, user, group, nice,
+                                            cpu_affinity, numa_node, ioprio, sched_policy,
+                                            tags])],
+    {ok, {pool, Name, Size, Cmd, PortOpts}, undefined, []};
+is_port_command({call, Pool, Request} = T, _Pid, _State) when is_atom(Pool), is_binary(Request) ->
+    {ok, T, undefined, []};
+is_port_command({stop_pool, Pool} = T, _Pid, _State) when is_atom(Pool) ->
+    {ok, T, undefined, []};
+is_port_command({dag, Nodes, Edges, Options}, Pid, State) ->
+    Nodes2 = [check_dag_node(N, Pid, State) || N <- Nodes],
+    {ok, {dag, Nodes2, Edges, Options}, undefined, []};
+is_port_command({stop_dag, Id} = T, _Pid, _State) when is_integer(Id) ->
+    {ok, T, undefined, []};
+is_port_command({Op, Tag}, _Pid, _State)
+        when Op =:= stop_tag; Op =:= list_tag; Op =:= tag_stats ->
+    {ok, {Op, tag_name(Tag)}, undefined, []};
+is_port_command({kill_tag, Tag, Sig}, _Pid, _State) when is_integer(Sig) ->
+    {ok, {kill_tag, tag_name(Tag), Sig}, undefined, []};
 is_port_command({list} = T, _Pid, _State) -> 
     {ok, T, undefined, []};
 is_port_command({stop, OsPid}=T, _Pid, _State) when is_integer(OsPid) -> 
@@ -744,6 +1381,34 @@ is_port_command({kill, Pid, Sig}, _Pid, _State) when is_pid(Pid),is_integer(Sig)
     []              -> throw({error, no_process})
     end.
 
+check_dag_node({Id, Cmd, Options}, Pid, State) when is_list(Cmd), is_list(Options) ->
+    case check_cmd_options(Options, Pid, State, [], []) of
+    {PortOpts, []} ->
+        [throw({error, ?FMT("Option ~p is not supported by dag nodes", [O])})
+            || O <- PortOpts, not is_dag_node_option(O)],
+        {Id, Cmd, PortOpts};
+    {_, Other} ->
+        throw({error, ?FMT("Options ~p are not supported by dag nodes", [Other])})
+    end;
+check_dag_node(Node, _Pid, _State) ->
+    throw({error, ?FMT("Invalid dag node ~p: expected {NodeId, Cmd, Options}", [Node])}).
+
+%% Options whose results are delivered as exit info or messages of the
+%% OsPid, which dag nodes don't have an owner of, are not supported
+is_dag_node_option(O) when O =:= sync; O =:= msg ->
+    false;
+is_dag_node_option({Std, {tail, _}}) when Std =:= stdout; Std =:= stderr ->
+    false;
+is_dag_node_option({Std, {tee, _, {tail, _}}}) when Std =:= stdout; Std =:= stderr ->
+    false;
+is_dag_node_option({Std, {spool, _, _}}) when Std =:= stdout; Std =:= stderr ->
+    false;
+is_dag_node_option(O) when is_tuple(O) ->
+    not lists:member(element(1, O), [sync, msg, restart, perf_counters, timeout,
+                                     cpu_limit, max_output]);
+is_dag_node_option(_) ->
+    true.
+
 check_cmd_options([monitor|T], Pid, State, PortOpts, OtherOpts) ->
     check_cmd_options(T, Pid, State, PortOpts, OtherOpts);
 check_cmd_options([link|T], Pid, State, PortOpts, OtherOpts) ->
@@ -764,17 +1429,133 @@ check_cmd_options([{kill_timeout, I}=H|T], Pid, State, PortOpts, OtherOpts) when
     check_cmd_options(T, Pid, State, [H|PortOpts], OtherOpts);
 check_cmd_options([{nice, I}=H|T], Pid, State, PortOpts, OtherOpts) when is_integer(I), I >= -20, I =< 20 ->
     check_cmd_options(T, Pid, State, [H|PortOpts], OtherOpts);
+check_cmd_options([{tags, [_|_]=L}|T], Pid, State, PortOpts, OtherOpts) ->
+    check_cmd_options(T, Pid, State, [{tags, [tag_name(I) || I <- L]}|PortOpts], OtherOpts);
+check_cmd_options([setsid=H|T], Pid, State, PortOpts, OtherOpts) ->
+    check_cmd_options(T, Pid, State, [H|PortOpts], OtherOpts);
+check_cmd_options([{cpu_affinity, [_|_]=L}=H|T], Pid, State, PortOpts, OtherOpts) ->
+    [throw({error, ?FMT("Invalid cpu_affinity CPU: ~p", [C])})
+        || C <- L, not is_integer(C) orelse C < 0],
+    check_cmd_options(T, Pid, State, [H|PortOpts], OtherOpts);
+check_cmd_options([{numa_node, I}=H|T], Pid, State, PortOpts, OtherOpts) when is_integer(I), I >= 0 ->
+    check_cmd_options(T, Pid, State, [H|PortOpts], OtherOpts);
+check_cmd_options([{ioprio, C, I}=H|T], Pid, State, PortOpts, OtherOpts)
+        when (C =:= realtime orelse C =:= best_effort orelse C =:= idle),
+             is_integer(I), I >= 0, I =< 7 ->
+    check_cmd_options(T, Pid, State, [H|PortOpts], OtherOpts);
+check_cmd_options([{sched_policy, P}=H|T], Pid, State, PortOpts, OtherOpts)
+        when P =:= other; P =:= batch; P =:= idle ->
+    check_cmd_options(T, Pid, State, [H|PortOpts], OtherOpts);
+check_cmd_options([{sched_policy, P, I}=H|T], Pid, State, PortOpts, OtherOpts)
+        when (P =:= fifo orelse P =:= rr), is_integer(I), I >= 1, I =< 99 ->
+    check_cmd_options(T, Pid, State, [H|PortOpts], OtherOpts);
+check_cmd_options([{perf_counters, L}=H|T], Pid, State, PortOpts, OtherOpts) when is_list(L) ->
+    Events = [cycles, instructions, cache_references, cache_misses, branches,
+              branch_misses, task_clock, page_faults, context_switches, cpu_migrations],
+    case [E || E <- L, not lists:member(E, Events)] of
+    []  -> check_cmd_options(T, Pid, State, [H|PortOpts], OtherOpts);
+    Bad -> throw({error, ?FMT("Invalid perf_counters events: ~p", [Bad])})
+    end;
+check_cmd_options([sync=H|T], Pid, State, PortOpts, OtherOpts) ->
+    check_cmd_options(T, Pid, State, [H|PortOpts], OtherOpts);
+check_cmd_options([{sync, I}=H|T], Pid, State, PortOpts, OtherOpts) when is_integer(I), I > 0 ->
+    check_cmd_options(T, Pid, State, [H|PortOpts], OtherOpts);
+check_cmd_options([{output_rate, I}=H|T], Pid, State, PortOpts, OtherOpts) when is_integer(I), I > 0 ->
+    check_cmd_options(T, Pid, State, [H|PortOpts], OtherOpts);
+check_cmd_options([{priority, I}=H|T], Pid, State, PortOpts, OtherOpts) when is_integer(I) ->
+    check_cmd_options(T, Pid, State, [H|PortOpts], OtherOpts);
+check_cmd_options([{job_class, C, I}=H|T], Pid, State, PortOpts, OtherOpts)
+        when is_atom(C), is_integer(I), I > 0 ->
+    check_cmd_options(T, Pid, State, [H|PortOpts], OtherOpts);
+check_cmd_options([{queue_timeout, I}=H|T], Pid, State, PortOpts, OtherOpts)
+        when I =:= infinity; is_integer(I), I > 0 ->
+    check_cmd_options(T, Pid, State, [H|PortOpts], OtherOpts);
+check_cmd_options([{timeout, I}=H|T], Pid, State, PortOpts, OtherOpts) when is_integer(I), I > 0 ->
+    check_cmd_options(T, Pid, State, [H|PortOpts], OtherOpts);
+check_cmd_options([{cpu_limit, I}=H|T], Pid, State, PortOpts, OtherOpts) when is_integer(I), I > 0 ->
+    check_cmd_options(T, Pid, State, [H|PortOpts], OtherOpts);
+check_cmd_options([{cgroup, L}|T], Pid, State, PortOpts, OtherOpts) when is_list(L) ->
+    Opts = [case O of
+            {name, N} when is_atom(N) -> {name, atom_to_list(N)};
+            {name, [_|_]}             -> O;
+            {io_max, [_|_]}           -> O;
+            {cpu_max, Q, P} when is_integer(Q), Q > 0, is_integer(P), P > 0 -> O;
+            {K, I} when (K =:= cpu_weight orelse K =:= memory_max orelse K =:= pids_max),
+                        is_integer(I), I > 0 -> O;
+            _ -> throw({error, ?FMT("Invalid cgroup option: ~p", [O])})
+            end || O <- L],
+    check_cmd_options(T, Pid, State, [{cgroup, Opts}|PortOpts], OtherOpts);
+check_cmd_options([{restart, P, Max, Within, Backoff}=H|T], Pid, State, PortOpts, OtherOpts)
+        when (P =:= permanent orelse P =:= transient), is_integer(Max), Max > 0,
+             is_integer(Within), Within > 0, is_integer(Backoff), Backoff >= 0 ->
+    check_cmd_options(T, Pid, State, [H|PortOpts], OtherOpts);
+check_cmd_options([msg=H|T], Pid, State, PortOpts, OtherOpts) ->
+    check_cmd_options(T, Pid, State, [H|PortOpts], OtherOpts);
+check_cmd_options([{msg, I}=H|T], Pid, State, PortOpts, OtherOpts) when is_integer(I), I > 2 ->
+    check_cmd_options(T, Pid, State, [H|PortOpts], OtherOpts);
+check_cmd_options([{max_output, I, A}=H|T], Pid, State, PortOpts, OtherOpts)
+        when is_integer(I), I > 0, (A=:=truncate orelse A=:=drop orelse A=:=kill) ->
+    check_cmd_options(T, Pid, State, [H|PortOpts], OtherOpts);
 check_cmd_options([H|T], Pid, State, PortOpts, OtherOpts) when H=:=stdin; H=:=stdout; H=:=stderr ->
     check_cmd_options(T, Pid, State, [H|PortOpts], [{H, Pid}|OtherOpts]);
 check_cmd_options([{stdin, I}=H|T], Pid, State, PortOpts, OtherOpts)
         when I=:=null; I=:=close; is_list(I) ->
     check_cmd_options(T, Pid, State, [H|PortOpts], OtherOpts);
+check_cmd_options([{Std, {tee, File, Sink}}=H|T], Pid, State, PortOpts, OtherOpts)
+        when Std=:=stderr; Std=:=stdout ->
+    case File of
+    [_|_]                              -> ok;
+    {append, F} when is_list(F), F=/=[] -> ok;
+    _ -> throw({error, ?FMT("Invalid ~w option ~p: bad file", [Std, H])})
+    end,
+    case Sink of
+    erlang ->
+        check_cmd_options(T, Pid, State, [H|PortOpts], [{Std, Pid}|OtherOpts]);
+    {tail, N} when is_integer(N), N > 0, N =< 1048576 ->
+        check_cmd_options(T, Pid, State, [H|PortOpts], OtherOpts);
+    _ ->
+        throw({error, ?FMT("Invalid ~w option ~p: expected erlang or {tail, Bytes} sink", [Std, H])})
+    end;
+check_cmd_options([{Std, {rotate, File, Opts}}=H|T], Pid, State, PortOpts, OtherOpts)
+        when (Std=:=stderr orelse Std=:=stdout), is_list(File), File=/=[], is_list(Opts) ->
+    [throw({error, ?FMT("Invalid ~w rotate option ~p", [Std, O])})
+        || O <- Opts, not is_rotate_option(O)],
+    check_cmd_options(T, Pid, State, [H|PortOpts], OtherOpts);
+check_cmd_options([{Std, {spool, File}}|T], Pid, State, PortOpts, OtherOpts)
+        when Std=:=stderr; Std=:=stdout ->
+    check_cmd_options([{Std, {spool, File, []}}|T], Pid, State, PortOpts, OtherOpts);
+check_cmd_options([{Std, {spool, File, Opts}}=H|T], Pid, State, PortOpts, OtherOpts)
+        when (Std=:=stderr orelse Std=:=stdout), is_list(File), File=/=[], is_list(Opts) ->
+    [throw({error, ?FMT("Invalid ~w spool option ~p", [Std, O])})
+        || O <- Opts, not is_spool_option(O)],
+    check_cmd_options(T, Pid, State, [H|PortOpts], OtherOpts);
+check_cmd_options([{Std, [T1|_]=Opts}|T], Pid, State, PortOpts, OtherOpts)
+        when (Std=:=stderr orelse Std=:=stdout), is_tuple(T1) ->
+    check_cmd_options([{Std, Pid, Opts}|T], Pid, State, PortOpts, OtherOpts);
+check_cmd_options([{Std, I, Opts}|T], Pid, State, PortOpts, OtherOpts)
+        when (Std=:=stderr orelse Std=:=stdout), is_list(Opts) ->
+    Dev = if
+          I=:=print      -> fun print/3;
+          is_pid(I)      -> I;
+          is_function(I) ->
+            {arity, 3} =:= erlang:fun_info(I, arity)
+                orelse throw({error, ?FMT("Invalid ~w option ~p: expected Fun/3", [Std, I])}),
+            I;
+          true ->
+            throw({error, ?FMT("Invalid ~w device ~p: stream options require a pid, fun or print",
+                               [Std, I])})
+          end,
+    StreamOpts = [check_stream_option(Std, O) || O <- Opts],
+    check_cmd_options(T, Pid, State, [{Std, StreamOpts} | PortOpts], [{Std, Dev} | OtherOpts]);
 check_cmd_options([{Std, I}=H|T], Pid, State, PortOpts, OtherOpts)
         when Std=:=stderr, I=/=Std; Std=:=stdout, I=/=Std ->
     if
         I=:=null; I=:=close; I=:=stderr; I=:=stdout; is_list(I); 
         is_tuple(I), size(I)=:=2, element(1,I)=:=append, is_list(element(2,I)) ->
             check_cmd_options(T, Pid, State, [H|PortOpts], OtherOpts);
+        is_tuple(I), size(I)=:=2, element(1,I)=:=tail, is_integer(element(2,I)),
+        element(2,I) > 0, element(2,I) =< 1048576 ->
+            check_cmd_options(T, Pid, State, [H|PortOpts], OtherOpts);
         I=:=print ->
             check_cmd_options(T, Pid, State, [Std | PortOpts], [{Std, fun print/3} | OtherOpts]);
         is_pid(I) ->
@@ -798,6 +1579,53 @@ check_cmd_options([Other|_], _Pid, _State, _PortOpts, _OtherOpts) ->
 check_cmd_options([], _Pid, _State, PortOpts, OtherOpts) ->
     {PortOpts, OtherOpts}.
     
+check_stream_option(_Std, {framing, line} = O) ->
+    O;
+check_stream_option(_Std, {framing, {delimiter, B}} = O) when is_integer(B), B >= 0, B =< 255 ->
+    O;
+check_stream_option(_Std, {framing, {packet, N}} = O) when N =:= 1; N =:= 2; N =:= 4 ->
+    O;
+check_stream_option(_Std, {max_record, N} = O) when is_integer(N), N > 0, N =< 60000 ->
+    O;
+check_stream_option(_Std, {compress, N} = O) when is_integer(N), N >= 0, N =< 9 ->
+    O;
+check_stream_option(_Std, {compress_flush, N} = O) when is_integer(N), N > 0, N =< 16777216 ->
+    O;
+check_stream_option(Std, {Filter, Patterns} = O) when (Filter =:= include orelse Filter =:= exclude),
+                                                      is_list(Patterns) ->
+    % The port program expects patterns as binaries
+    try
+        {Filter, [unicode:characters_to_binary(P) || P <- Patterns]}
+    catch _:_ ->
+        throw({error, ?FMT("Invalid ~w stream option ~p", [Std, O])})
+    end;
+check_stream_option(Std, Other) ->
+    throw({error, ?FMT("Invalid ~w stream option ~p", [Std, Other])}).
+
+is_rotate_option({K, V}) when (K=:=size orelse K=:=time orelse K=:=count),
+                             is_integer(V), V >= 0 -> true;
+is_rotate_option({buffer, V}) when is_integer(V), V > 0, V =< 16777216 -> true;
+is_rotate_option(_) -> false.
+
+is_spool_option({progress, V}) when is_integer(V), V >= 0 -> true;
+is_spool_option({buffer, V}) when is_integer(V), V > 0, V =< 16777216 -> true;
+is_spool_option(_) -> false.
+
+%% Tags are passed to the port program as strings
+tag_name(Tag) when is_atom(Tag) ->
+    atom_to_list(Tag);
+tag_name([_|_] = Tag) ->
+    case io_lib:printable_list(Tag) of
+    true  -> Tag;
+    false -> throw({error, ?FMT("Invalid tag: ~p", [Tag])})
+    end;
+tag_name(Tag) ->
+    throw({error, ?FMT("Invalid tag: ~p", [Tag])}).
+
+%% Format a list of CPUs as the "-port_cpu_affinity" argument, e.g. "0,1,4"
+cpu_list([_|_] = Cpus) ->
+    string:join([integer_to_list(C) || C <- Cpus, is_integer(C), C >= 0], ",").
+
 next_trans(I) when I =< 134217727 ->
     I+1;
 next_trans(_) ->
@@ -805,3 +1633,104 @@ next_trans(_) ->
 
 print(Stream, OsPid, Data) ->
     io:format("Got ~w from ~w: ~p\n", [Stream, OsPid, Data]).
+
+%%%---------------------------------------------------------------------
+%%% Unit tests
+%%%---------------------------------------------------------------------
+
+-ifdef(TEST).
+
+-include_lib("eunit/include/eunit.hrl").
+
+transaction_test_() ->
+    {setup,
+        fun() -> {ok, Pid} = exec:start([]), Pid end,
+        fun(Pid) ->
+            Ref = monitor(process, Pid),
+            exit(Pid, kill),
+            receive {'DOWN', Ref, _, _, _} -> ok end
+        end,
+        [?_test(test_sync_overlap()),
+         ?_test(test_queued_overlap()),
+         ?_test(test_pool_call_overlap()),
+         ?_test(test_msg()),
+         ?_test(test_msg_malformed()),
+         ?_test(test_msg_new_atom())]}.
+
+%% The reply to a sync run comes after the one to a later async run
+test_sync_overlap() ->
+    Self = self(),
+    spawn_link(fun() ->
+        Self ! {sync, exec:run("sleep 1; echo a", [sync, stdout])}
+    end),
+    timer:sleep(200),
+    {ok, Pid, OsPid} = exec:run("true", []),
+    ?assert(is_pid(Pid) andalso is_integer(OsPid)),
+    receive
+    {sync, Reply} -> ?assertEqual({ok, 0, <<"a\n">>, <<>>}, Reply)
+    after 5000    -> ?assert(false)
+    end.
+
+%% The reply to a run queued by admission control comes when it's started
+test_queued_overlap() ->
+    Self = self(),
+    Class = {job_class, test_queued_overlap, 1},
+    {ok, _, _} = exec:run("sleep 1", [Class]),
+    spawn_link(fun() -> Self ! {queued, exec:run("true", [Class])} end),
+    timer:sleep(200),
+    {ok, Pid, OsPid} = exec:run("true", []),
+    ?assert(is_pid(Pid) andalso is_integer(OsPid)),
+    receive
+    {queued, Reply} -> ?assertMatch({ok, _, _}, Reply)
+    after 5000      -> ?assert(false)
+    end.
+
+%% The reply to a pool call comes when a worker responds
+test_pool_call_overlap() ->
+    Self = self(),
+    ok = exec:start_pool(test_pool_call_overlap, "sleep 1; exec cat", 1, []),
+    spawn_link(fun() ->
+        Self ! {call, exec:call(test_pool_call_overlap, <<"a">>)}
+    end),
+    timer:sleep(200),
+    {ok, Pid, OsPid} = exec:run("true", []),
+    ?assert(is_pid(Pid) andalso is_integer(OsPid)),
+    receive
+    {call, Reply} -> ?assertEqual({ok, <<"a">>}, Reply)
+    after 5000    -> ?assert(false)
+    end,
+    ?assertEqual(ok, exec:stop_pool(test_pool_call_overlap)).
+
+%% A shell command writing a {msg, 3} channel message with the Term bytes
+msg_cmd(Term) ->
+    Data = <<(byte_size(Term)):32, Term/binary>>,
+    "printf '" ++ lists:flatten([io_lib:format("\\~3.8.0b", [B]) || <<B>> <= Data]) ++ "' >&3".
+
+test_msg() ->
+    {ok, _, OsPid} = exec:run(msg_cmd(term_to_binary({a, [1, <<"b">>]})), [msg]),
+    receive
+    {msg, OsPid, Term} -> ?assertEqual({a, [1, <<"b">>]}, Term)
+    after 5000         -> ?assert(false)
+    end.
+
+%% A float whose text isn't a number passes the checks of the port program
+test_msg_malformed() ->
+    Float = list_to_binary(string:left("abc", 31, 0)),
+    {ok, _, OsPid} = exec:run(msg_cmd(<<131, 99, Float/binary>>), [msg]),
+    receive
+    {exit_info, OsPid, Info} -> ?assertMatch([{msg_error, _}], Info)
+    after 5000               -> ?assert(false)
+    end,
+    ?assert(is_process_alive(whereis(exec))).
+
+test_msg_new_atom() ->
+    Name = "exec_test_msg_new_atom_" ++ integer_to_list(erlang:phash2(make_ref())),
+    Atom = <<131, 100, (length(Name)):16, (list_to_binary(Name))/binary>>,
+    {ok, _, OsPid} = exec:run(msg_cmd(Atom), [msg]),
+    receive
+    {exit_info, OsPid, Info} -> ?assertMatch([{msg_error, _}], Info)
+    after 5000               -> ?assert(false)
+    end,
+    ?assertError(badarg, list_to_existing_atom(Name)).
+
+-endif.
@@ -0,0 +1,451 @@
+%%%------------------------------------------------------------------------
+%%% File: $Id$
+%%%------------------------------------------------------------------------
+%%% @doc Benchmark scenarios for the `exec' application.
+%%%      The module measures the cost of running OS commands through
+%%%      `exec' and compares it with the built-in `erlang:open_port/2'
+%%%      and `os:cmd/1' facilities.  Every scenario is driven by a fixed
+%%%      set of parameters, so that the results of two runs on the same
+%%%      host can be compared to detect performance regressions.
+%%%
+%%%      Scenarios:
+%%%      <dl>
+%%%      <dt>spawn_storm</dt>
+%%%          <dd>Run `{count, N}' short-lived commands from
+%%%              `{concurrency, C}' Erlang processes. Latency is measured
+%%%              from the spawn request until the exit notification.</dd>
+%%%      <dt>chatty</dt>
+%%%          <dd>Run `{children, K}' commands concurrently, each printing
+%%%              `{lines, L}' short lines to stdout with a separate write
+%%%              per line.</dd>
+%%%      <dt>bulk_stdin</dt>
+%%%          <dd>Push `{bytes, B}' bytes to a child's stdin in chunks of
+%%%              `{chunk, Sz}' bytes. Latency is measured per chunk.</dd>
+%%%      <dt>bulk_stdout</dt>
+%%%          <dd>Read `{bytes, B}' bytes from a child's stdout.</dd>
+%%%      <dt>mass_stop</dt>
+%%%          <dd>Start `{count, N}' sleeping commands and stop all of them
+%%%              at once. Latency is measured from the beginning of the
+%%%              stop burst until every exit notification arrives.</dd>
+%%%      </dl>
+%%%
+%%%      The soak/1 function ramps the number of concurrent children
+%%%      managed by `exec-port' and records its CPU utilization, RSS and
+%%%      event latencies at every level.  The children are instances of
+%%%      the bundled `exec-loadgen' program.
+%%%
+%%%      Example:
+%%%      ```
+%%%      $ make bench
+%%%      $ erl -pa ebin -noshell -eval "exec_bench:run([spawn_storm], [{count, 5000}]), halt()."
+%%%      $ erl -pa ebin -noshell -eval "exec_bench:soak([{levels, [1000, 10000, 30000]}]), halt()."
+%%%      '''
+%%% @author Serge Aleynikov <saleyn@gmail.com>
+%%% @version {@vsn}
+%%% @end
+%%%------------------------------------------------------------------------
+-module(exec_bench).
+-author('saleyn@gmail.com').
+
+%% External exports
+-export([run/0, run/1, run/2, scenarios/0, soak/0, soak/1]).
+
+%% Internal exports
+-export([proc_cpu_us/1, proc_rss_kb/1]).
+
+-include("exec.hrl").
+
+-record(result, {
+    scenario,
+    backend,
+    ops     = 0,                % Number of completed operations
+    bytes   = 0,                % Number of bytes transferred
+    time    = 0,                % Wall clock time of the scenario in microseconds
+    lat     = []                % Latencies of individual operations in microseconds
+}).
+
+-type scenario()  :: spawn_storm | chatty | bulk_stdin | bulk_stdout | mass_stop.
+-type backend()   :: exec | open_port | os_cmd.
+-type option()    ::
+      {backends,    [backend()]}
+    | {exec_options, list()}
+    | {count,       pos_integer()}
+    | {concurrency, pos_integer()}
+    | {children,    pos_integer()}
+    | {lines,       pos_integer()}
+    | {bytes,       pos_integer()}
+    | {chunk,       pos_integer()}
+    | {iterations,  pos_integer()}
+    | {levels,      [non_neg_integer()]}
+    | {probes,      non_neg_integer()}
+    | {settle,      non_neg_integer()}
+    | {window,      pos_integer()}
+    | {child_rate,  non_neg_integer()}
+    | {line_size,   pos_integer()}
+    | {child_output, null | erlang}
+    | {loadgen,     string()}
+    | quiet.
+
+%%-------------------------------------------------------------------------
+%% @doc List of all available benchmark scenarios.
+%% @end
+%%-------------------------------------------------------------------------
+-spec scenarios() -> [scenario()].
+scenarios() ->
+    [spawn_storm, chatty, bulk_stdin, bulk_stdout, mass_stop].
+
+%%-------------------------------------------------------------------------
+%% @equiv run(scenarios())
+%%-------------------------------------------------------------------------
+run() ->
+    run(scenarios()).
+
+%%-------------------------------------------------------------------------
+%% @equiv run(Scenarios, [])
+%%-------------------------------------------------------------------------
+run(Scenarios) ->
+    run(Scenarios, []).
+
+%%-------------------------------------------------------------------------
+%% @doc Run given benchmark `Scenarios' against every backend listed in
+%%      the `{backends, List}' option (default: `[exec, open_port, os_cmd]').
+%%      Scenarios that are not applicable to a backend are skipped.
+%%      The `exec' server is started with `{exec_options, Opts}' unless
+%%      it's already running.  A report table is printed unless the `quiet'
+%%      option is given. The function returns the list of results, one
+%%      property list per scenario/backend pair.
+%% @end
+%%-------------------------------------------------------------------------
+-spec run([scenario()], [option()]) -> [[{atom(), any()}]].
+run(Scenarios, Options) when is_list(Scenarios), is_list(Options) ->
+    ok       = ensure_started(Options),
+    Backends = param(backends, Options),
+    Results  = [R || S <- Scenarios, B <- Backends, R <- [scenario(S, B, Options)], R =/= skip],
+    proplists:get_bool(quiet, Options) orelse report(Results),
+    [summary(R) || R <- Results].
+
+%%-------------------------------------------------------------------------
+%% @equiv soak([])
+%%-------------------------------------------------------------------------
+soak() ->
+    soak([]).
+
+%%-------------------------------------------------------------------------
+%% @doc Ramp the number of concurrent children managed by a single
+%%      `exec-port' through the `{levels, [N]}' list.  Every background
+%%      child is an `exec-loadgen' printing `{child_rate, R}' lines of
+%%      `{line_size, Sz}' bytes per second either to `/dev/null' or
+%%      to Erlang (`{child_output, null | erlang}').  After ramping up
+%%      to a level and waiting `{settle, Ms}', the port's CPU utilization
+%%      and RSS are sampled over a `{window, Ms}' period, during which
+%%      `{probes, P}' echoing children measure the stdin-to-stdout round
+%%      trip latency and short-lived children measure the spawn-to-exit
+%%      latency.  Failed spawns (e.g. due to file descriptor exhaustion)
+%%      are counted rather than aborting the test.  Returns one property
+%%      list per level.
+%% @end
+%%-------------------------------------------------------------------------
+-spec soak([option()]) -> [[{atom(), any()}]].
+soak(Options) when is_list(Options) ->
+    ok     = ensure_started(Options),
+    Exe    = param(loadgen, Options),
+    PortId = port_ospid(),
+    Probes = [begin
+                {ok, _, I} = exec:run(Exe ++ " -echo -lifetime 86400000", [stdin, stdout]),
+                I
+              end || _ <- lists:seq(1, param(probes, Options))],
+    {Results, Kids} =
+        lists:foldl(fun(N, {Acc, Kids0}) ->
+            {Kids1, Errors} = spawn_children(N - length(Kids0), Exe, Options, Kids0, 0),
+            timer:sleep(param(settle, Options)),
+            R = soak_sample(PortId, Probes, Exe, Options),
+            {[[{children, length(Kids1)}, {spawn_errors, Errors} | R] | Acc], Kids1}
+        end, {[], []}, param(levels, Options)),
+    [exec:stop(I) || I <- Kids ++ Probes],
+    Res = lists:reverse(Results),
+    proplists:get_bool(quiet, Options) orelse soak_report(Res),
+    Res.
+
+%%%---------------------------------------------------------------------
+%%% Scenarios
+%%%---------------------------------------------------------------------
+
+scenario(spawn_storm, Backend, Options) ->
+    N = param(count, Options),
+    {Time, Lats, _} = parallel(param(concurrency, Options), N,
+                               fun() -> run_output(Backend, "true") end),
+    #result{scenario=spawn_storm, backend=Backend, ops=N, time=Time, lat=Lats};
+
+scenario(chatty, Backend, Options) ->
+    K   = param(children, Options),
+    Cmd = ?FMT("i=0; while [ $i -lt ~w ]; do echo \"chatty line $i\"; i=$((i+1)); done",
+               [param(lines, Options)]),
+    {Time, Lats, Bytes} = parallel(K, K, fun() -> run_output(Backend, Cmd) end),
+    #result{scenario=chatty, backend=Backend, ops=K, bytes=Bytes, time=Time, lat=Lats};
+
+scenario(bulk_stdout, Backend, Options) ->
+    N   = param(iterations, Options),
+    Cmd = ?FMT("head -c ~w /dev/zero", [param(bytes, Options)]),
+    {Time, Lats, Bytes} = parallel(1, N, fun() -> run_output(Backend, Cmd) end),
+    #result{scenario=bulk_stdout, backend=Backend, ops=N, bytes=Bytes, time=Time, lat=Lats};
+
+scenario(bulk_stdin, os_cmd, _Options) ->
+    skip;
+scenario(bulk_stdin, Backend, Options) ->
+    Bytes = param(bytes, Options),
+    Chunk = param(chunk, Options),
+    T0    = os:timestamp(),
+    Lats  = run_input(Backend, Bytes, Chunk),
+    #result{scenario=bulk_stdin, backend=Backend, ops=length(Lats), bytes=Bytes,
+            time=timer:now_diff(os:timestamp(), T0), lat=Lats};
+
+scenario(mass_stop, exec, Options) ->
+    N  = param(count, Options),
+    Ps = [begin {ok, P, I} = exec:run("sleep 1000", [monitor]), {P, I} end
+          || _ <- lists:seq(1, N)],
+    T0 = os:timestamp(),
+    [exec:stop(I) || {_, I} <- Ps],
+    Lats = wait_down(N, T0, []),
+    #result{scenario=mass_stop, backend=exec, ops=N,
+            time=timer:now_diff(os:timestamp(), T0), lat=Lats};
+scenario(mass_stop, _Backend, _Options) ->
+    % Neither open_port/2 nor os:cmd/1 are able to terminate a child
+    skip.
+
+%%%---------------------------------------------------------------------
+%%% Internal functions
+%%%---------------------------------------------------------------------
+
+%% Run Cmd to completion and return the number of stdout bytes received.
+run_output(exec, Cmd) ->
+    {ok, Pid, OsPid} = exec:run(Cmd, [stdout, monitor]),
+    exec_output(Pid, OsPid, 0);
+run_output(open_port, Cmd) ->
+    port_output(open_port({spawn, Cmd}, [binary, exit_status]), 0);
+run_output(os_cmd, Cmd) ->
+    length(os:cmd(Cmd)).
+
+exec_output(Pid, OsPid, Bytes) ->
+    receive
+    {stdout, OsPid, Data} ->
+        exec_output(Pid, OsPid, Bytes + byte_size(Data));
+    {'DOWN', _Ref, process, Pid, _Reason} ->
+        Bytes
+    end.
+
+port_output(Port, Bytes) ->
+    receive
+    {Port, {data, Data}} ->
+        port_output(Port, Bytes + byte_size(Data));
+    {Port, {exit_status, _}} ->
+        Bytes
+    end.
+
+%% Feed Bytes to the stdin of a child in chunks and wait for it to exit.
+%% Return the list of per-chunk latencies.
+run_input(exec, Bytes, Chunk) ->
+    {ok, Pid, OsPid} = exec:run(?FMT("head -c ~w > /dev/null", [Bytes]), [stdin, monitor]),
+    Data = binary:copy(<<"x">>, Chunk),
+    Lats = [element(1, timed(fun() -> exec:send(OsPid, binary:part(Data, 0, N)) end))
+            || N <- chunks(Bytes, Chunk)],
+    receive {'DOWN', _Ref, process, Pid, _Reason} -> Lats end;
+run_input(open_port, Bytes, Chunk) ->
+    Port = open_port({spawn, ?FMT("head -c ~w > /dev/null", [Bytes])}, [binary, exit_status]),
+    Data = binary:copy(<<"x">>, Chunk),
+    Lats = [element(1, timed(fun() -> erlang:port_command(Port, binary:part(Data, 0, N)) end))
+            || N <- chunks(Bytes, Chunk)],
+    port_output(Port, 0),
+    Lats.
+
+chunks(Bytes, Chunk) when Bytes > Chunk ->
+    [Chunk | chunks(Bytes - Chunk, Chunk)];
+chunks(Bytes, _Chunk) ->
+    [Bytes].
+
+wait_down(0, _T0, Acc) ->
+    lists:reverse(Acc);
+wait_down(N, T0, Acc) ->
+    receive
+    {'DOWN', _Ref, process, _Pid, _Reason} ->
+        wait_down(N-1, T0, [timer:now_diff(os:timestamp(), T0) | Acc])
+    end.
+
+%% Execute Count calls of Fun from Workers concurrent processes.
+%% Fun() must return the number of bytes it transferred.
+%% Returns {WallTimeUs, Latencies, TotalBytes}.
+parallel(Workers, Count, Fun) ->
+    Self = self(),
+    T0   = os:timestamp(),
+    Pids = [spawn_link(fun() -> Self ! {self(), [timed(Fun) || _ <- lists:seq(1, N)]} end)
+            || N <- split(Count, Workers)],
+    Res  = lists:append([receive {P, L} -> L end || P <- Pids]),
+    Time = timer:now_diff(os:timestamp(), T0),
+    {Time, [Us || {Us, _} <- Res], lists:sum([B || {_, B} <- Res, is_integer(B)])}.
+
+split(Count, Workers) ->
+    [Count div Workers + if I =< Count rem Workers -> 1; true -> 0 end
+     || I <- lists:seq(1, Workers)].
+
+timed(Fun) ->
+    T0  = os:timestamp(),
+    Res = Fun(),
+    {timer:now_diff(os:timestamp(), T0), Res}.
+
+summary(#result{scenario=S, backend=B, ops=N, bytes=Bytes, time=T, lat=Lats}) ->
+    Sorted = lists:sort(Lats),
+    Secs   = max(T, 1) / 1000000,
+    [{scenario, S}, {backend, B}, {ops, N}, {bytes, Bytes}, {time_us, T},
+     {ops_per_sec, N / Secs}, {mb_per_sec, Bytes / Secs / 1048576},
+     {p50, percentile(50, Sorted)}, {p90, percentile(90, Sorted)},
+     {p99, percentile(99, Sorted)}, {max, percentile(100, Sorted)}].
+
+percentile(_P, []) ->
+    0;
+percentile(P, Sorted) ->
+    lists:nth(max(1, (P * length(Sorted) + 99) div 100), Sorted).
+
+report(Results) ->
+    io:format("~-12s ~-10s ~8s ~10s ~10s ~9s ~9s ~9s ~9s ~9s\n",
+        ["Scenario", "Backend", "Ops", "Time(ms)", "Ops/s", "MB/s",
+         "p50(us)", "p90(us)", "p99(us)", "max(us)"]),
+    [begin
+        P = summary(R),
+        V = fun(K) -> proplists:get_value(K, P) end,
+        io:format("~-12w ~-10w ~8w ~10.1f ~10.1f ~9.2f ~9w ~9w ~9w ~9w\n",
+            [V(scenario), V(backend), V(ops), V(time_us) / 1000, V(ops_per_sec),
+             V(mb_per_sec), V(p50), V(p90), V(p99), V(max)])
+     end || R <- Results],
+    ok.
+
+spawn_children(K, _Exe, _Options, Acc, Errors) when K =< 0 ->
+    {Acc, Errors};
+spawn_children(K, Exe, Options, Acc, Errors) ->
+    Cmd  = ?FMT("~s -rate ~w -size ~w -lifetime 86400000",
+                [Exe, param(child_rate, Options), param(line_size, Options)]),
+    Opts = case param(child_output, Options) of
+           null   -> [{stdout, null}, {stderr, null}];
+           erlang -> [{stdout, fun(_, _, _) -> ok end}, {stderr, null}]
+           end,
+    case exec:run(Cmd, Opts) of
+    {ok, _Pid, OsPid} -> spawn_children(K-1, Exe, Options, [OsPid | Acc], Errors);
+    {error, _}        -> spawn_children(K-1, Exe, Options, Acc, Errors+1)
+    end.
+
+%% Sample port's CPU and RSS over the measurement window while measuring
+%% echo and spawn latencies.
+soak_sample(PortId, Probes, Exe, Options) ->
+    Window = param(window, Options) * 1000,
+    T0     = os:timestamp(),
+    Cpu0   = proc_cpu_us(PortId),
+    {Echo, Spawn, Lost} = soak_probe(Probes, Exe, T0, Window, [], [], 0),
+    Time   = timer:now_diff(os:timestamp(), T0),
+    Cpu    = (proc_cpu_us(PortId) - Cpu0) / Time * 100,
+    E      = lists:sort(Echo),
+    S      = lists:sort(Spawn),
+    [{cpu_pct, Cpu}, {rss_kb, proc_rss_kb(PortId)},
+     {echo_p50,  percentile(50, E)}, {echo_p99,  percentile(99, E)},
+     {spawn_p50, percentile(50, S)}, {spawn_p99, percentile(99, S)},
+     {lost, Lost}].
+
+soak_probe(Probes, Exe, T0, Window, Echo, Spawn, Lost) ->
+    case timer:now_diff(os:timestamp(), T0) < Window of
+    true ->
+        E = [echo_latency(I) || I <- Probes],
+        {S, _} = timed(fun() -> run_output(exec, Exe ++ " -lifetime 0") end),
+        soak_probe(Probes, Exe, T0, Window, [L || L <- E, is_integer(L)] ++ Echo,
+                   [S | Spawn], Lost + length([x || timeout <- E]));
+    false ->
+        {Echo, Spawn, Lost}
+    end.
+
+echo_latency(OsPid) ->
+    T0 = os:timestamp(),
+    ok = exec:send(OsPid, <<"ping\n">>),
+    receive
+    {stdout, OsPid, _} -> timer:now_diff(os:timestamp(), T0)
+    after 5000         -> timeout
+    end.
+
+soak_report(Results) ->
+    io:format("~9s ~7s ~8s ~10s ~10s ~10s ~10s ~10s ~6s\n",
+        ["Children", "Errors", "CPU(%)", "RSS(KB)", "echo50(us)", "echo99(us)",
+         "spawn50", "spawn99", "Lost"]),
+    [begin
+        V = fun(K) -> proplists:get_value(K, P) end,
+        io:format("~9w ~7w ~8.1f ~10w ~10w ~10w ~10w ~10w ~6w\n",
+            [V(children), V(spawn_errors), V(cpu_pct), V(rss_kb), V(echo_p50),
+             V(echo_p99), V(spawn_p50), V(spawn_p99), V(lost)])
+     end || P <- Results],
+    ok.
+
+%% OS pid of the exec-port program
+port_ospid() ->
+    {links, Links} = process_info(whereis(exec), links),
+    [Port | _]     = [P || P <- Links, is_port(P)],
+    {os_pid, Pid}  = erlang:port_info(Port, os_pid),
+    Pid.
+
+%% @private
+%% CPU time (user + system) consumed by an OS process in microseconds.
+proc_cpu_us(OsPid) ->
+    proc_cpu_ticks(OsPid) * 1000000 div clock_ticks().
+
+proc_cpu_ticks(OsPid) ->
+    % Fields following the "(comm) " of /proc/Pid/stat start with the state
+    % (field 3), so utime and stime (fields 14 and 15) are at 12 and 13.
+    [_, Stat] = binary:split(read_proc(OsPid, "stat"), <<") ">>),
+    Fields    = string:tokens(binary_to_list(Stat), " "),
+    list_to_integer(lists:nth(12, Fields)) + list_to_integer(lists:nth(13, Fields)).
+
+%% @private
+%% Resident set size of an OS process in kilobytes.
+proc_rss_kb(OsPid) ->
+    Lines = string:tokens(binary_to_list(read_proc(OsPid, "status")), "\n"),
+    case [L || "VmRSS:" ++ L <- Lines] of
+    [L | _] -> list_to_integer(hd(string:tokens(L, " \tkB")));
+    []      -> 0
+    end.
+
+%% Files in /proc report zero size, so they are read rather than file:read_file/1'd.
+read_proc(OsPid, File) ->
+    {ok, F}    = file:open(?FMT("/proc/~w/~s", [OsPid, File]), [read, raw, binary]),
+    {ok, Data} = file:read(F, 65536),
+    ok         = file:close(F),
+    Data.
+
+clock_ticks() ->
+    list_to_integer(hd(string:tokens(os:cmd("getconf CLK_TCK"), "\n"))).
+
+ensure_started(Options) ->
+    case whereis(exec) of
+    undefined ->
+        case exec:start(param(exec_options, Options)) of
+        {ok, _}                       -> ok;
+        {error, {already_started, _}} -> ok;
+        Error                         -> Error
+        end;
+    _ ->
+        ok
+    end.
+
+param(Key, Options) ->
+    proplists:get_value(Key, Options, default(Key)).
+
+default(backends)     -> [exec, open_port, os_cmd];
+default(exec_options) -> [];
+default(count)        -> 1000;              % Commands run by spawn_storm/mass_stop
+default(concurrency)  -> 10;                % Concurrent callers in spawn_storm
+default(children)     -> 50;                % Concurrent children in chatty
+default(lines)        -> 1000;              % Lines printed by each chatty child
+default(bytes)        -> 64*1024*1024;      % Volume of bulk_stdin/bulk_stdout
+default(chunk)        -> 64*1024;           % Write size of bulk_stdin
+default(iterations)   -> 3;                 % Repetitions of bulk_stdout
+default(levels)       -> [100, 1000, 5000, 10000, 20000];   % Soak test children counts
+default(probes)       -> 10;                % Echoing children measuring soak latency
+default(settle)       -> 2000;              % Delay before sampling a soak level (ms)
+default(window)       -> 5000;              % Soak level sampling period (ms)
+default(child_rate)   -> 1;                 % Lines/sec printed by every soak child
+default(line_size)    -> 80;                % Size of a line printed by a soak child
+default(child_output) -> null;              % Where soak children print: null | erlang
+default(loadgen)      ->
+    filename:join(filename:dirname(exec:default(portexe)), "exec-loadgen").
@@ -0,0 +1,358 @@
+%%%------------------------------------------------------------------------
+%%% File: $Id$
+%%%------------------------------------------------------------------------
+%%% @doc Replay of `exec-port' protocol captures.
+%%%      A port program started with the `{capture, File}' option of
+%%%      {@link exec:start/1} appends every packet exchanged with Erlang to
+%%%      `File'.  This module reads such a capture and drives a fresh
+%%%      instance of the port program (possibly a different build of it)
+%%%      with the same stream of commands at the original or accelerated
+%%%      pace.  Reply latencies as well as CPU and memory consumed by the
+%%%      port program are measured, so that a production workload can be
+%%%      replayed against a candidate build to detect regressions.
+%%%
+%%%      OS pids referred to by `stop', `kill' and `stdin' commands are
+%%%      remapped to the pids of the children started during the replay.
+%%%
+%%%      Format of the capture file:
+%%%      ```
+%%%      Capture = <<"EXECCAP1", Record*>>
+%%%      Record  = <<Dir:8, Time:64, Len:32, Packet:Len/binary>>
+%%%      '''
+%%%      where `Dir' is `$I' for packets sent to the port program and `$O'
+%%%      for packets sent by it, `Time' is the monotonic time in nanoseconds,
+%%%      and `Packet' is the message in the external term format.
+%%%
+%%%      Example:
+%%%      ```
+%%%      1> exec:start([{capture, "/tmp/exec.cap"}]).
+%%%      ...
+%%%      2> exec_replay:run("/tmp/exec.cap", [{speed, 10}]).
+%%%      3> exec_replay:compare("/tmp/exec.cap", "/opt/old/exec-port", "/opt/new/exec-port", []).
+%%%      '''
+%%% @author Serge Aleynikov <saleyn@gmail.com>
+%%% @version {@vsn}
+%%% @end
+%%%------------------------------------------------------------------------
+-module(exec_replay).
+-author('saleyn@gmail.com').
+
+%% External exports
+-export([read/1, run/1, run/2, compare/4]).
+
+-include("exec.hrl").
+
+-define(MAGIC, "EXECCAP1").
+
+-record(req, {
+    time,                       % Capture time of the request (ns)
+    trans,                      % Transaction id
+    instr,                      % Instruction sent to the port
+    reply,                      % Reply recorded in the capture
+    latency                     % Latency of the recorded reply (us)
+}).
+
+-record(state, {
+    port,
+    start,                      % Start time of the replay (os:timestamp())
+    base,                       % Capture time of the first request (ns)
+    speed,                      % Replay speed factor or 'max'
+    pending,                    % dict: TransId -> {SendTime, #req{}}
+    pids,                       % dict: captured OsPid -> replayed OsPid
+    lat        = [],            % [{Latency, CapturedLatency}] in microseconds
+    events     = 0,             % Number of asynchronous messages from the port
+    mismatches = 0              % Replies different from the captured ones
+}).
+
+-type capture_record() :: {in | out, Time::non_neg_integer(), Packet::term()}.
+-type option() ::
+      {speed,   number() | max}
+    | {portexe, string()}
+    | {args,    string()}
+    | {drain,   non_neg_integer()}
+    | quiet.
+
+%%-------------------------------------------------------------------------
+%% @doc Read a capture file.  A truncated last record, which is left when
+%%      the port program is killed while writing it, is ignored.
+%% @end
+%%-------------------------------------------------------------------------
+-spec read(string()) -> {ok, [capture_record()]} | {error, any()}.
+read(File) ->
+    case file:read_file(File) of
+    {ok, <<?MAGIC, Data/binary>>} -> {ok, parse(Data, [])};
+    {ok, _}                       -> {error, bad_format};
+    Error                         -> Error
+    end.
+
+%%-------------------------------------------------------------------------
+%% @equiv run(File, [])
+%%-------------------------------------------------------------------------
+run(File) ->
+    run(File, []).
+
+%%-------------------------------------------------------------------------
+%% @doc Replay commands recorded in the capture `File' against a new
+%%      instance of the port program.  Options:
+%%      <dl>
+%%      <dt>{speed, Factor}</dt>
+%%          <dd>Replay `Factor' times faster than recorded (default 1).
+%%              `max' sends every command without any delay.</dd>
+%%      <dt>{portexe, Exe}</dt>
+%%          <dd>Port program to replay against (default
+%%              `exec:default(portexe)').</dd>
+%%      <dt>{args, Args}</dt>
+%%          <dd>Extra arguments of the port program (e.g. "-user nobody").</dd>
+%%      <dt>{drain, Ms}</dt>
+%%          <dd>After the last command wait until the port is silent for
+%%              `Ms' milliseconds before stopping it (default 1000).</dd>
+%%      <dt>quiet</dt><dd>Don't print the report.</dd>
+%%      </dl>
+%%      The function returns a property list with the replayed and the
+%%      captured request latency percentiles, the CPU utilization and RSS
+%%      of the port program, and the number of replies that differ from
+%%      the captured ones.
+%% @end
+%%-------------------------------------------------------------------------
+-spec run(string(), [option()]) -> [{atom(), any()}].
+run(File, Options) when is_list(Options) ->
+    {ok, Records} = read(File),
+    Requests = requests(Records),
+    Exe      = param(portexe, Options) ++ " -n " ++ param(args, Options),
+    Port     = erlang:open_port({spawn, Exe}, [binary, exit_status, {packet, 4}, nouse_stdio, hide]),
+    {os_pid, OsPid} = erlang:port_info(Port, os_pid),
+    Cpu0     = exec_bench:proc_cpu_us(OsPid),
+    State0   = #state{port=Port, start=os:timestamp(), speed=param(speed, Options),
+                      base=base(Requests), pending=dict:new(), pids=dict:new()},
+    State1   = replay(Requests, State0),
+    State    = drain(param(drain, Options), State1),
+    Time     = timer:now_diff(os:timestamp(), State#state.start),
+    Cpu      = exec_bench:proc_cpu_us(OsPid) - Cpu0,
+    Rss      = exec_bench:proc_rss_kb(OsPid),
+    ok       = shutdown(Port),
+    {Lat, CapturedLat} = lists:unzip(State#state.lat),
+    Result   =
+        [{requests,     length(Requests)},
+         {replies,      length(Lat)},
+         {unanswered,   dict:size(State#state.pending)},
+         {mismatches,   State#state.mismatches},
+         {events,       State#state.events},
+         {time_us,      Time},
+         {cpu_pct,      Cpu * 100 / max(1, Time)},
+         {rss_kb,       Rss}]
+        ++ percentiles("",  Lat)
+        ++ [{captured_events,  length([x || {out, _, {0, _}} <- Records])},
+            {captured_time_us, captured_time(Records)}]
+        ++ percentiles("captured_", [L || L <- CapturedLat, is_integer(L)]),
+    proplists:get_bool(quiet, Options) orelse report(Result),
+    Result.
+
+%%-------------------------------------------------------------------------
+%% @doc Replay the capture `File' against the `BaseExe' and `CandidateExe'
+%%      builds of the port program and print their results side by side.
+%% @end
+%%-------------------------------------------------------------------------
+-spec compare(string(), string(), string(), [option()]) ->
+    {Base::[{atom(), any()}], Candidate::[{atom(), any()}]}.
+compare(File, BaseExe, CandidateExe, Options) ->
+    Opts = [quiet | proplists:delete(portexe, Options)],
+    Base = run(File, [{portexe, BaseExe}      | Opts]),
+    Cand = run(File, [{portexe, CandidateExe} | Opts]),
+    io:format("~-16s ~14s ~14s ~8s\n", ["Metric", "Base", "Candidate", "Ratio"]),
+    [begin
+        B = proplists:get_value(K, Base),
+        C = proplists:get_value(K, Cand),
+        R = if B == 0 -> 0.0; true -> C / B end,
+        io:format("~-16w ~14s ~14s ~8.2f\n", [K, value(B), value(C), R])
+     end || K <- [time_us, cpu_pct, rss_kb, p50, p90, p99, max, mismatches]],
+    {Base, Cand}.
+
+%%%----------------------------------------------------------------------
+%%% Internal functions
+%%%----------------------------------------------------------------------
+
+parse(<<Dir:8, Time:64, Len:32, Packet:Len/binary, Tail/binary>>, Acc) ->
+    parse(Tail, [{direction(Dir), Time, binary_to_term(Packet)} | Acc]);
+parse(_Truncated, Acc) ->
+    lists:reverse(Acc).
+
+direction($I) -> in;
+direction($O) -> out.
+
+%% Extract the list of requests sent to the port annotated with their
+%% captured replies.  Shutdown requests are skipped since the replay ends
+%% with its own shutdown.
+requests(Records) ->
+    {Reqs, _, Replies, _} =
+        lists:foldl(fun request/2, {[], dict:new(), dict:new(), 0}, Records),
+    [case dict:find(I, Replies) of
+     {ok, {Reply, T}} -> R#req{reply=Reply, latency=(T - R#req.time) div 1000};
+     error            -> R
+     end || {I, R} <- lists:reverse(Reqs)].
+
+request({in, _T, {_, {shutdown}}}, Acc) ->
+    Acc;
+request({in, T, {Trans, Instr}}, {Reqs, Pending, Replies, N}) ->
+    Pending1 = if Trans > 0 -> dict:store(Trans, N, Pending); true -> Pending end,
+    {[{N, #req{time=T, trans=Trans, instr=Instr}} | Reqs], Pending1, Replies, N+1};
+request({out, T, {Trans, Reply}}, {Reqs, Pending, Replies, N} = Acc) when Trans > 0 ->
+    case dict:find(Trans, Pending) of
+    {ok, I} -> {Reqs, dict:erase(Trans, Pending), dict:store(I, {Reply, T}, Replies), N};
+    error   -> Acc
+    end;
+request({out, _T, _Event}, Acc) ->
+    Acc.
+
+base([#req{time=T} | _]) -> T;
+base([])                 -> 0.
+
+captured_time([])      -> 0;
+captured_time(Records) ->
+    {_, T0, _} = hd(Records),
+    {_, T1, _} = lists:last(Records),
+    (T1 - T0) div 1000.
+
+replay([], State) ->
+    State;
+replay([#req{time=T} = R | Tail], #state{speed=Speed, base=Base} = State) ->
+    Due = case Speed of
+          max -> 0;
+          _   -> round((T - Base) / 1000 / Speed)
+          end,
+    replay(Tail, send_request(R, wait(Due, State))).
+
+%% Process messages from the port until `Due' microseconds since the start.
+wait(Due, #state{port=Port, start=T0} = State) ->
+    Timeout = max(0, Due - timer:now_diff(os:timestamp(), T0)) div 1000,
+    receive
+    {Port, {data, Bin}} ->
+        wait(Due, handle_message(binary_to_term(Bin), State));
+    {Port, {exit_status, Status}} ->
+        erlang:error({port_exited, Status})
+    after Timeout ->
+        State
+    end.
+
+%% Process messages from the port until it's silent for `Ms' milliseconds.
+drain(Ms, #state{port=Port} = State) ->
+    receive
+    {Port, {data, Bin}} ->
+        drain(Ms, handle_message(binary_to_term(Bin), State));
+    {Port, {exit_status, Status}} ->
+        erlang:error({port_exited, Status})
+    after Ms ->
+        State
+    end.
+
+send_request(#req{trans=Trans, instr=Instr, reply=Reply} = R, #state{port=Port} = State) ->
+    {Instr1, State1} = remap(Instr, State),
+    erlang:port_command(Port, term_to_binary({Trans, Instr1})),
+    case Reply of
+    undefined -> State1;
+    _         -> Pending = dict:store(Trans, {os:timestamp(), R}, State1#state.pending),
+                 State1#state{pending=Pending}
+    end.
+
+remap({stop, OsPid}, State) ->
+    {Pid, State1} = remap_pid(OsPid, State),
+    {{stop, Pid}, State1};
+remap({kill, OsPid, Sig}, State) ->
+    {Pid, State1} = remap_pid(OsPid, State),
+    {{kill, Pid, Sig}, State1};
+remap({stdin, OsPid, Data}, State) ->
+    {Pid, State1} = remap_pid(OsPid, State),
+    {{stdin, Pid, Data}, State1};
+remap(Instr, State) ->
+    {Instr, State}.
+
+%% If the child with a given captured pid is still being started, wait for
+%% the reply carrying its replayed pid.
+remap_pid(OsPid, #state{port=Port, pids=Pids, pending=Pending} = State) ->
+    Starting = dict:fold(fun(_, {_, #req{reply={ok, P}}}, A) -> A orelse P =:= OsPid;
+                            (_, _, A)                        -> A
+                         end, false, Pending),
+    case dict:find(OsPid, Pids) of
+    {ok, Pid} ->
+        {Pid, State};
+    error when Starting ->
+        receive
+        {Port, {data, Bin}} -> remap_pid(OsPid, handle_message(binary_to_term(Bin), State))
+        after 5000          -> {OsPid, State}
+        end;
+    error ->
+        {OsPid, State}
+    end.
+
+handle_message({0, _Event}, #state{events=N} = State) ->
+    State#state{events=N+1};
+handle_message({Trans, Reply}, #state{pending=Pending} = State) ->
+    case dict:find(Trans, Pending) of
+    {ok, {Sent, #req{reply=Captured, latency=CapturedLat}}} ->
+        Lat  = timer:now_diff(os:timestamp(), Sent),
+        Pids = case {Captured, Reply} of
+               {{ok, Old}, {ok, New}} when is_integer(Old), is_integer(New) ->
+                   dict:store(Old, New, State#state.pids);
+               _ ->
+                   State#state.pids
+               end,
+        Diff = case same_kind(Captured, Reply) of
+               true  -> 0;
+               false -> 1
+               end,
+        State#state{pending=dict:erase(Trans, Pending), pids=Pids,
+                    lat=[{Lat, CapturedLat} | State#state.lat],
+                    mismatches=State#state.mismatches + Diff};
+    error ->
+        State
+    end.
+
+same_kind(A, B) when is_tuple(A), is_tuple(B) -> element(1, A) =:= element(1, B);
+same_kind(A, B)                               -> A =:= B.
+
+shutdown(Port) ->
+    erlang:port_command(Port, term_to_binary({0, {shutdown}})),
+    receive
+    {Port, {exit_status, _}} -> flush(Port)
+    after 30000              -> catch erlang:port_close(Port), flush(Port)
+    end.
+
+flush(Port) ->
+    receive
+    {Port, _} -> flush(Port)
+    after 0   -> ok
+    end.
+
+percentiles(Prefix, Lats) ->
+    Sorted = lists:sort(Lats),
+    [{list_to_atom(Prefix ++ atom_to_list(K)), percentile(P, Sorted)}
+        || {K, P} <- [{p50, 50}, {p90, 90}, {p99, 99}, {max, 100}]].
+
+percentile(_P, []) ->
+    0;
+percentile(P, Sorted) ->
+    lists:nth(max(1, (P * length(Sorted) + 99) div 100), Sorted).
+
+report(Result) ->
+    V = fun(K) -> proplists:get_value(K, Result) end,
+    io:format("Requests: ~w, replies: ~w, unanswered: ~w, mismatches: ~w\n"
+              "CPU: ~.1f%, RSS: ~wKB\n",
+        [V(requests), V(replies), V(unanswered), V(mismatches), V(cpu_pct), V(rss_kb)]),
+    io:format("~-10s ~12s ~8s ~9s ~9s ~9s ~9s\n",
+        ["", "Time(ms)", "Events", "p50(us)", "p90(us)", "p99(us)", "max(us)"]),
+    [io:format("~-10s ~12.1f ~8w ~9w ~9w ~9w ~9w\n",
+        [Name, V(list_to_atom(P ++ "time_us")) / 1000, V(list_to_atom(P ++ "events")),
+         V(list_to_atom(P ++ "p50")), V(list_to_atom(P ++ "p90")),
+         V(list_to_atom(P ++ "p99")), V(list_to_atom(P ++ "max"))])
+     || {Name, P} <- [{"Replay", ""}, {"Captured", "captured_"}]],
+    ok.
+
+value(F) when is_float(F) -> ?FMT("~.1f", [F]);
+value(I)                  -> ?FMT("~w",   [I]).
+
+param(Key, Options) ->
+    proplists:get_value(Key, Options, default(Key)).
+
+default(speed)   -> 1;
+default(portexe) -> exec:default(portexe);
+default(args)    -> "";
+default(drain)   -> 1000.